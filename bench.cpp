@@ -0,0 +1,169 @@
+#include "dm.hpp"
+#include "dm-static.hpp"
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <vector>
+
+// Compares a virtual target chain against the same chain composed
+// statically, to show how much of a small read is dispatch overhead.
+//
+// On a small VM, reading the in-memory source, the static chain ran at
+// 0.95-1.26x the virtual one's rate, usually about 1.2x, and the erased one
+// at 1.0-1.15x. Reading a 4 MiB cached file, both were at 1.0-1.17x. Runs
+// vary by tens of percent, so compare several.
+//
+// Usage: bench [FILE [BLOCKS]]
+// Without FILE, only the in-memory source is measured. Keep BLOCKS small
+// enough to stay in cache, or memcpy and the page cache drown out dispatch.
+
+using namespace devmapper;
+using namespace std;
+
+namespace {
+
+const off_t Offset = 2048; // typical pe_start
+
+// Both in-memory sources copy through here. Inlined into a static chain, a
+// fixed-size memcpy becomes "rep movsq", which is slower here than the libc
+// call the virtual chain makes, and would be timed instead of dispatch.
+__attribute__((noinline))
+void copy(uint8_t *dst, const uint8_t *src, size_t size) {
+	memcpy(dst, src, size);
+}
+
+// Virtual in-memory source
+struct memory : public target {
+	memory(const uint8_t *data, off_t blocks) : data(data), blocks(blocks) { }
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		if (block >= blocks)
+			return 0;
+		copy(buf, data + block * BlockSize + offset, size);
+		return size;
+	}
+	
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count) {
+		if (block + off_t(count) > blocks)
+			count = block < blocks ? blocks - block : 0;
+		copy(buf, data + block * BlockSize, count * BlockSize);
+		return count * BlockSize;
+	}
+	
+private:
+	const uint8_t *data;
+	off_t blocks;
+};
+
+// Static in-memory source
+struct static_memory {
+	static_memory(const uint8_t *data, off_t blocks)
+		: data(data), blocks(blocks) { }
+	
+	int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		if (block >= blocks)
+			return 0;
+		copy(buf, data + block * BlockSize + offset, size);
+		return size;
+	}
+	
+	int read_blocks(off_t block, uint8_t *buf, size_t count) {
+		if (block + off_t(count) > blocks)
+			count = block < blocks ? blocks - block : 0;
+		copy(buf, data + block * BlockSize, count * BlockSize);
+		return count * BlockSize;
+	}
+	
+	bool allocated(off_t block, off_t& count) {
+		count = 0;
+		return true;
+	}
+	
+	bool direct(off_t block, off_t& count, int& fd, off_t& offset) {
+		count = 0;
+		return false;
+	}
+	
+private:
+	const uint8_t *data;
+	off_t blocks;
+};
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+const off_t Reads = 1 << 22;
+
+// Read an LV of 'blocks' blocks over and over, one block at a time, using
+// whatever interface T offers. Returns the best blocks per second of a few
+// passes.
+template <typename T>
+double run(T& tgt, off_t blocks, unsigned& sum) {
+	uint8_t buf[BlockSize];
+	double best = 0;
+	for (int pass = 0; pass < 5; ++pass) {
+		double start = now();
+		for (off_t i = 0; i < Reads; ++i) {
+			tgt.read(i % blocks, buf, 0, BlockSize);
+			sum += buf[i % BlockSize];
+		}
+		double rate = Reads / (now() - start);
+		if (rate > best)
+			best = rate;
+	}
+	return best;
+}
+
+// Build the usual LV shape, a table of linear segments over one PV, in both
+// styles, then time them against each other.
+template <typename Static>
+void compare(const char *name, target::ptr pv, const Static& spv,
+		off_t blocks) {
+	off_t half = blocks / 2;
+	
+	targets::table *table = new targets::table();
+	target::ptr virt(table);
+	table->add(half, target::ptr(new targets::linear(pv, Offset + half)));
+	table->add(blocks - half, target::ptr(new targets::linear(pv, Offset)));
+	
+	static_targets::segments<Static> stat(spv);
+	stat.add(half, Offset + half);
+	stat.add(blocks - half, Offset);
+	
+	unsigned sum = 0;
+	double v = run(*virt, blocks, sum), s = run(stat, blocks, sum);
+	target::ptr erased = static_targets::erase(stat);
+	double e = run(*erased, blocks, sum);
+	
+	cout << name << ": virtual " << size_t(v) << " blocks/s, static "
+		<< size_t(s) << " (" << s / v << "x), erased " << size_t(e)
+		<< " (" << e / v << "x)\n";
+	if (sum == 1) // keep the reads alive
+		cout << "\n";
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+	off_t blocks = argc > 2 ? strtoll(argv[2], NULL, 0) : 4096;
+	
+	vector<uint8_t> data((blocks + Offset) * BlockSize);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = i * 2654435761u >> 24;
+	target::ptr mem(new memory(&data[0], blocks + Offset));
+	compare("memory", mem, static_memory(&data[0], blocks + Offset), blocks);
+	
+	if (argc > 1) {
+		targets::file *file = new targets::file(argv[1]);
+		target::ptr pv(file);
+		compare("file", pv, static_targets::file(file->descriptor()), blocks);
+	}
+	return 0;
+}
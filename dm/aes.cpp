@@ -0,0 +1,334 @@
+#include "crypto.hpp"
+#include "cpu.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_INTRIN 1
+#endif
+
+namespace devmapper {
+namespace crypto {
+
+/***** Portable implementation *****/
+
+static uint8_t xtime(uint8_t x) {
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+// S-boxes and GF(2^8) multiplication tables, built at first use
+struct aes_tables {
+	uint8_t sbox[256], inv[256];
+	uint8_t mul2[256], mul3[256], mul9[256], mul11[256], mul13[256],
+		mul14[256];
+	
+	aes_tables() {
+		uint8_t exp[256], log[256];
+		uint8_t x = 1;
+		for (int i = 0; i < 255; ++i) {
+			exp[i] = x;
+			log[x] = i;
+			x ^= xtime(x); // multiply by the generator 3
+		}
+		
+		for (int i = 0; i < 256; ++i) {
+			uint8_t b = i ? exp[(255 - log[i]) % 255] : 0;
+			uint8_t s = b;
+			for (int r = 1; r <= 4; ++r)
+				s ^= (b << r) | (b >> (8 - r));
+			s ^= 0x63;
+			sbox[i] = s;
+			inv[s] = i;
+			
+			uint8_t m2 = xtime(i), m4 = xtime(m2), m8 = xtime(m4);
+			mul2[i] = m2;
+			mul3[i] = m2 ^ i;
+			mul9[i] = m8 ^ i;
+			mul11[i] = m8 ^ m2 ^ i;
+			mul13[i] = m8 ^ m4 ^ i;
+			mul14[i] = m8 ^ m4 ^ m2;
+		}
+	}
+};
+
+static const aes_tables& tab() {
+	static const aes_tables t;
+	return t;
+}
+
+static void add_key(uint8_t *s, const uint8_t *k) {
+	for (int i = 0; i < 16; ++i)
+		s[i] ^= k[i];
+}
+
+static void inv_mix(uint8_t *s) {
+	const aes_tables& t = tab();
+	for (int c = 0; c < 16; c += 4) {
+		uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+		s[c] = t.mul14[a0] ^ t.mul11[a1] ^ t.mul13[a2] ^ t.mul9[a3];
+		s[c + 1] = t.mul9[a0] ^ t.mul14[a1] ^ t.mul11[a2] ^ t.mul13[a3];
+		s[c + 2] = t.mul13[a0] ^ t.mul9[a1] ^ t.mul14[a2] ^ t.mul11[a3];
+		s[c + 3] = t.mul11[a0] ^ t.mul13[a1] ^ t.mul9[a2] ^ t.mul14[a3];
+	}
+}
+
+aes::aes(const uint8_t *key, size_t len) {
+	if (len != 16 && len != 24 && len != 32)
+		throw exception("AES key must be 128, 192 or 256 bits");
+	
+	const aes_tables& t = tab();
+	size_t nk = len / 4, words = 4 * (nk + 7);
+	m_rounds = nk + 6;
+	
+	uint8_t *w = m_enc[0], rcon = 1;
+	memcpy(w, key, len);
+	for (size_t i = nk; i < words; ++i) {
+		uint8_t tmp[4];
+		memcpy(tmp, &w[4 * (i - 1)], 4);
+		if (i % nk == 0) {
+			uint8_t b = tmp[0];
+			tmp[0] = t.sbox[tmp[1]] ^ rcon;
+			tmp[1] = t.sbox[tmp[2]];
+			tmp[2] = t.sbox[tmp[3]];
+			tmp[3] = t.sbox[b];
+			rcon = xtime(rcon);
+		} else if (nk > 6 && i % nk == 4) {
+			for (int j = 0; j < 4; ++j)
+				tmp[j] = t.sbox[tmp[j]];
+		}
+		for (int j = 0; j < 4; ++j)
+			w[4 * i + j] = w[4 * (i - nk) + j] ^ tmp[j];
+	}
+	
+	// Equivalent inverse cipher keys, as AESDEC wants them
+	memcpy(m_dec[0], m_enc[m_rounds], BlockBytes);
+	for (size_t r = 1; r < m_rounds; ++r) {
+		memcpy(m_dec[r], m_enc[m_rounds - r], BlockBytes);
+		inv_mix(m_dec[r]);
+	}
+	memcpy(m_dec[m_rounds], m_enc[0], BlockBytes);
+}
+
+aes::~aes() {
+	volatile uint8_t *p = m_enc[0];
+	for (size_t i = 0; i < sizeof(m_enc) + sizeof(m_dec); ++i)
+		p[i] = 0;
+}
+
+void aes::encrypt(const uint8_t *in, uint8_t *out) const {
+	const aes_tables& t = tab();
+	uint8_t s[16], n[16];
+	memcpy(s, in, 16);
+	add_key(s, m_enc[0]);
+	for (size_t r = 1; r <= m_rounds; ++r) {
+		// SubBytes and ShiftRows
+		for (int c = 0; c < 4; ++c)
+			for (int row = 0; row < 4; ++row)
+				n[row + 4 * c] = t.sbox[s[row + 4 * ((c + row) % 4)]];
+		if (r != m_rounds) {
+			for (int c = 0; c < 16; c += 4) {
+				uint8_t a0 = n[c], a1 = n[c + 1], a2 = n[c + 2], a3 = n[c + 3];
+				s[c] = t.mul2[a0] ^ t.mul3[a1] ^ a2 ^ a3;
+				s[c + 1] = a0 ^ t.mul2[a1] ^ t.mul3[a2] ^ a3;
+				s[c + 2] = a0 ^ a1 ^ t.mul2[a2] ^ t.mul3[a3];
+				s[c + 3] = t.mul3[a0] ^ a1 ^ a2 ^ t.mul2[a3];
+			}
+		} else {
+			memcpy(s, n, 16);
+		}
+		add_key(s, m_enc[r]);
+	}
+	memcpy(out, s, 16);
+}
+
+void aes::decrypt(const uint8_t *in, uint8_t *out) const {
+	const aes_tables& t = tab();
+	uint8_t s[16], n[16];
+	memcpy(s, in, 16);
+	add_key(s, m_enc[m_rounds]);
+	for (size_t r = m_rounds; r-- > 0; ) {
+		// InvShiftRows and InvSubBytes
+		for (int c = 0; c < 4; ++c)
+			for (int row = 0; row < 4; ++row)
+				n[row + 4 * c] = t.inv[s[row + 4 * ((c + 4 - row) % 4)]];
+		memcpy(s, n, 16);
+		add_key(s, m_enc[r]);
+		if (r)
+			inv_mix(s);
+	}
+	memcpy(out, s, 16);
+}
+
+
+/***** XTS *****/
+
+// Multiply a tweak by x in GF(2^128)
+static void xts_double(uint8_t *t) {
+	uint8_t carry = 0;
+	for (int i = 0; i < 16; ++i) {
+		uint8_t next = t[i] >> 7;
+		t[i] = (t[i] << 1) | carry;
+		carry = next;
+	}
+	if (carry)
+		t[0] ^= 0x87;
+}
+
+static void xts_iv(uint8_t *iv, uint64_t sector) {
+	memset(iv, 0, aes::BlockBytes);
+	for (int i = 0; i < 8; ++i)
+		iv[i] = sector >> (8 * i);
+}
+
+static void xts_portable(const aes& data, const aes& tweak, uint8_t *buf,
+		size_t sectors, uint64_t sector) {
+	for (size_t s = 0; s < sectors; ++s, ++sector) {
+		uint8_t t[16];
+		xts_iv(t, sector);
+		tweak.encrypt(t, t);
+		for (size_t i = 0; i < BlockSize; i += aes::BlockBytes, buf += 16) {
+			add_key(buf, t);
+			data.decrypt(buf, buf);
+			add_key(buf, t);
+			xts_double(t);
+		}
+	}
+}
+
+#ifdef HAVE_X86_INTRIN
+
+__attribute__((target("sse2")))
+static inline __m128i xts_double(__m128i t) {
+	__m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(t, 31),
+		_MM_SHUFFLE(0, 1, 0, 3));
+	carry = _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87));
+	return _mm_xor_si128(_mm_slli_epi64(t, 1), carry);
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i xts_tweak(const aes& tweak, uint64_t sector) {
+	const __m128i *k = reinterpret_cast<const __m128i*>(tweak.enc_keys());
+	size_t rounds = tweak.rounds();
+	__m128i t = _mm_set_epi64x(0, sector);
+	t = _mm_xor_si128(t, _mm_loadu_si128(k));
+	for (size_t r = 1; r < rounds; ++r)
+		t = _mm_aesenc_si128(t, _mm_loadu_si128(k + r));
+	return _mm_aesenclast_si128(t, _mm_loadu_si128(k + rounds));
+}
+
+// Four blocks at a time, to keep the AES unit's pipeline full
+__attribute__((target("aes,sse2")))
+static void xts_aesni(const aes& data, const aes& tweak, uint8_t *buf,
+		size_t sectors, uint64_t sector) {
+	__m128i k[aes::MaxRounds + 1];
+	size_t rounds = data.rounds();
+	const __m128i *dk = reinterpret_cast<const __m128i*>(data.dec_keys());
+	for (size_t r = 0; r <= rounds; ++r)
+		k[r] = _mm_loadu_si128(dk + r);
+	
+	for (size_t s = 0; s < sectors; ++s, ++sector) {
+		__m128i t = xts_tweak(tweak, sector);
+		__m128i *p = reinterpret_cast<__m128i*>(buf + s * BlockSize);
+		for (size_t i = 0; i < BlockSize / aes::BlockBytes; i += 4) {
+			__m128i t0 = t, t1 = xts_double(t0), t2 = xts_double(t1),
+				t3 = xts_double(t2);
+			t = xts_double(t3);
+			__m128i b0 = _mm_xor_si128(_mm_loadu_si128(p + i), t0);
+			__m128i b1 = _mm_xor_si128(_mm_loadu_si128(p + i + 1), t1);
+			__m128i b2 = _mm_xor_si128(_mm_loadu_si128(p + i + 2), t2);
+			__m128i b3 = _mm_xor_si128(_mm_loadu_si128(p + i + 3), t3);
+			b0 = _mm_xor_si128(b0, k[0]);
+			b1 = _mm_xor_si128(b1, k[0]);
+			b2 = _mm_xor_si128(b2, k[0]);
+			b3 = _mm_xor_si128(b3, k[0]);
+			for (size_t r = 1; r < rounds; ++r) {
+				b0 = _mm_aesdec_si128(b0, k[r]);
+				b1 = _mm_aesdec_si128(b1, k[r]);
+				b2 = _mm_aesdec_si128(b2, k[r]);
+				b3 = _mm_aesdec_si128(b3, k[r]);
+			}
+			b0 = _mm_aesdeclast_si128(b0, k[rounds]);
+			b1 = _mm_aesdeclast_si128(b1, k[rounds]);
+			b2 = _mm_aesdeclast_si128(b2, k[rounds]);
+			b3 = _mm_aesdeclast_si128(b3, k[rounds]);
+			_mm_storeu_si128(p + i, _mm_xor_si128(b0, t0));
+			_mm_storeu_si128(p + i + 1, _mm_xor_si128(b1, t1));
+			_mm_storeu_si128(p + i + 2, _mm_xor_si128(b2, t2));
+			_mm_storeu_si128(p + i + 3, _mm_xor_si128(b3, t3));
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pair(__m128i lo, __m128i hi) {
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+// Eight blocks at a time, two per 256-bit register
+__attribute__((target("vaes,avx2,aes")))
+static void xts_vaes(const aes& data, const aes& tweak, uint8_t *buf,
+		size_t sectors, uint64_t sector) {
+	__m256i k[aes::MaxRounds + 1];
+	size_t rounds = data.rounds();
+	const __m128i *dk = reinterpret_cast<const __m128i*>(data.dec_keys());
+	for (size_t r = 0; r <= rounds; ++r)
+		k[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128(dk + r));
+	
+	for (size_t s = 0; s < sectors; ++s, ++sector) {
+		__m128i t = xts_tweak(tweak, sector);
+		__m256i *p = reinterpret_cast<__m256i*>(buf + s * BlockSize);
+		for (size_t i = 0; i < BlockSize / 32; i += 4) {
+			__m128i tw[8];
+			for (int j = 0; j < 8; ++j) {
+				tw[j] = t;
+				t = xts_double(t);
+			}
+			__m256i t0 = pair(tw[0], tw[1]), t1 = pair(tw[2], tw[3]),
+				t2 = pair(tw[4], tw[5]), t3 = pair(tw[6], tw[7]);
+			__m256i b0 = _mm256_xor_si256(_mm256_loadu_si256(p + i), t0);
+			__m256i b1 = _mm256_xor_si256(_mm256_loadu_si256(p + i + 1), t1);
+			__m256i b2 = _mm256_xor_si256(_mm256_loadu_si256(p + i + 2), t2);
+			__m256i b3 = _mm256_xor_si256(_mm256_loadu_si256(p + i + 3), t3);
+			b0 = _mm256_xor_si256(b0, k[0]);
+			b1 = _mm256_xor_si256(b1, k[0]);
+			b2 = _mm256_xor_si256(b2, k[0]);
+			b3 = _mm256_xor_si256(b3, k[0]);
+			for (size_t r = 1; r < rounds; ++r) {
+				b0 = _mm256_aesdec_epi128(b0, k[r]);
+				b1 = _mm256_aesdec_epi128(b1, k[r]);
+				b2 = _mm256_aesdec_epi128(b2, k[r]);
+				b3 = _mm256_aesdec_epi128(b3, k[r]);
+			}
+			b0 = _mm256_aesdeclast_epi128(b0, k[rounds]);
+			b1 = _mm256_aesdeclast_epi128(b1, k[rounds]);
+			b2 = _mm256_aesdeclast_epi128(b2, k[rounds]);
+			b3 = _mm256_aesdeclast_epi128(b3, k[rounds]);
+			_mm256_storeu_si256(p + i, _mm256_xor_si256(b0, t0));
+			_mm256_storeu_si256(p + i + 1, _mm256_xor_si256(b1, t1));
+			_mm256_storeu_si256(p + i + 2, _mm256_xor_si256(b2, t2));
+			_mm256_storeu_si256(p + i + 3, _mm256_xor_si256(b3, t3));
+		}
+	}
+	_mm256_zeroupper();
+}
+
+#endif // HAVE_X86_INTRIN
+
+xts::xts(const uint8_t *key, size_t len)
+	: m_data(key, len / 2), m_tweak(key + len / 2, len / 2) {
+	if (len % 2)
+		throw exception("XTS key must hold two equal-sized AES keys");
+}
+
+void xts::decrypt(uint8_t *buf, size_t sectors, uint64_t sector) const {
+#ifdef HAVE_X86_INTRIN
+	if (cpu().vaes)
+		return xts_vaes(m_data, m_tweak, buf, sectors, sector);
+	if (cpu().aesni)
+		return xts_aesni(m_data, m_tweak, buf, sectors, sector);
+#endif
+	xts_portable(m_data, m_tweak, buf, sectors, sector);
+}
+
+} } // namespace devmapper::crypto
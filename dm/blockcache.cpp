@@ -0,0 +1,112 @@
+#include "blockcache.hpp"
+
+#include <string.h>
+
+namespace devmapper {
+
+blockcache::blockcache(size_t budget) : m_next_owner(0) {
+	for (size_t i = 0; i < Shards; ++i) {
+		shard& s = m_shards[i];
+		pthread_mutex_init(&s.lock, NULL);
+		s.hits = s.misses = s.evictions = 0;
+	}
+	set_budget(budget);
+}
+
+blockcache::~blockcache() {
+	for (size_t i = 0; i < Shards; ++i)
+		pthread_mutex_destroy(&m_shards[i].lock);
+}
+
+blockcache& blockcache::shared() {
+	static blockcache cache(64 << 20);
+	return cache;
+}
+
+void blockcache::set_budget(size_t budget) {
+	m_budget = budget;
+	for (size_t i = 0; i < Shards; ++i) {
+		shard& s = m_shards[i];
+		pthread_mutex_lock(&s.lock);
+		s.max = budget / PageBytes / Shards;
+		trim(s);
+		pthread_mutex_unlock(&s.lock);
+	}
+}
+
+blockcache::stats blockcache::statistics() {
+	stats st = { 0, 0, 0, 0 };
+	for (size_t i = 0; i < Shards; ++i) {
+		shard& s = m_shards[i];
+		pthread_mutex_lock(&s.lock);
+		st.hits += s.hits;
+		st.misses += s.misses;
+		st.evictions += s.evictions;
+		st.pages += s.pages.size();
+		pthread_mutex_unlock(&s.lock);
+	}
+	return st;
+}
+
+uint64_t blockcache::owner() {
+	return __sync_fetch_and_add(&m_next_owner, 1);
+}
+
+void blockcache::forget(uint64_t owner) {
+	for (size_t i = 0; i < Shards; ++i) {
+		shard& s = m_shards[i];
+		pthread_mutex_lock(&s.lock);
+		map_t::iterator it = s.pages.lower_bound(key(owner, 0));
+		while (it != s.pages.end() && it->first.first == owner) {
+			s.lru.erase(it->second.pos);
+			s.pages.erase(it++);
+		}
+		pthread_mutex_unlock(&s.lock);
+	}
+}
+
+// Neighbouring pages go to different shards, so a sequential reader spreads
+// across all of them
+blockcache::shard& blockcache::find(uint64_t owner, off_t page) {
+	return m_shards[(page + owner * 7) % Shards];
+}
+
+void blockcache::trim(shard& s) {
+	while (s.pages.size() > s.max && !s.lru.empty()) {
+		s.pages.erase(s.lru.back());
+		s.lru.pop_back();
+		++s.evictions;
+	}
+}
+
+bool blockcache::get(uint64_t owner, off_t page, uint8_t *buf) {
+	shard& s = find(owner, page);
+	pthread_mutex_lock(&s.lock);
+	map_t::iterator it = s.pages.find(key(owner, page));
+	bool found = it != s.pages.end();
+	if (found) {
+		memcpy(buf, &it->second.data[0], PageBytes);
+		s.lru.splice(s.lru.begin(), s.lru, it->second.pos);
+		++s.hits;
+	} else {
+		++s.misses;
+	}
+	pthread_mutex_unlock(&s.lock);
+	return found;
+}
+
+void blockcache::put(uint64_t owner, off_t page, const uint8_t *buf) {
+	shard& s = find(owner, page);
+	pthread_mutex_lock(&s.lock);
+	key k(owner, page);
+	if (s.max && s.pages.find(k) == s.pages.end()) {
+		entry& e = s.pages[k];
+		e.data.assign(buf, buf + PageBytes);
+		s.lru.push_front(k);
+		e.pos = s.lru.begin();
+		trim(s);
+	}
+	pthread_mutex_unlock(&s.lock);
+}
+
+} // namespace devmapper
@@ -0,0 +1,46 @@
+#include "cpu.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_CPUID 1
+#endif
+
+namespace devmapper {
+
+#ifdef HAVE_CPUID
+// Has the OS enabled saving of the YMM registers?
+static bool os_avx() {
+	unsigned int lo, hi;
+	__asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (lo & 0x6) == 0x6;
+}
+#endif
+
+static cpu_features detect() {
+	cpu_features f = { false, false, false, false, false, false, false };
+#ifdef HAVE_CPUID
+	unsigned int a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return f;
+	f.sse2 = d & (1 << 26);
+	f.ssse3 = c & (1 << 9);
+	f.sse41 = c & (1 << 19);
+	f.aesni = c & (1 << 25);
+	bool avx = (c & (1 << 27)) && (c & (1 << 28)) && os_avx();
+	
+	if (__get_cpuid_max(0, 0) >= 7) {
+		__cpuid_count(7, 0, a, b, c, d);
+		f.avx2 = avx && (b & (1 << 5));
+		f.sha = b & (1 << 29);
+		f.vaes = f.avx2 && f.aesni && (c & (1 << 9));
+	}
+#endif
+	return f;
+}
+
+const cpu_features& cpu() {
+	static const cpu_features features = detect();
+	return features;
+}
+
+} // namespace devmapper
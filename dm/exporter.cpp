@@ -0,0 +1,269 @@
+#include "exporter.hpp"
+#include "memscan.hpp"
+#include "ratelimit.hpp"
+#include "workpool.hpp"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace devmapper {
+
+static const uint64_t ReportEvery = 500 * 1000 * 1000; // ns
+static const size_t ZeroBytes = 64 * 1024;
+
+exporter::options::options()
+	: chunk_bytes(4 << 20), workers(8), sparse(true), offload(true) { }
+
+struct exporter::worker : public workpool::job {
+	exporter *ex;
+	std::vector<uint8_t> buf;
+	virtual void run() { ex->work(buf); }
+};
+
+exporter::exporter(target& src, off_t bytes, const options& o)
+	: src(src), blocks(bytes / BlockSize), opts(o), fd(-1), m_reporter(NULL) {
+	if (opts.chunk_bytes < BlockSize)
+		opts.chunk_bytes = BlockSize;
+	opts.chunk_bytes -= opts.chunk_bytes % BlockSize;
+	if (!opts.workers)
+		opts.workers = 1;
+	pthread_mutex_init(&report_lock, NULL);
+}
+
+exporter::~exporter() {
+	pthread_mutex_destroy(&report_lock);
+}
+
+int exporter::run(int out, reporter *r) {
+	fd = out;
+	m_reporter = r;
+	next_chunk = 0;
+	error = 0;
+	memset(&m_progress, 0, sizeof(m_progress));
+	m_progress.total = blocks * BlockSize;
+	started = reported = token_bucket::now();
+
+	// A file we've just made, or emptied, has nothing to overwrite with
+	// zeroes. Devices might hold anything.
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	fresh = S_ISREG(st.st_mode) && st.st_size == 0;
+	if (S_ISREG(st.st_mode) && ftruncate(fd, blocks * BlockSize) == -1)
+		return -errno;
+	granule = st.st_blksize > off_t(BlockSize) ? st.st_blksize : BlockSize;
+	if (granule > opts.chunk_bytes)
+		granule = opts.chunk_bytes;
+	can_punch = true;
+	can_copy = opts.offload;
+
+	workpool pool(opts.workers);
+	std::vector<worker> workers(opts.workers);
+	std::vector<workpool::job*> jobs;
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].ex = this;
+		workers[i].buf.resize(opts.chunk_bytes);
+		jobs.push_back(&workers[i]);
+	}
+	pool.run(&jobs[0], jobs.size());
+
+	report(true);
+	return error;
+}
+
+// Take chunks in turn until they're all done, or something fails
+void exporter::work(std::vector<uint8_t>& buf) {
+	off_t per = opts.chunk_bytes / BlockSize;
+	while (!error) {
+		off_t block = __sync_fetch_and_add(&next_chunk, 1) * per;
+		if (block >= blocks)
+			return;
+		size_t count = std::min(per, blocks - block);
+		int err = copy_chunk(block, count, &buf[0]);
+		if (err < 0) {
+			__sync_bool_compare_and_swap(&error, 0, err);
+			return;
+		}
+		__sync_fetch_and_add(&m_progress.done, count * BlockSize);
+		report(false);
+	}
+}
+
+int exporter::copy_chunk(off_t block, size_t count, uint8_t *buf) {
+	off_t end = block + count;
+	while (block < end) {
+		off_t pos = block * BlockSize;
+		off_t run;
+		if (!src.allocated(block, run)) {
+			if (run <= 0 || run > end - block)
+				run = end - block;
+			int err = write_zero(pos, run * BlockSize);
+			if (err < 0)
+				return err;
+			block += run;
+			continue;
+		}
+		if (run <= 0 || run > end - block)
+			run = end - block;
+
+		int sfd;
+		off_t soff, drun;
+		if (can_copy && src.direct(block, drun, sfd, soff)) {
+			if (drun > 0 && drun < run)
+				run = drun;
+			size_t copied;
+			int err = copy_direct(sfd, soff, pos, run * BlockSize, copied);
+			if (err < 0)
+				return err;
+			block += copied / BlockSize;
+			if (copied == run * BlockSize)
+				continue;
+			run -= copied / BlockSize;
+			pos = block * BlockSize;
+		}
+
+		int err = src.read_blocks(block, buf, run);
+		if (err >= 0 && err != int(run * BlockSize))
+			err = -EIO;
+		if (err < 0)
+			return err;
+		err = emit(pos, buf, run * BlockSize);
+		if (err < 0)
+			return err;
+		block += run;
+	}
+	return 0;
+}
+
+// Copy within the kernel, returning zero or negative errno. Stops short, and
+// turns copying off, where the kernel or the filesystems can't do it.
+int exporter::copy_direct(int sfd, off_t soff, off_t pos, size_t size,
+		size_t& copied) {
+	copied = 0;
+#ifdef __linux__
+	loff_t in = soff, out = pos;
+	while (copied < size) {
+		ssize_t n = copy_file_range(sfd, &in, fd, &out, size - copied, 0);
+		if (n > 0) {
+			copied += n;
+			continue;
+		}
+		if (n == 0)
+			return -EIO; // the source ended early
+		if (errno == EINTR)
+			continue;
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+				errno != EOPNOTSUPP && errno != EBADF)
+			return -errno;
+		can_copy = false;
+		break;
+	}
+	// Partial blocks are copied again the slow way
+	copied -= copied % BlockSize;
+	__sync_fetch_and_add(&m_progress.copied, copied);
+#else
+	can_copy = false;
+#endif
+	return 0;
+}
+
+// Write data out, leaving its zero pieces as holes
+int exporter::emit(off_t pos, const uint8_t *buf, size_t size) {
+	if (!opts.sparse)
+		return write_data(pos, buf, size);
+
+	size_t i = 0;
+	while (i < size) {
+		// Pieces end at multiples of the granule, so holes line up with
+		// the destination's own blocks
+		size_t piece = std::min(granule - (pos + i) % granule, size - i);
+		bool zero = all_zero(buf + i, piece);
+		size_t j = i + piece;
+		while (j < size) {
+			piece = std::min(granule, size - j);
+			if (all_zero(buf + j, piece) != zero)
+				break;
+			j += piece;
+		}
+
+		int err = zero ? write_zero(pos + i, j - i)
+			: write_data(pos + i, buf + i, j - i);
+		if (err < 0)
+			return err;
+		i = j;
+	}
+	return 0;
+}
+
+int exporter::write_zero(off_t pos, size_t size) {
+	if (opts.sparse) {
+		if (fresh) {
+			__sync_fetch_and_add(&m_progress.zero, size);
+			return 0;
+		}
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (can_punch) {
+			if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					pos, size) == 0) {
+				__sync_fetch_and_add(&m_progress.zero, size);
+				return 0;
+			}
+			if (errno != EOPNOTSUPP && errno != ENOSYS && errno != ENODEV)
+				return -errno;
+			can_punch = false;
+		}
+#endif
+	}
+
+	static const uint8_t zeroes[ZeroBytes] = { 0 };
+	for (size_t done = 0; done < size; ) {
+		size_t n = std::min(ZeroBytes, size - done);
+		int err = write_data(pos + done, zeroes, n);
+		if (err < 0)
+			return err;
+		done += n;
+	}
+	return 0;
+}
+
+int exporter::write_data(off_t pos, const uint8_t *buf, size_t size) {
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = pwrite(fd, buf + done, size - done, pos + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		done += n;
+	}
+	__sync_fetch_and_add(&m_progress.written, size);
+	return 0;
+}
+
+// Workers skip reporting if another is already at it
+void exporter::report(bool last) {
+	if (!m_reporter)
+		return;
+	uint64_t now = token_bucket::now();
+	if (last)
+		pthread_mutex_lock(&report_lock);
+	else if (now - reported < ReportEvery ||
+			pthread_mutex_trylock(&report_lock) != 0)
+		return;
+
+	if (last || now - reported >= ReportEvery) {
+		reported = now;
+		progress p = m_progress;
+		p.elapsed_ns = now - started;
+		m_reporter->report(p);
+	}
+	pthread_mutex_unlock(&report_lock);
+}
+
+} // namespace devmapper
@@ -5,116 +5,305 @@ using std::string;
 
 #include <errno.h>
 
+// SEEK_DATA/SEEK_HOLE reach the filesystem only with the FUSE 3 API. The
+// default build uses FUSE 2 and doesn't report holes; "make FUSE3=1" does.
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
 #include <fuse.h>
 
+#if FUSE_USE_VERSION >= 30
+#define FUSE_FILL(filler, buf, name) \
+	filler(buf, name, NULL, 0, static_cast<fuse_fill_dir_flags>(0))
+#else
+#define FUSE_FILL(filler, buf, name) filler(buf, name, NULL, 0)
+#endif
+
 
 namespace devmapper {
 
-struct fuse_params {
-	target& tgt;
-	size_t size;
+static string parent(const string& path) {
+	string::size_type slash = path.rfind('/');
+	return slash ? path.substr(0, slash) : "/";
+}
+
+static string absolute(const string& path) {
+	return path[0] == '/' ? path : "/" + path;
+}
+
+void fuse_tree::add_dirs(const string& path) {
+	for (string dir = parent(path); m_dirs.insert(dir).second && dir != "/";
+			dir = parent(dir))
+		;
+	m_dirs.insert("/");
+}
+
+void fuse_tree::add(const string& path, target::ptr tgt, off_t size) {
+	file f = { tgt, size };
+	m_files[absolute(path)] = f;
+	add_dirs(absolute(path));
+}
+
+void fuse_tree::add(const string& path, fuse_control::ptr ctl) {
+	m_controls[absolute(path)] = ctl;
+	add_dirs(absolute(path));
+}
+
+const fuse_tree::file *fuse_tree::find(const string& path) const {
+	std::map<string, file>::const_iterator it = m_files.find(path);
+	return it == m_files.end() ? NULL : &it->second;
+}
+
+fuse_control *fuse_tree::control(const string& path) const {
+	std::map<string, fuse_control::ptr>::const_iterator it
+		= m_controls.find(path);
+	return it == m_controls.end() ? NULL : it->second.get();
+}
+
+bool fuse_tree::directory(const string& path) const {
+	return path == "/" || m_dirs.count(path);
+}
+
+std::vector<string> fuse_tree::list(const string& path) const {
+	std::vector<string> names;
+	for (std::set<string>::const_iterator it = m_dirs.begin();
+			it != m_dirs.end(); ++it)
+		if (*it != "/" && parent(*it) == path)
+			names.push_back(it->substr(it->rfind('/') + 1));
+	for (std::map<string, file>::const_iterator it = m_files.begin();
+			it != m_files.end(); ++it)
+		if (parent(it->first) == path)
+			names.push_back(it->first.substr(it->first.rfind('/') + 1));
+	for (std::map<string, fuse_control::ptr>::const_iterator it
+			= m_controls.begin(); it != m_controls.end(); ++it)
+		if (parent(it->first) == path)
+			names.push_back(it->first.substr(it->first.rfind('/') + 1));
+	return names;
+}
+
+// What an open file reads from, or what's been written to it
+struct fuse_open {
+	target::ptr tgt;	// the target's own reader, if it wants one
+	string shown;		// for control files, as they were when opened
+	string written;
+	bool dirty;
 };
 
 } // namespace devmapper
-using devmapper::fuse_params;
-using devmapper::BlockSize;
+using devmapper::fuse_control;
+using devmapper::fuse_open;
+using devmapper::fuse_tree;
+using devmapper::read_bytes;
+using devmapper::seek_bytes;
+using devmapper::target;
 
 
-static const char *target_name = "device";
+// Control files are small, so writes past this are refused
+static const size_t MaxControlSize = 64 * 1024;
 
-static fuse_params *par() {
-	return reinterpret_cast<fuse_params*>(fuse_get_context()->private_data);
+static const fuse_tree *tree() {
+	return reinterpret_cast<const fuse_tree*>(
+		fuse_get_context()->private_data);
 }
 
-static bool is_target(const char *path) {
-	return path[0] == '/' && string(target_name) == (path + 1);
+static fuse_open *opened(struct fuse_file_info *fi) {
+	return reinterpret_cast<fuse_open*>(fi->fh);
 }
 
 
 extern "C" int dm_getattr(const char *path, struct stat *stbuf) {
 	memset(stbuf, 0, sizeof(struct stat));
 
-	if (string("/") == path) {
+	if (tree()->directory(path)) {
 		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 3;
-	} else if (is_target(path)) {
+		stbuf->st_nlink = 2;
+	} else if (const fuse_tree::file *f = tree()->find(path)) {
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = par()->size;
+		stbuf->st_size = f->size;
+	} else if (fuse_control *c = tree()->control(path)) {
+		stbuf->st_mode = S_IFREG | (c->writable() ? 0644 : 0444);
+		stbuf->st_nlink = 1;
+		stbuf->st_size = c->get().size();
 	} else
 		return -ENOENT;
 
 	return 0;
 }
 
+extern "C" int dm_truncate(const char *path, off_t size) {
+	if (fuse_control *c = tree()->control(path))
+		return c->writable() ? 0 : -EACCES; // a write will follow
+	return tree()->find(path) ? -EACCES : -ENOENT;
+}
+
 extern "C" int dm_open(const char *path,
 		struct fuse_file_info *fi) {
-	if (!is_target(path))
+	const fuse_tree::file *f = tree()->find(path);
+	fuse_control *c = tree()->control(path);
+	if (!f && !c)
 		return -ENOENT;
 
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+	if ((f || !c->writable()) && (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	fuse_open *o = new fuse_open();
+	o->dirty = false;
+	if (f)
+		o->tgt = f->tgt->open_reader();
+
+	// A control file's size changes as it does, so the kernel mustn't stop
+	// reads at the size it last saw. Each open reads one consistent copy.
+	if (c) {
+		o->shown = c->get();
+		fi->direct_io = 1;
+	}
+	fi->fh = reinterpret_cast<uintptr_t>(o);
+	return 0;
+}
+
+extern "C" int dm_write(const char *path, const char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi) {
+	fuse_control *c = tree()->control(path);
+	if (!c || !c->writable())
 		return -EACCES;
+	if (offset < 0 || size > MaxControlSize ||
+			offset > off_t(MaxControlSize - size))
+		return -EFBIG;
+	fuse_open *o = opened(fi);
+	if (o->written.size() < offset + size)
+		o->written.resize(offset + size);
+	o->written.replace(offset, size, buf, size);
+	o->dirty = true;
+	return size;
+}
 
+// Settings written to a control file apply on close, and errors show there
+extern "C" int dm_flush(const char *path, struct fuse_file_info *fi) {
+	fuse_control *c = tree()->control(path);
+	fuse_open *o = opened(fi);
+	if (!c || !o || !o->dirty)
+		return 0;
+	o->dirty = false;
+	return c->set(o->written);
+}
+
+extern "C" int dm_release(const char *path, struct fuse_file_info *fi) {
+	delete opened(fi);
 	return 0;
 }
 
 extern "C" int dm_readdir(const char *path, void *buf,
 		fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	if (string("/") != path)
+	if (!tree()->directory(path))
 		return -ENOENT;
-	filler(buf, target_name, NULL, 0);
+	std::vector<string> names(tree()->list(path));
+	for (size_t i = 0; i < names.size(); ++i)
+		FUSE_FILL(filler, buf, names[i].c_str());
 	return 0;
 }
 
 extern "C" int dm_read(const char *path, char *buf, size_t size,
 		off_t offset, struct fuse_file_info *fi) {
-	if (!is_target(path))
+	if (fuse_control *c = tree()->control(path)) {
+		fuse_open *o = opened(fi);
+		string text(o ? o->shown : c->get());
+		if (offset >= off_t(text.size()))
+			return 0;
+		size_t n = text.copy(buf, size, offset);
+		return n;
+	}
+	
+	const fuse_tree::file *f = tree()->find(path);
+	if (!f)
 		return -ENOENT;
+	if (offset >= f->size)
+		return 0;
+	if (off_t(size) > f->size - offset)
+		size = f->size - offset;
 	
-	off_t end = offset + size, block = offset / BlockSize;
-	while (true) {
-		off_t bstart = block * BlockSize;
-		if (bstart > end)
-			return size;
-		
-		off_t boffset = offset - bstart;
-		if (boffset < 0)
-			boffset = 0;
-		off_t bend = end - bstart;
-		if (bend > BlockSize)
-			bend = BlockSize;
-		size_t want = bend - boffset;
-		
-		int err = par()->tgt.read(block, reinterpret_cast<uint8_t*>(buf),
-			boffset, want);
-		if (err < 0)
-			return err;
-		if (err != want)
-			return err + boffset - offset;
-		
-		++block;
-		buf += want;
+	fuse_open *o = opened(fi);
+	target& tgt = o && o->tgt ? *o->tgt : *f->tgt;
+	return read_bytes(tgt, reinterpret_cast<uint8_t*>(buf), size, offset);
+}
+
+#if FUSE_USE_VERSION >= 30
+extern "C" int dm_getattr3(const char *path, struct stat *stbuf,
+		struct fuse_file_info *fi) {
+	return dm_getattr(path, stbuf);
+}
+
+extern "C" int dm_truncate3(const char *path, off_t size,
+		struct fuse_file_info *fi) {
+	return dm_truncate(path, size);
+}
+
+extern "C" int dm_readdir3(const char *path, void *buf,
+		fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+		enum fuse_readdir_flags flags) {
+	return dm_readdir(path, buf, filler, offset, fi);
+}
+
+extern "C" off_t dm_lseek(const char *path, off_t off, int whence,
+		struct fuse_file_info *fi) {
+	const fuse_tree::file *f = tree()->find(path);
+	if (!f)
+		return -ENOENT;
+	
+	switch (whence) {
+		case SEEK_SET: return off;
+		case SEEK_END: return f->size + off;
+		case SEEK_DATA: return seek_bytes(*f->tgt, off, f->size, false);
+		case SEEK_HOLE: return seek_bytes(*f->tgt, off, f->size, true);
+		default: return -EINVAL;
 	}
 }
+#endif
 
 
 namespace devmapper {
 
 static struct fuse_operations fuse_ops = {
+#if FUSE_USE_VERSION >= 30
+	.getattr	= dm_getattr3,
+	.truncate	= dm_truncate3,
+	.open		= dm_open,
+	.read		= dm_read,
+	.write		= dm_write,
+	.flush		= dm_flush,
+	.release	= dm_release,
+	.readdir	= dm_readdir3,
+	.lseek		= dm_lseek,
+#else
 	.getattr	= dm_getattr,
+	.truncate	= dm_truncate,
 	.open		= dm_open,
 	.read		= dm_read,
+	.write		= dm_write,
+	.flush		= dm_flush,
+	.release	= dm_release,
 	.readdir	= dm_readdir,
+#endif
+};
+
+// The caller owns the target of the single-file fuse_serve()
+struct no_delete {
+	void operator()(target *) const { }
 };
 
 void fuse_serve(const char *path, target& tgt, size_t size) {
-	fuse_params params = { .tgt = tgt, .size = size };
+	fuse_tree tree;
+	tree.add("device", target::ptr(&tgt, no_delete()), size);
+	fuse_serve(path, tree);
+}
+
+void fuse_serve(const char *path, const fuse_tree& tree) {
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
 	fuse_opt_add_arg(&args, "devmapper::fuse_serve"); // progname
 	fuse_opt_add_arg(&args, "-f"); // foreground
 	fuse_opt_add_arg(&args, path);
-	fuse_main(args.argc, args.argv, &fuse_ops, &params);
+	fuse_main(args.argc, args.argv, &fuse_ops,
+		const_cast<fuse_tree*>(&tree));
 }
 
 } // namespace devmapper
@@ -0,0 +1,293 @@
+#include "iosched.hpp"
+#include "workpool.hpp"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace devmapper {
+
+struct iosched::request {
+	uint8_t *buf;
+	size_t size;
+	off_t offset;
+	ssize_t result;
+	bool done;
+	
+	off_t end() const { return offset + size; }
+	
+	static bool by_offset(const request *a, const request *b) {
+		return a->offset < b->offset;
+	}
+};
+
+static const uint64_t MaxWindowUsec = 1000000;
+
+// One merged read, as a job on the I/O pool
+struct iosched::merged_read : public workpool::job {
+	iosched *sched;
+	request **reqs;
+	size_t count;
+	
+	virtual void run() { sched->issue(reqs, count); }
+};
+
+struct iosched::settings : public fuse_control {
+	settings(iosched::ptr s) : parent(s) { }
+	
+	virtual std::string get() {
+		config c = parent->current();
+		stats s = parent->statistics();
+		std::ostringstream os;
+		os << "window_usec " << c.window_usec << "\n"
+			<< "max_batch " << c.max_batch << "\n"
+			<< "max_merge " << c.max_merge << "\n"
+			<< "max_gap " << c.max_gap << "\n"
+			<< "requests " << s.requests << "\n"
+			<< "batches " << s.batches << "\n"
+			<< "reads " << s.reads << "\n"
+			<< "merged " << s.requests - s.reads << "\n"
+			<< "bytes_requested " << s.bytes_requested << "\n"
+			<< "bytes_read " << s.bytes_read << "\n";
+		return os.str();
+	}
+	
+	// Statistics written back are ignored, so the whole file can be
+	virtual int set(const std::string& text) {
+		config c = parent->current();
+		std::istringstream is(text);
+		std::string key, val;
+		while (is >> key) {
+			uint64_t n;
+			if (!(is >> val) || val[0] == '-' ||
+					!(std::istringstream(val) >> n))
+				return -EINVAL;
+			if (key == "window_usec") {
+				if (n > MaxWindowUsec)
+					return -EINVAL;
+				c.window_usec = n;
+			}
+			else if (key == "max_batch")
+				c.max_batch = n;
+			else if (key == "max_merge")
+				c.max_merge = n;
+			else if (key == "max_gap")
+				c.max_gap = n;
+			else if (key != "requests" && key != "batches" && key != "reads" &&
+					key != "merged" && key != "bytes_requested" &&
+					key != "bytes_read")
+				return -EINVAL;
+		}
+		if (!c.max_batch || !c.max_merge)
+			return -EINVAL;
+		parent->configure(c);
+		return 0;
+	}
+	
+private:
+	iosched::ptr parent;
+};
+
+iosched::config::config()
+	: window_usec(100), max_batch(32), max_merge(1 << 20), max_gap(0) { }
+
+iosched::iosched(int fd, const config& c)
+	: m_fd(::dup(fd)), m_config(c), m_gathering(false), m_inflight(0),
+		m_last_batch(0) {
+	memset(&m_stats, 0, sizeof(m_stats));
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_arrived, NULL);
+	pthread_cond_init(&m_done, NULL);
+}
+
+iosched::~iosched() {
+	pthread_cond_destroy(&m_done);
+	pthread_cond_destroy(&m_arrived);
+	pthread_mutex_destroy(&m_lock);
+	if (m_fd != -1)
+		::close(m_fd);
+}
+
+iosched::ptr iosched::for_device(int fd, const config& c) {
+	typedef std::pair<dev_t, ino_t> key;
+	typedef std::map<key, std::tr1::weak_ptr<iosched> > registry;
+	static registry devices;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		return ptr(new iosched(fd, c));
+	key k = S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)
+		? key(st.st_rdev, 0) : key(st.st_dev, st.st_ino);
+	
+	pthread_mutex_lock(&lock);
+	// Forget devices no one schedules any more
+	for (registry::iterator it = devices.begin(); it != devices.end(); )
+		if (it->second.expired())
+			devices.erase(it++);
+		else
+			++it;
+	ptr sched = devices[k].lock();
+	if (!sched) {
+		sched.reset(new iosched(fd, c));
+		devices[k] = sched;
+	}
+	pthread_mutex_unlock(&lock);
+	return sched;
+}
+
+void iosched::configure(const config& c) {
+	pthread_mutex_lock(&m_lock);
+	m_config = c;
+	pthread_mutex_unlock(&m_lock);
+}
+
+iosched::config iosched::current() {
+	pthread_mutex_lock(&m_lock);
+	config c = m_config;
+	pthread_mutex_unlock(&m_lock);
+	return c;
+}
+
+fuse_control::ptr iosched::control() {
+	return fuse_control::ptr(new settings(shared_from_this()));
+}
+
+iosched::stats iosched::statistics() {
+	pthread_mutex_lock(&m_lock);
+	stats s = m_stats;
+	pthread_mutex_unlock(&m_lock);
+	return s;
+}
+
+ssize_t iosched::pread(uint8_t *buf, size_t size, off_t offset) {
+	request r = { buf, size, offset, 0, false };
+	
+	pthread_mutex_lock(&m_lock);
+	++m_stats.requests;
+	m_stats.bytes_requested += size;
+	m_pending.push_back(&r);
+	if (m_pending.size() >= m_config.max_batch)
+		pthread_cond_signal(&m_arrived);
+	
+	while (!r.done) {
+		if (!m_gathering && !m_pending.empty())
+			gather();
+		else
+			pthread_cond_wait(&m_done, &m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+	return r.result;
+}
+
+// Take the pending requests, and read them in as few pieces as we can.
+// Called and returns with the lock held. Once the batch is taken, the next
+// reader to arrive starts gathering another.
+void iosched::gather() {
+	m_gathering = true;
+	
+	// A lone reader with no recent company shouldn't pay for the window.
+	// Batches still in flight mean the device is busy, so company is likely.
+	if (m_config.window_usec && (m_last_batch > 1 || m_pending.size() > 1 ||
+			m_inflight)) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		uint64_t usec = now.tv_usec + m_config.window_usec;
+		struct timespec deadline;
+		deadline.tv_sec = now.tv_sec + usec / 1000000;
+		deadline.tv_nsec = (usec % 1000000) * 1000;
+		while (m_pending.size() < m_config.max_batch &&
+				pthread_cond_timedwait(&m_arrived, &m_lock, &deadline) == 0)
+			; // pass
+	}
+	
+	std::vector<request*> batch;
+	batch.swap(m_pending);
+	m_last_batch = batch.size();
+	++m_stats.batches;
+	m_gathering = false;
+	++m_inflight;
+	off_t max_gap = m_config.max_gap, max_merge = m_config.max_merge;
+	pthread_mutex_unlock(&m_lock);
+	
+	std::sort(batch.begin(), batch.end(), request::by_offset);
+	std::vector<merged_read> runs;
+	size_t first = 0;
+	while (first < batch.size()) {
+		size_t last = first + 1;
+		off_t start = batch[first]->offset, end = batch[first]->end();
+		for (; last < batch.size(); ++last) {
+			const request *r = batch[last];
+			off_t merged = std::max(end, r->end());
+			if (r->offset > end + max_gap || merged - start > max_merge)
+				break;
+			end = merged;
+		}
+		merged_read j;
+		j.sched = this;
+		j.reqs = &batch[first];
+		j.count = last - first;
+		runs.push_back(j);
+		first = last;
+	}
+	
+	if (runs.size() == 1) {
+		issue(runs[0].reqs, runs[0].count);
+	} else {
+		std::vector<workpool::job*> jobs;
+		for (size_t i = 0; i < runs.size(); ++i)
+			jobs.push_back(&runs[i]);
+		workpool::io().run(&jobs[0], jobs.size());
+	}
+	
+	pthread_mutex_lock(&m_lock);
+	for (size_t i = 0; i < batch.size(); ++i)
+		batch[i]->done = true;
+	--m_inflight;
+	pthread_cond_broadcast(&m_done);
+}
+
+// Read a run of sorted, mergeable requests with one system call
+void iosched::issue(request **reqs, size_t count) {
+	off_t start = reqs[0]->offset, end = start;
+	for (size_t i = 0; i < count; ++i)
+		end = std::max(end, reqs[i]->end());
+	size_t size = end - start;
+	
+	std::vector<uint8_t> bounce;
+	uint8_t *buf = reqs[0]->buf;
+	if (count > 1) {
+		bounce.resize(size);
+		buf = &bounce[0];
+	}
+	
+	ssize_t got = ::pread(m_fd, buf, size, start);
+	int err = errno;
+	
+	pthread_mutex_lock(&m_lock);
+	++m_stats.reads;
+	if (got > 0)
+		m_stats.bytes_read += got;
+	pthread_mutex_unlock(&m_lock);
+	
+	for (size_t i = 0; i < count; ++i) {
+		request *r = reqs[i];
+		if (got == -1) {
+			r->result = -err;
+			continue;
+		}
+		off_t skip = r->offset - start;
+		ssize_t avail = got - skip;
+		r->result = avail < 0 ? 0 : std::min(ssize_t(r->size), avail);
+		if (count > 1 && r->result > 0)
+			memcpy(r->buf, buf + skip, r->result);
+	}
+}
+
+} // namespace devmapper
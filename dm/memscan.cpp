@@ -0,0 +1,124 @@
+#include "memscan.hpp"
+#include "cpu.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_INTRIN 1
+#endif
+
+namespace devmapper {
+
+#ifdef HAVE_X86_INTRIN
+
+// Each returns how far it got, stopping short at a stride that isn't zero
+
+__attribute__((target("avx2")))
+static size_t zero_avx2(const uint8_t *buf, size_t size) {
+	size_t i = 0;
+	for (; i + 128 <= size; i += 128) {
+		const __m256i *p = (const __m256i*)(buf + i);
+		__m256i acc = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+			_mm256_or_si256(_mm256_loadu_si256(p + 2),
+				_mm256_loadu_si256(p + 3)));
+		if (!_mm256_testz_si256(acc, acc))
+			break;
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+static size_t zero_sse2(const uint8_t *buf, size_t size) {
+	size_t i = 0;
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= size; i += 64) {
+		const __m128i *p = (const __m128i*)(buf + i);
+		__m128i acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+			_mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			break;
+	}
+	return i;
+}
+
+// Stop short at the stride holding a difference, for the caller to find it
+
+__attribute__((target("avx2")))
+static size_t same_avx2(const uint8_t *a, const uint8_t *b, size_t size) {
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		const __m256i *pa = (const __m256i*)(a + i);
+		const __m256i *pb = (const __m256i*)(b + i);
+		__m256i eq = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(pa), _mm256_loadu_si256(pb)),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(pa + 1),
+				_mm256_loadu_si256(pb + 1)));
+		if (_mm256_movemask_epi8(eq) != -1)
+			break;
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+static size_t same_sse2(const uint8_t *a, const uint8_t *b, size_t size) {
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		const __m128i *pa = (const __m128i*)(a + i);
+		const __m128i *pb = (const __m128i*)(b + i);
+		__m128i eq = _mm_and_si128(
+			_mm_cmpeq_epi8(_mm_loadu_si128(pa), _mm_loadu_si128(pb)),
+			_mm_cmpeq_epi8(_mm_loadu_si128(pa + 1), _mm_loadu_si128(pb + 1)));
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+	return i;
+}
+
+#endif // HAVE_X86_INTRIN
+
+
+bool all_zero(const uint8_t *buf, size_t size) {
+	size_t i = 0;
+#ifdef HAVE_X86_INTRIN
+	if (cpu().avx2)
+		i = zero_avx2(buf, size);
+	else if (cpu().sse2)
+		i = zero_sse2(buf, size);
+#endif
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t w;
+		memcpy(&w, buf + i, sizeof(w));
+		if (w)
+			return false;
+	}
+	for (; i < size; ++i)
+		if (buf[i])
+			return false;
+	return true;
+}
+
+size_t first_difference(const uint8_t *a, const uint8_t *b, size_t size) {
+	size_t i = 0;
+#ifdef HAVE_X86_INTRIN
+	if (cpu().avx2)
+		i = same_avx2(a, b, size);
+	else if (cpu().sse2)
+		i = same_sse2(a, b, size);
+#endif
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t x, y;
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y)
+			break;
+	}
+	for (; i < size; ++i)
+		if (a[i] != b[i])
+			return i;
+	return size;
+}
+
+} // namespace devmapper
@@ -0,0 +1,665 @@
+#include "dm.hpp"
+#include "workpool.hpp"
+
+#include <stdexcept>
+#include <string>
+using std::string;
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+
+/***** Protocol constants, from the NBD protocol document *****/
+namespace devmapper {
+namespace nbdproto {
+static const uint64_t InitMagic = 0x4e42444d41474943ULL; // "NBDMAGIC"
+static const uint64_t OptMagic = 0x49484156454f5054ULL; // "IHAVEOPT"
+static const uint64_t ReplyOptMagic = 0x3e889045565a9ULL;
+static const uint32_t RequestMagic = 0x25609513;
+static const uint32_t SimpleMagic = 0x67446698;
+static const uint32_t StructuredMagic = 0x668e33ef;
+
+enum { FlagFixedNewstyle = 1, FlagNoZeroes = 2 };
+enum {
+	HasFlags = 1 << 0, ReadOnly = 1 << 1, SendFlush = 1 << 2,
+	SendDF = 1 << 7, CanMultiConn = 1 << 8,
+};
+
+enum {
+	OptExportName = 1, OptAbort = 2, OptList = 3, OptInfo = 6, OptGo = 7,
+	OptStructuredReply = 8,
+};
+enum {
+	RepAck = 1, RepServer = 2, RepInfo = 3,
+	RepErrUnsup = 0x80000001, RepErrInvalid = 0x80000003,
+	RepErrUnknown = 0x80000006,
+};
+enum { InfoExport = 0, InfoBlockSize = 3 };
+
+enum {
+	CmdRead = 0, CmdWrite = 1, CmdDisc = 2, CmdFlush = 3, CmdTrim = 4,
+	CmdWriteZeroes = 6,
+};
+enum { CmdFlagDF = 1 << 1 };
+
+enum { ReplyDone = 1 };
+enum {
+	ReplyNone = 0, ReplyOffsetData = 1, ReplyOffsetHole = 2,
+	ReplyError = 32769,
+};
+
+// Errors go over the wire as these values, whatever the local errno is
+enum {
+	ErrPerm = 1, ErrIO = 5, ErrNoMem = 12, ErrInval = 22, ErrNoSpc = 28,
+	ErrOverflow = 75, ErrNotSup = 95,
+};
+
+static const uint32_t MaxRequest = 32 << 20;
+static const size_t MaxInflight = 64;
+static const size_t MaxChunks = 256;
+static const unsigned AcceptBackoffUsec = 100 * 1000;
+static const char *ExportName = "device";
+} // namespace nbdproto
+using namespace nbdproto;
+
+
+/***** Utility functions *****/
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return (uint16_t(p[0]) << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return (uint32_t(get16(p)) << 16) | get16(p + 2);
+}
+
+static uint64_t get64(const uint8_t *p) {
+	return (uint64_t(get32(p)) << 32) | get32(p + 4);
+}
+
+static bool read_full(int fd, void *buf, size_t size) {
+	uint8_t *p = static_cast<uint8_t*>(buf);
+	while (size) {
+		ssize_t got = ::read(fd, p, size);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		p += got;
+		size -= got;
+	}
+	return true;
+}
+
+static bool write_full(int fd, struct iovec *iov, int count) {
+	while (count) {
+		ssize_t put = ::writev(fd, iov, count);
+		if (put == -1 && errno == EINTR)
+			continue;
+		if (put <= 0)
+			return false;
+		for (; count && size_t(put) >= iov->iov_len; ++iov, --count)
+			put -= iov->iov_len;
+		if (count) {
+			iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + put;
+			iov->iov_len -= put;
+		}
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size) {
+	struct iovec iov = { const_cast<void*>(buf), size };
+	return write_full(fd, &iov, 1);
+}
+
+static uint32_t wire_error(int err) {
+	switch (err) {
+		case EPERM: case EROFS: return ErrPerm;
+		case ENOMEM: return ErrNoMem;
+		case EINVAL: return ErrInval;
+		case ENOSPC: return ErrNoSpc;
+		case EOVERFLOW: return ErrOverflow;
+		case ENOTSUP: return ErrNotSup;
+		default: return ErrIO;
+	}
+}
+
+static void error(const string& msg) {
+	char buf[256];
+	buf[0] = '\0';
+	strerror_r(errno, buf, sizeof(buf));
+	throw std::runtime_error(msg + ": " + buf);
+}
+
+
+/***** Connections *****/
+
+struct nbd_request;
+
+// One client. Requests are read on the connection's own thread and handed
+// to the target concurrently; replies go out in whatever order they finish.
+struct nbd_conn {
+	nbd_conn(int fd, target& tgt, size_t size);
+	~nbd_conn();
+	
+	void run();
+	void reply(nbd_request *req, int result);
+	void simple_reply(uint64_t handle, uint32_t err);
+	// Fail a read, as a structured error chunk once those are agreed on
+	void read_error(uint64_t handle, uint32_t err);
+	
+private:
+	bool handshake();
+	bool option_reply(uint32_t opt, uint32_t type, const uint8_t *data = NULL,
+		size_t size = 0);
+	bool export_info(uint32_t opt, const uint8_t *data, size_t size);
+	bool transmission();
+	
+	void begin();
+	void finish();
+	
+	int fd;
+	target& tgt;
+	uint64_t size;
+	bool structured, no_zeroes;
+	
+	pthread_mutex_t write_lock, lock;
+	pthread_cond_t idle;
+	size_t inflight;
+	
+	friend struct nbd_request;
+};
+
+// A read in flight, run either as an asynchronous target read or, when it
+// doesn't fall on block boundaries, as a job on the I/O pool
+struct nbd_request : public target::completion, public workpool::job {
+	nbd_conn *conn;
+	uint64_t handle, offset;
+	uint32_t length;
+	uint16_t flags;
+	std::vector<uint8_t> buf;
+	
+	virtual void run() {
+		done(read_bytes(conn->tgt, &buf[0], length, offset));
+	}
+	
+	virtual void done(int result) {
+		nbd_conn *c = conn;
+		c->reply(this, result);
+		delete this;
+		c->finish();
+	}
+};
+
+nbd_conn::nbd_conn(int fd, target& tgt, size_t size)
+	: fd(fd), tgt(tgt), size(size), structured(false), no_zeroes(false),
+	inflight(0) {
+	pthread_mutex_init(&write_lock, NULL);
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&idle, NULL);
+}
+
+nbd_conn::~nbd_conn() {
+	pthread_cond_destroy(&idle);
+	pthread_mutex_destroy(&lock);
+	pthread_mutex_destroy(&write_lock);
+	::close(fd);
+}
+
+void nbd_conn::run() {
+	if (handshake())
+		transmission();
+	
+	// Replies still in flight need the socket
+	pthread_mutex_lock(&lock);
+	while (inflight)
+		pthread_cond_wait(&idle, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void nbd_conn::begin() {
+	pthread_mutex_lock(&lock);
+	while (inflight >= MaxInflight)
+		pthread_cond_wait(&idle, &lock);
+	++inflight;
+	pthread_mutex_unlock(&lock);
+}
+
+void nbd_conn::finish() {
+	pthread_mutex_lock(&lock);
+	--inflight;
+	pthread_cond_broadcast(&idle);
+	pthread_mutex_unlock(&lock);
+}
+
+bool nbd_conn::option_reply(uint32_t opt, uint32_t type, const uint8_t *data,
+		size_t len) {
+	uint8_t hdr[20];
+	put64(hdr, ReplyOptMagic);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, type);
+	put32(hdr + 16, len);
+	struct iovec iov[2] = {
+		{ hdr, sizeof(hdr) },
+		{ const_cast<uint8_t*>(data), len },
+	};
+	return write_full(fd, iov, len ? 2 : 1);
+}
+
+// NBD_OPT_INFO and NBD_OPT_GO
+bool nbd_conn::export_info(uint32_t opt, const uint8_t *data, size_t len) {
+	if (len < 6 || get32(data) > len - 6)
+		return option_reply(opt, RepErrInvalid);
+	uint32_t namelen = get32(data);
+	string name(reinterpret_cast<const char*>(data + 4), namelen);
+	if (!name.empty() && name != ExportName)
+		return option_reply(opt, RepErrUnknown);
+	
+	uint8_t info[12];
+	put16(info, InfoExport);
+	put64(info + 2, size);
+	put16(info + 10, HasFlags | ReadOnly | SendFlush | CanMultiConn |
+		(structured ? SendDF : 0));
+	if (!option_reply(opt, RepInfo, info, 12))
+		return false;
+	
+	uint8_t bsize[14];
+	put16(bsize, InfoBlockSize);
+	put32(bsize + 2, 1);
+	put32(bsize + 6, BlockSize);
+	put32(bsize + 10, MaxRequest);
+	if (!option_reply(opt, RepInfo, bsize, sizeof(bsize)))
+		return false;
+	return option_reply(opt, RepAck);
+}
+
+bool nbd_conn::handshake() {
+	uint8_t hello[18];
+	put64(hello, InitMagic);
+	put64(hello + 8, OptMagic);
+	put16(hello + 16, FlagFixedNewstyle | FlagNoZeroes);
+	if (!write_full(fd, hello, sizeof(hello)))
+		return false;
+	
+	uint8_t cflags[4];
+	if (!read_full(fd, cflags, 4))
+		return false;
+	if (!(get32(cflags) & FlagFixedNewstyle))
+		return false;
+	no_zeroes = get32(cflags) & FlagNoZeroes;
+	
+	while (true) {
+		uint8_t hdr[16];
+		if (!read_full(fd, hdr, sizeof(hdr)) || get64(hdr) != OptMagic)
+			return false;
+		uint32_t opt = get32(hdr + 8), len = get32(hdr + 12);
+		if (len > 4096)
+			return false;
+		std::vector<uint8_t> data(len + 1);
+		if (!read_full(fd, &data[0], len))
+			return false;
+		
+		switch (opt) {
+		case OptExportName: {
+			string name(reinterpret_cast<char*>(&data[0]), len);
+			if (!name.empty() && name != ExportName)
+				return false;
+			uint8_t reply[10 + 124] = { 0 };
+			put64(reply, size);
+			put16(reply + 8, HasFlags | ReadOnly | SendFlush | CanMultiConn);
+			return write_full(fd, reply, no_zeroes ? 10 : sizeof(reply));
+		}
+		case OptGo:
+			if (!export_info(opt, &data[0], len))
+				return false;
+			if (len >= 6 && get32(&data[0]) <= len - 6) {
+				string name(reinterpret_cast<char*>(&data[4]), get32(&data[0]));
+				if (name.empty() || name == ExportName)
+					return true;
+			}
+			break;
+		case OptInfo:
+			if (!export_info(opt, &data[0], len))
+				return false;
+			break;
+		case OptList: {
+			uint8_t entry[4 + 16];
+			size_t namelen = strlen(ExportName);
+			put32(entry, namelen);
+			memcpy(entry + 4, ExportName, namelen);
+			if (!option_reply(opt, RepServer, entry, 4 + namelen) ||
+					!option_reply(opt, RepAck))
+				return false;
+			break;
+		}
+		case OptStructuredReply:
+			if (len) {
+				if (!option_reply(opt, RepErrInvalid))
+					return false;
+				break;
+			}
+			structured = true;
+			if (!option_reply(opt, RepAck))
+				return false;
+			break;
+		case OptAbort:
+			option_reply(opt, RepAck);
+			return false;
+		default:
+			if (!option_reply(opt, RepErrUnsup))
+				return false;
+		}
+	}
+}
+
+void nbd_conn::simple_reply(uint64_t handle, uint32_t err) {
+	uint8_t hdr[16];
+	put32(hdr, SimpleMagic);
+	put32(hdr + 4, err);
+	put64(hdr + 8, handle);
+	pthread_mutex_lock(&write_lock);
+	write_full(fd, hdr, sizeof(hdr));
+	pthread_mutex_unlock(&write_lock);
+}
+
+void nbd_conn::read_error(uint64_t handle, uint32_t err) {
+	if (!structured) {
+		simple_reply(handle, err);
+		return;
+	}
+	uint8_t chunk[20 + 6];
+	put32(chunk, StructuredMagic);
+	put16(chunk + 4, ReplyDone);
+	put16(chunk + 6, ReplyError);
+	put64(chunk + 8, handle);
+	put32(chunk + 16, 6);
+	put32(chunk + 20, err);
+	put16(chunk + 24, 0);	// no message
+	pthread_mutex_lock(&write_lock);
+	write_full(fd, chunk, sizeof(chunk));
+	pthread_mutex_unlock(&write_lock);
+}
+
+void nbd_conn::reply(nbd_request *req, int result) {
+	if (result >= 0 && uint32_t(result) != req->length)
+		result = -EIO;
+	
+	if (!structured) {
+		uint8_t hdr[16];
+		put32(hdr, SimpleMagic);
+		put32(hdr + 4, result < 0 ? wire_error(-result) : 0);
+		put64(hdr + 8, req->handle);
+		struct iovec iov[2] = {
+			{ hdr, sizeof(hdr) },
+			{ &req->buf[0], req->length },
+		};
+		pthread_mutex_lock(&write_lock);
+		write_full(fd, iov, result < 0 ? 1 : 2);
+		pthread_mutex_unlock(&write_lock);
+		return;
+	}
+	
+	if (result < 0) {
+		read_error(req->handle, wire_error(-result));
+		return;
+	}
+	
+	// Nothing to send but the end of the reply
+	if (req->length == 0) {
+		uint8_t chunk[20];
+		put32(chunk, StructuredMagic);
+		put16(chunk + 4, ReplyDone);
+		put16(chunk + 6, ReplyNone);
+		put64(chunk + 8, req->handle);
+		put32(chunk + 16, 0);
+		pthread_mutex_lock(&write_lock);
+		write_full(fd, chunk, sizeof(chunk));
+		pthread_mutex_unlock(&write_lock);
+		return;
+	}
+	
+	// Split into data and hole chunks, unless asked not to fragment
+	std::vector<uint8_t> hdrs;
+	std::vector<size_t> data_at;	// chunk start in buf, or -1 for a hole
+	std::vector<uint32_t> lens;
+	uint64_t pos = req->offset, end = req->offset + req->length;
+	while (pos < end) {
+		off_t count = 0;
+		bool data = (req->flags & CmdFlagDF) ||
+			tgt.allocated(pos / BlockSize, count);
+		uint64_t next = count > 0 ? (pos / BlockSize + count) * BlockSize : end;
+		if (next > end)
+			next = end;
+		if (!data_at.empty() && (data_at.back() != size_t(-1)) == data)
+			lens.back() += next - pos; // same kind as the last chunk
+		else {
+			data_at.push_back(data ? pos - req->offset : size_t(-1));
+			lens.push_back(next - pos);
+		}
+		pos = next;
+	}
+	if (data_at.size() > MaxChunks) {
+		// Badly fragmented, just send it all as data
+		data_at.assign(1, 0);
+		lens.assign(1, req->length);
+	}
+	
+	hdrs.resize(data_at.size() * 32);
+	std::vector<struct iovec> iov;
+	uint64_t chunk_off = req->offset;
+	for (size_t i = 0; i < data_at.size(); ++i) {
+		uint8_t *h = &hdrs[i * 32];
+		bool data = data_at[i] != size_t(-1);
+		put32(h, StructuredMagic);
+		put16(h + 4, i + 1 == data_at.size() ? ReplyDone : 0);
+		put16(h + 6, data ? ReplyOffsetData : ReplyOffsetHole);
+		put64(h + 8, req->handle);
+		put32(h + 16, data ? 8 + lens[i] : 12);
+		put64(h + 20, chunk_off);
+		put32(h + 28, lens[i]);
+		struct iovec hv = { h, size_t(data ? 28 : 32) };
+		iov.push_back(hv);
+		if (data) {
+			struct iovec dv = { &req->buf[data_at[i]], lens[i] };
+			iov.push_back(dv);
+		}
+		chunk_off += lens[i];
+	}
+	
+	pthread_mutex_lock(&write_lock);
+	write_full(fd, &iov[0], int(iov.size()));
+	pthread_mutex_unlock(&write_lock);
+}
+
+bool nbd_conn::transmission() {
+	while (true) {
+		uint8_t hdr[28];
+		if (!read_full(fd, hdr, sizeof(hdr)) || get32(hdr) != RequestMagic)
+			return false;
+		uint16_t flags = get16(hdr + 4), type = get16(hdr + 6);
+		uint64_t handle = get64(hdr + 8), offset = get64(hdr + 16);
+		uint32_t length = get32(hdr + 24);
+		
+		switch (type) {
+		case CmdRead: {
+			if (offset > size || length > size - offset) {
+				read_error(handle, ErrInval);
+				break;
+			}
+			if (length > MaxRequest) {
+				read_error(handle, ErrOverflow);
+				break;
+			}
+			
+			nbd_request *req = new nbd_request();
+			req->conn = this;
+			req->handle = handle;
+			req->offset = offset;
+			req->length = length;
+			req->flags = flags;
+			req->buf.resize(length ? length : 1);
+			begin();
+			if (offset % BlockSize == 0 && length % BlockSize == 0)
+				tgt.read_async(offset / BlockSize, &req->buf[0],
+					length / BlockSize, req);
+			else
+				workpool::io().submit(req);
+			break;
+		}
+		case CmdWrite: {
+			// Swallow the payload to stay in sync
+			std::vector<uint8_t> junk(64 * 1024);
+			for (uint32_t left = length; left; ) {
+				uint32_t n = left < junk.size() ? left : junk.size();
+				if (!read_full(fd, &junk[0], n))
+					return false;
+				left -= n;
+			}
+			simple_reply(handle, ErrPerm);
+			break;
+		}
+		case CmdTrim:
+		case CmdWriteZeroes:
+			simple_reply(handle, ErrPerm);
+			break;
+		case CmdFlush:
+			simple_reply(handle, 0);
+			break;
+		case CmdDisc:
+			return true;
+		default:
+			simple_reply(handle, ErrInval);
+		}
+	}
+}
+
+
+/***** Listening *****/
+
+struct nbd_client {
+	int fd;
+	target *tgt;
+	size_t size;
+};
+
+static void *nbd_thread(void *arg) {
+	nbd_client *client = static_cast<nbd_client*>(arg);
+	{
+		nbd_conn conn(client->fd, *client->tgt, client->size);
+		conn.run();
+	}
+	delete client;
+	return NULL;
+}
+
+// A path makes a Unix socket, anything else is [host:]port over TCP
+static int nbd_listen(const char *address) {
+	string addr(address);
+	if (addr.find('/') != string::npos) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (addr.size() >= sizeof(sun.sun_path))
+			throw std::runtime_error("Socket path too long");
+		strcpy(sun.sun_path, addr.c_str());
+		
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1)
+			error("Can't create socket");
+		unlink(sun.sun_path);
+		if (bind(fd, reinterpret_cast<struct sockaddr*>(&sun), sizeof(sun)) == -1
+				|| listen(fd, 16) == -1)
+			error("Can't listen on " + addr);
+		return fd;
+	}
+	
+	string host("127.0.0.1"), port(addr);
+	size_t colon = addr.rfind(':');
+	if (colon != string::npos) {
+		host = addr.substr(0, colon);
+		port = addr.substr(colon + 1);
+	}
+	
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if (err)
+		throw std::runtime_error("Can't resolve " + addr + ": " +
+			gai_strerror(err));
+	
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd == -1) {
+		freeaddrinfo(res);
+		error("Can't create socket");
+	}
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1 || listen(fd, 16) == -1) {
+		freeaddrinfo(res);
+		error("Can't listen on " + addr);
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+void nbd_serve(const char *address, target& tgt, size_t size) {
+	signal(SIGPIPE, SIG_IGN);
+	int lfd = nbd_listen(address);
+	
+	while (true) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// Out of descriptors or memory, likely for a while. Clients
+			// already connected carry on; try again shortly.
+			perror("NBD accept");
+			usleep(AcceptBackoffUsec);
+			continue;
+		}
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		
+		nbd_client *client = new nbd_client();
+		client->fd = fd;
+		client->tgt = &tgt;
+		client->size = size;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, nbd_thread, client) != 0) {
+			::close(fd);
+			delete client;
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+} // namespace devmapper
@@ -0,0 +1,194 @@
+#include "parity.hpp"
+#include "cpu.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_INTRIN 1
+#endif
+
+namespace devmapper {
+namespace parity {
+
+// Log and exponent tables for the generator {02}
+struct tables {
+	uint8_t exp[512], log[256];
+	
+	tables() {
+		unsigned x = 1;
+		for (int i = 0; i < 255; ++i) {
+			exp[i] = exp[i + 255] = x;
+			log[x] = i;
+			x <<= 1;
+			if (x & 0x100)
+				x ^= 0x11d;
+		}
+		exp[510] = exp[511] = exp[0];
+		log[0] = 0;
+	}
+};
+
+static const tables& gf() {
+	static tables t;
+	return t;
+}
+
+uint8_t mul(uint8_t a, uint8_t b) {
+	if (!a || !b)
+		return 0;
+	const tables& t = gf();
+	return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t inverse(uint8_t a) {
+	const tables& t = gf();
+	return a ? t.exp[255 - t.log[a]] : 0;
+}
+
+uint8_t exp2(unsigned n) {
+	return gf().exp[n % 255];
+}
+
+// Products of 'c' with every low nibble, and every high nibble, so that
+// c * x = lo[x & 15] ^ hi[x >> 4]. Suits a byte shuffle.
+static void nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+	for (int i = 0; i < 16; ++i) {
+		lo[i] = mul(c, i);
+		hi[i] = mul(c, i << 4);
+	}
+}
+
+
+#ifdef HAVE_X86_INTRIN
+
+__attribute__((target("avx2")))
+static size_t xor_avx2(uint8_t *dst, const uint8_t *src, size_t size) {
+	size_t i = 0;
+	for (; i + 128 <= size; i += 128) {
+		for (int j = 0; j < 128; j += 32) {
+			__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i + j));
+			__m256i s = _mm256_loadu_si256((const __m256i*)(src + i + j));
+			_mm256_storeu_si256((__m256i*)(dst + i + j), _mm256_xor_si256(d, s));
+		}
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+static size_t xor_sse2(uint8_t *dst, const uint8_t *src, size_t size) {
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		for (int j = 0; j < 64; j += 16) {
+			__m128i d = _mm_loadu_si128((const __m128i*)(dst + i + j));
+			__m128i s = _mm_loadu_si128((const __m128i*)(src + i + j));
+			_mm_storeu_si128((__m128i*)(dst + i + j), _mm_xor_si128(d, s));
+		}
+	}
+	return i;
+}
+
+// 'dst' = ('accumulate' ? 'dst' : 0) ^ 'c' * 'src'
+__attribute__((target("avx2")))
+static size_t mul_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+		size_t size, bool accumulate) {
+	uint8_t lo[16], hi[16];
+	nibble_tables(c, lo, hi);
+	__m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)lo));
+	__m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)hi));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+	
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i l = _mm256_and_si256(s, mask);
+		__m256i h = _mm256_and_si256(_mm256_srli_epi16(s, 4), mask);
+		__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, l),
+			_mm256_shuffle_epi8(thi, h));
+		if (accumulate)
+			p = _mm256_xor_si256(p,
+				_mm256_loadu_si256((const __m256i*)(dst + i)));
+		_mm256_storeu_si256((__m256i*)(dst + i), p);
+	}
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t mul_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+		size_t size, bool accumulate) {
+	uint8_t lo[16], hi[16];
+	nibble_tables(c, lo, hi);
+	__m128i tlo = _mm_loadu_si128((__m128i*)lo);
+	__m128i thi = _mm_loadu_si128((__m128i*)hi);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i l = _mm_and_si128(s, mask);
+		__m128i h = _mm_and_si128(_mm_srli_epi16(s, 4), mask);
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l),
+			_mm_shuffle_epi8(thi, h));
+		if (accumulate)
+			p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i*)(dst + i)));
+		_mm_storeu_si128((__m128i*)(dst + i), p);
+	}
+	return i;
+}
+
+#endif // HAVE_X86_INTRIN
+
+
+void xor_into(uint8_t *dst, const uint8_t *src, size_t size) {
+	size_t i = 0;
+#ifdef HAVE_X86_INTRIN
+	if (cpu().avx2)
+		i = xor_avx2(dst, src, size);
+	else if (cpu().sse2)
+		i = xor_sse2(dst, src, size);
+#endif
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t d, s;
+		memcpy(&d, dst + i, sizeof(d));
+		memcpy(&s, src + i, sizeof(s));
+		d ^= s;
+		memcpy(dst + i, &d, sizeof(d));
+	}
+	for (; i < size; ++i)
+		dst[i] ^= src[i];
+}
+
+static void mul_into(uint8_t *dst, const uint8_t *src, uint8_t c,
+		size_t size, bool accumulate) {
+	size_t i = 0;
+#ifdef HAVE_X86_INTRIN
+	if (cpu().avx2)
+		i = mul_avx2(dst, src, c, size, accumulate);
+	else if (cpu().ssse3)
+		i = mul_ssse3(dst, src, c, size, accumulate);
+#endif
+	if (i == size)
+		return;
+	uint8_t lo[16], hi[16];
+	nibble_tables(c, lo, hi);
+	for (; i < size; ++i) {
+		uint8_t p = lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+		dst[i] = accumulate ? dst[i] ^ p : p;
+	}
+}
+
+void mul_xor_into(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size) {
+	if (c == 1)
+		xor_into(dst, src, size);
+	else if (c)
+		mul_into(dst, src, c, size, true);
+}
+
+void scale(uint8_t *buf, uint8_t c, size_t size) {
+	if (c == 0)
+		memset(buf, 0, size);
+	else if (c != 1)
+		mul_into(buf, buf, c, size, false);
+}
+
+} } // namespace devmapper::parity
@@ -0,0 +1,107 @@
+#include "ratelimit.hpp"
+
+#include <errno.h>
+#include <time.h>
+
+namespace devmapper {
+
+static const uint64_t NanosPerSec = 1000000000ULL;
+static const uint64_t Forever = ~uint64_t(0) / 2;
+
+const uint64_t token_bucket::LongestNap;
+
+token_bucket::token_bucket() : m_rate(0), m_burst(0), m_paid(0) { }
+
+// How long 'n' tokens take at 'rate', without overflowing for large
+// bursts. Amounts too long to count are as good as forever.
+static uint64_t nanos(uint64_t n, uint64_t rate) {
+	uint64_t whole = n / rate;
+	if (whole >= Forever / NanosPerSec)
+		return Forever;
+	// The remainder is under a second, however large the rate
+	return whole * NanosPerSec +
+		uint64_t(double(n % rate) * NanosPerSec / rate);
+}
+
+// How many tokens take 'ns' at 'rate', the other way from nanos()
+static uint64_t tokens(uint64_t ns, uint64_t rate) {
+	uint64_t whole = ns / NanosPerSec;
+	if (whole && rate >= Forever / whole)
+		return Forever;
+	return whole * rate +
+		uint64_t(double(ns % NanosPerSec) * rate / NanosPerSec);
+}
+
+// A wait for tokens at rate 'from', as it would be at rate 'to'
+static uint64_t rescale(uint64_t ns, uint64_t from, uint64_t to) {
+	if (!to)
+		return 0;
+	if (!from || from == to)
+		return ns;
+	return nanos(tokens(ns, from), to);
+}
+
+void token_bucket::configure(uint64_t rate, uint64_t burst) {
+	uint64_t old = m_rate;
+	m_burst = burst;
+	m_rate = rate;
+	if (old == rate)
+		return;
+	
+	// Otherwise debts run up at a low rate would outlast raising it
+	uint64_t t = now(), paid, rebased;
+	do {
+		paid = m_paid;
+		rebased = paid > t ? t + rescale(paid - t, old, rate) : paid;
+	} while (!__sync_bool_compare_and_swap(&m_paid, paid, rebased));
+}
+
+uint64_t token_bucket::rewait(uint64_t wait, uint64_t& rate) const {
+	uint64_t current = m_rate;
+	wait = rescale(wait, rate, current);
+	rate = current;
+	return wait;
+}
+
+uint64_t token_bucket::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NanosPerSec + ts.tv_nsec;
+}
+
+void token_bucket::sleep(uint64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / NanosPerSec;
+	ts.tv_nsec = ns % NanosPerSec;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		; // pass
+}
+
+// Each reservation pays for its tokens after whatever was reserved before
+// it. Up to 'burst' tokens' worth of that may be owed without waiting.
+uint64_t token_bucket::reserve(uint64_t n) {
+	uint64_t rate = m_rate;
+	if (!rate)
+		return 0;
+	uint64_t cost = nanos(n, rate);
+	uint64_t slack = nanos(m_burst, rate);
+	
+	uint64_t t = now(), old, paid;
+	do {
+		old = m_paid;
+		paid = (old > t ? old : t) + cost;
+	} while (!__sync_bool_compare_and_swap(&m_paid, old, paid));
+	return paid - t > slack ? paid - t - slack : 0;
+}
+
+void token_bucket::take(uint64_t n) {
+	uint64_t rate = m_rate;
+	uint64_t wait = reserve(n);
+	while (wait) {
+		uint64_t nap = wait < LongestNap ? wait : LongestNap;
+		sleep(nap);
+		wait = rewait(wait - nap, rate);
+	}
+}
+
+} // namespace devmapper
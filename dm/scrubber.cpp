@@ -0,0 +1,390 @@
+#include "scrubber.hpp"
+#include "memscan.hpp"
+#include "workpool.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <errno.h>
+#include <stdio.h>
+
+namespace devmapper {
+
+static const uint64_t SaveEvery = 10 * 1000000000ULL; // ns
+
+// Reads one leg's copy of a chunk
+struct scrub_read : public workpool::job {
+	target *tgt;
+	off_t block;
+	uint8_t *buf;
+	size_t count;
+	bool ok;
+
+	virtual void run() {
+		ok = tgt->read_blocks(block, buf, count) == int(count * BlockSize);
+	}
+};
+
+struct scrubber::settings : public fuse_control {
+	settings(scrubber *s) : parent(s) { }
+	virtual std::string get() { return parent->status(); }
+	virtual int set(const std::string& text) {
+		return parent->configure(text);
+	}
+
+private:
+	scrubber *parent;
+};
+
+scrubber::scrubber(const std::string& checkpoint, uint64_t rate,
+		size_t chunk_bytes)
+	: m_checkpoint(checkpoint), chunk(chunk_bytes / BlockSize),
+	m_state(Paused), m_region(0), m_block(0), m_mismatched(0),
+	m_unreadable_bytes(0), saved(0), stopping(false), started(false) {
+	if (!chunk)
+		chunk = 1;
+	bucket.configure(rate, 0);
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wake, NULL);
+}
+
+scrubber::~scrubber() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+	if (started)
+		pthread_join(m_thread, NULL);
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+}
+
+void scrubber::add(const std::string& name, off_t start, off_t blocks,
+		SHARED_PTR<targets::mirror> m) {
+	region r = { name, start, blocks, m };
+	regions.push_back(r);
+}
+
+void scrubber::start(bool paused) {
+	m_state = paused ? Paused : Running;
+	if (!m_checkpoint.empty()) {
+		std::ifstream in(m_checkpoint.c_str());
+		if (in) {
+			std::ostringstream text;
+			text << in.rdbuf();
+			m_state = Running;
+			if (apply(text.str()) < 0)
+				throw exception("Bad scrub checkpoint " + m_checkpoint);
+		}
+	}
+
+	if (pthread_create(&m_thread, NULL, thread, this) != 0)
+		throw exception("Can't start scrubbing");
+	started = true;
+}
+
+std::string scrubber::status() {
+	pthread_mutex_lock(&lock);
+	std::string s = describe();
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+int scrubber::configure(const std::string& text) {
+	pthread_mutex_lock(&lock);
+	int err = apply(text);
+	if (err == 0)
+		save();
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+	return err;
+}
+
+fuse_control::ptr scrubber::control() {
+	return fuse_control::ptr(new settings(this));
+}
+
+off_t scrubber::checked() const {
+	off_t blocks = 0;
+	for (size_t i = 0; i < m_region && i < regions.size(); ++i)
+		blocks += regions[i].blocks;
+	return blocks + m_block;
+}
+
+std::string scrubber::describe() const {
+	static const char *states[] = { "running", "paused", "done" };
+	off_t total = 0;
+	for (size_t i = 0; i < regions.size(); ++i)
+		total += regions[i].blocks;
+
+	std::ostringstream os;
+	os << "state " << states[m_state] << "\n"
+		<< "rate " << bucket.rate() << "\n";
+	if (m_region < regions.size()) {
+		const region& r = regions[m_region];
+		os << "position " << r.name << " "
+			<< (r.start + m_block) * BlockSize << "\n";
+	}
+	os << "checked " << checked() * BlockSize << "\n"
+		<< "total " << total * BlockSize << "\n"
+		<< "mismatched_bytes " << m_mismatched << "\n"
+		<< "unreadable_bytes " << m_unreadable_bytes << "\n";
+	for (size_t i = 0; i < m_mismatches.size(); ++i)
+		os << "mismatch " << m_mismatches[i].name << " "
+			<< m_mismatches[i].offset << " " << m_mismatches[i].length << "\n";
+	for (size_t i = 0; i < m_unreadable.size(); ++i)
+		os << "unreadable " << m_unreadable[i].name << " "
+			<< m_unreadable[i].offset << " " << m_unreadable[i].length << "\n";
+	return os.str();
+}
+
+// Check everything before changing anything. Lists that are given replace
+// ours. Call with the lock held, or before the thread starts.
+int scrubber::apply(const std::string& text) {
+	state st = m_state;
+	uint64_t rate = bucket.rate();
+	size_t reg = m_region;
+	off_t block = m_block;
+	bool moved = false, listed = false;
+	std::vector<range> mismatches, unreadable;
+	uint64_t mismatched = m_mismatched, unreadable_bytes = m_unreadable_bytes;
+
+	std::istringstream lines(text);
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::istringstream is(line);
+		std::string key;
+		if (!(is >> key))
+			continue;
+
+		if (key == "state") {
+			std::string v;
+			is >> v;
+			if (v == "running")
+				st = Running;
+			else if (v == "paused")
+				st = Paused;
+			else if (v == "done")
+				st = Done;
+			else
+				return -EINVAL;
+		} else if (key == "rate") {
+			std::string v;
+			if (!(is >> v) || v[0] == '-' || !(std::istringstream(v) >> rate))
+				return -EINVAL;
+		} else if (key == "position") {
+			std::string name;
+			off_t offset;
+			if (!(is >> name >> offset) || offset % BlockSize)
+				return -EINVAL;
+			offset /= BlockSize;
+			for (reg = 0; reg < regions.size(); ++reg) {
+				const region& r = regions[reg];
+				if (r.name == name && offset >= r.start &&
+						offset <= r.start + r.blocks)
+					break;
+			}
+			if (reg == regions.size())
+				return -EINVAL;
+			block = offset - regions[reg].start;
+			moved = true;
+		} else if (key == "checked" || key == "total") {
+			continue; // follow from the rest
+		} else if (key == "mismatched_bytes") {
+			if (!(is >> mismatched))
+				return -EINVAL;
+		} else if (key == "unreadable_bytes") {
+			if (!(is >> unreadable_bytes))
+				return -EINVAL;
+		} else if (key == "mismatch" || key == "unreadable") {
+			range r;
+			if (!(is >> r.name >> r.offset >> r.length))
+				return -EINVAL;
+			(key == "mismatch" ? mismatches : unreadable).push_back(r);
+			listed = true;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	// Starting a finished scrub again starts it over
+	if (m_state == Done && st == Running && !moved) {
+		reg = 0;
+		block = 0;
+		if (!listed) {
+			m_mismatches.clear();
+			m_unreadable.clear();
+			mismatched = unreadable_bytes = 0;
+		}
+	}
+	if (st == Done)
+		reg = regions.size();
+
+	m_state = st;
+	bucket.configure(rate, 0);
+	m_region = reg;
+	m_block = block;
+	m_mismatched = mismatched;
+	m_unreadable_bytes = unreadable_bytes;
+	if (listed) {
+		m_mismatches.swap(mismatches);
+		m_unreadable.swap(unreadable);
+	}
+	return 0;
+}
+
+// Write the status beside the checkpoint, then move it into place, so a
+// crash leaves the old one or the new. Call with the lock held.
+void scrubber::save() {
+	saved = token_bucket::now();
+	if (m_checkpoint.empty())
+		return;
+	std::string temp = m_checkpoint + ".tmp";
+	{
+		std::ofstream out(temp.c_str());
+		out << describe();
+		if (!out)
+			return;
+	}
+	rename(temp.c_str(), m_checkpoint.c_str());
+}
+
+void *scrubber::thread(void *arg) {
+	reinterpret_cast<scrubber*>(arg)->loop();
+	return NULL;
+}
+
+void scrubber::loop() {
+	size_t legs = 1;
+	for (size_t i = 0; i < regions.size(); ++i)
+		legs = std::max(legs, regions[i].tgt->legs().size());
+	std::vector<uint8_t> buf(legs * chunk * BlockSize);
+
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		if (m_state != Running) {
+			pthread_cond_wait(&wake, &lock);
+			continue;
+		}
+		if (m_region >= regions.size()) {
+			m_state = Done;
+			save();
+			continue;
+		}
+		size_t reg = m_region;
+		off_t block = m_block;
+		const region& r = regions[reg];
+		if (block >= r.blocks) {
+			++m_region;
+			m_block = 0;
+			continue;
+		}
+		size_t count = std::min(off_t(chunk), r.blocks - block);
+		pthread_mutex_unlock(&lock);
+
+		// Nap in short pieces, so we can stop quickly, and notice when
+		// the rate changes
+		uint64_t rate = bucket.rate();
+		uint64_t wait = bucket.reserve(count * BlockSize *
+			r.tgt->legs().size());
+		while (wait && !stopping) {
+			uint64_t nap = std::min(wait, token_bucket::LongestNap);
+			token_bucket::sleep(nap);
+			wait = bucket.rewait(wait - nap, rate);
+		}
+		if (!stopping)
+			scrub(r, block, count, &buf[0]);
+
+		pthread_mutex_lock(&lock);
+		if (stopping)
+			break;
+		// Unless someone moved us meanwhile
+		if (m_region == reg && m_block == block)
+			m_block += count;
+		if (token_bucket::now() - saved >= SaveEvery)
+			save();
+	}
+	save();
+	pthread_mutex_unlock(&lock);
+}
+
+// Read every leg's copy at once, and compare them block by block with the
+// first that could be read
+void scrubber::scrub(const region& r, off_t block, size_t count,
+		uint8_t *buf) {
+	const std::vector<target::ptr>& legs = r.tgt->legs();
+	size_t size = count * BlockSize;
+	std::vector<scrub_read> reads(legs.size());
+	std::vector<workpool::job*> jobs;
+	for (size_t i = 0; i < legs.size(); ++i) {
+		reads[i].ok = false;
+		if (!legs[i])
+			continue;
+		reads[i].tgt = legs[i].get();
+		reads[i].block = block;
+		reads[i].buf = buf + i * size;
+		reads[i].count = count;
+		jobs.push_back(&reads[i]);
+	}
+	if (!jobs.empty())
+		workpool::io().run(&jobs[0], jobs.size());
+
+	const uint8_t *first = NULL;
+	std::vector<char> differs(count);
+	bool unreadable = false, mismatched = false;
+	for (size_t i = 0; i < legs.size(); ++i) {
+		if (!reads[i].ok) {
+			unreadable = true;
+			continue;
+		}
+		if (!first) {
+			first = reads[i].buf;
+			continue;
+		}
+		const uint8_t *other = reads[i].buf;
+		for (size_t at = first_difference(first, other, size); at < size; ) {
+			size_t b = at / BlockSize;
+			differs[b] = mismatched = true;
+			at = (b + 1) * BlockSize;
+			at += first_difference(first + at, other + at, size - at);
+		}
+	}
+
+	off_t offset = (r.start + block) * BlockSize;
+	pthread_mutex_lock(&lock);
+	if (unreadable)
+		note(m_unreadable, m_unreadable_bytes, r.name, offset, size);
+	for (size_t b = 0; mismatched && b < count; ) {
+		if (!differs[b]) {
+			++b;
+			continue;
+		}
+		size_t end = b;
+		while (end < count && differs[end])
+			++end;
+		note(m_mismatches, m_mismatched, r.name, offset + b * BlockSize,
+			(end - b) * BlockSize);
+		b = end;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// Add to a list, joining ranges that touch. Past MaxListed, only count.
+void scrubber::note(std::vector<range>& list, uint64_t& total,
+		const std::string& name, off_t offset, off_t length) {
+	total += length;
+	if (!list.empty()) {
+		range& last = list.back();
+		if (last.name == name && last.offset + last.length == offset) {
+			last.length += length;
+			return;
+		}
+	}
+	if (list.size() < MaxListed) {
+		range r = { name, offset, length };
+		list.push_back(r);
+	}
+}
+
+} // namespace devmapper
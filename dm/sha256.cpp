@@ -0,0 +1,334 @@
+#include "crypto.hpp"
+#include "cpu.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_INTRIN 1
+#endif
+
+namespace devmapper {
+namespace crypto {
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t Initial[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+	0x1f83d9ab, 0x5be0cd19,
+};
+
+static uint32_t load_be(const uint8_t *p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+		(uint32_t(p[2]) << 8) | p[3];
+}
+
+static void store_be(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t ror(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+
+/***** Block functions *****/
+
+static void compress_portable(uint32_t *state, const uint8_t *data,
+		size_t blocks) {
+	for (; blocks; --blocks, data += 64) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; ++i)
+			w[i] = load_be(data + 4 * i);
+		for (int i = 16; i < 64; ++i) {
+			uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+			e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; ++i) {
+			uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+				((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+				((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef HAVE_X86_INTRIN
+
+// Four rounds at a time with the SHA extensions. Message vectors rotate
+// through m[0..3], each expanded two groups ahead of its use.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress_shani(uint32_t *state, const uint8_t *data,
+		size_t blocks) {
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+		0x0405060700010203ULL);
+	
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)state), 0xB1);
+	__m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)(state + 4)),
+		0x1B);
+	__m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+	
+	for (; blocks; --blocks, data += 64) {
+		__m128i abef_save = abef, cdgh_save = cdgh, m[4];
+		for (int g = 0; g < 16; ++g) {
+			__m128i& cur = m[g % 4];
+			if (g < 4)
+				cur = _mm_shuffle_epi8(
+					_mm_loadu_si128((const __m128i*)(data + 16 * g)), swap);
+			
+			__m128i msg = _mm_add_epi32(cur,
+				_mm_loadu_si128((const __m128i*)(K + 4 * g)));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			if (g >= 3 && g <= 14) {
+				__m128i& next = m[(g + 1) % 4];
+				next = _mm_add_epi32(next,
+					_mm_alignr_epi8(cur, m[(g + 3) % 4], 4));
+				next = _mm_sha256msg2_epu32(next, cur);
+			}
+			abef = _mm_sha256rnds2_epu32(abef, cdgh,
+				_mm_shuffle_epi32(msg, 0x0E));
+			if (g >= 1 && g <= 12)
+				m[(g + 3) % 4] = _mm_sha256msg1_epu32(m[(g + 3) % 4], cur);
+		}
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+	
+	tmp = _mm_shuffle_epi32(abef, 0x1B);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, cdgh, 0xF0));
+	_mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif // HAVE_X86_INTRIN
+
+static void compress(uint32_t *state, const uint8_t *data, size_t blocks) {
+#ifdef HAVE_X86_INTRIN
+	if (cpu().sha && cpu().sse41)
+		return compress_shani(state, data, blocks);
+#endif
+	compress_portable(state, data, blocks);
+}
+
+
+/***** Streaming interface *****/
+
+sha256::sha256() : m_buffered(0), m_total(0) {
+	memcpy(m_state, Initial, sizeof(m_state));
+}
+
+void sha256::update(const uint8_t *data, size_t size) {
+	m_total += size;
+	if (m_buffered) {
+		size_t want = 64 - m_buffered;
+		if (want > size)
+			want = size;
+		memcpy(m_buf + m_buffered, data, want);
+		m_buffered += want;
+		data += want;
+		size -= want;
+		if (m_buffered < 64)
+			return;
+		compress(m_state, m_buf, 1);
+		m_buffered = 0;
+	}
+	
+	if (size >= 64) {
+		compress(m_state, data, size / 64);
+		data += size & ~size_t(63);
+		size &= 63;
+	}
+	memcpy(m_buf, data, size);
+	m_buffered = size;
+}
+
+void sha256::final(uint8_t *digest) {
+	uint64_t bits = m_total * 8;
+	uint8_t pad[72] = { 0x80 };
+	size_t padlen = (m_buffered < 56 ? 56 : 120) - m_buffered;
+	for (int i = 0; i < 8; ++i)
+		pad[padlen + i] = bits >> (56 - 8 * i);
+	update(pad, padlen + 8);
+	
+	for (int i = 0; i < 8; ++i)
+		store_be(digest + 4 * i, m_state[i]);
+}
+
+
+/***** Multi-buffer *****/
+
+// One message as the compression function sees it: head, body, tail, then
+// padding and the length
+struct sha_stream {
+	const uint8_t *head, *body, *tail;
+	size_t head_size, body_size, tail_size;
+	
+	size_t total() const { return head_size + body_size + tail_size; }
+	size_t blocks() const { return (total() + 8) / 64 + 1; }
+	
+	void block(size_t n, uint8_t *out) const {
+		size_t pos = n * 64, len = total();
+		for (size_t i = 0; i < 64; ++i, ++pos) {
+			if (pos < head_size)
+				out[i] = head[pos];
+			else if (pos < head_size + body_size)
+				out[i] = body[pos - head_size];
+			else if (pos < len)
+				out[i] = tail[pos - head_size - body_size];
+			else if (pos == len)
+				out[i] = 0x80;
+			else if (pos + 8 < blocks() * 64)
+				out[i] = 0;
+			else
+				out[i] = (uint64_t(len) * 8) >> (8 * (blocks() * 64 - 1 - pos));
+		}
+	}
+	
+	// Copy block 'n' if it's not just a piece of the body
+	const uint8_t *block_ptr(size_t n, uint8_t *scratch) const {
+		size_t pos = n * 64;
+		if (pos >= head_size && pos + 64 <= head_size + body_size)
+			return body + pos - head_size;
+		block(n, scratch);
+		return scratch;
+	}
+};
+
+#ifdef HAVE_X86_INTRIN
+
+#define ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), \
+	_mm256_slli_epi32(x, 32 - (n)))
+
+// Eight independent messages of the same length, one per 32-bit lane
+__attribute__((target("avx2")))
+static void hash_x8(const sha_stream *s, uint8_t *const *digests) {
+	__m256i st[8];
+	for (int i = 0; i < 8; ++i)
+		st[i] = _mm256_set1_epi32(Initial[i]);
+	
+	uint8_t scratch[8][64];
+	size_t blocks = s[0].blocks();
+	for (size_t n = 0; n < blocks; ++n) {
+		const uint8_t *p[8];
+		for (int l = 0; l < 8; ++l)
+			p[l] = s[l].block_ptr(n, scratch[l]);
+		
+		__m256i w[64];
+		for (int i = 0; i < 16; ++i)
+			w[i] = _mm256_set_epi32(load_be(p[7] + 4 * i),
+				load_be(p[6] + 4 * i), load_be(p[5] + 4 * i),
+				load_be(p[4] + 4 * i), load_be(p[3] + 4 * i),
+				load_be(p[2] + 4 * i), load_be(p[1] + 4 * i),
+				load_be(p[0] + 4 * i));
+		for (int i = 16; i < 64; ++i) {
+			__m256i a = w[i - 15], b = w[i - 2];
+			__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(a, 7),
+				ROR8(a, 18)), _mm256_srli_epi32(a, 3));
+			__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(b, 17),
+				ROR8(b, 19)), _mm256_srli_epi32(b, 10));
+			w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0),
+				_mm256_add_epi32(w[i - 7], s1));
+		}
+		
+		__m256i a = st[0], b = st[1], c = st[2], d = st[3],
+			e = st[4], f = st[5], g = st[6], h = st[7];
+		for (int i = 0; i < 64; ++i) {
+			__m256i S1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(e, 6),
+				ROR8(e, 11)), ROR8(e, 25));
+			__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+				_mm256_andnot_si256(e, g));
+			__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1),
+				_mm256_add_epi32(ch, _mm256_add_epi32(w[i],
+				_mm256_set1_epi32(K[i]))));
+			__m256i S0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(a, 2),
+				ROR8(a, 13)), ROR8(a, 22));
+			__m256i maj = _mm256_xor_si256(_mm256_xor_si256(
+				_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+				_mm256_and_si256(b, c));
+			h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+			d = c; c = b; b = a; a = _mm256_add_epi32(t1,
+				_mm256_add_epi32(S0, maj));
+		}
+		st[0] = _mm256_add_epi32(st[0], a);
+		st[1] = _mm256_add_epi32(st[1], b);
+		st[2] = _mm256_add_epi32(st[2], c);
+		st[3] = _mm256_add_epi32(st[3], d);
+		st[4] = _mm256_add_epi32(st[4], e);
+		st[5] = _mm256_add_epi32(st[5], f);
+		st[6] = _mm256_add_epi32(st[6], g);
+		st[7] = _mm256_add_epi32(st[7], h);
+	}
+	
+	uint32_t lanes[8][8];
+	for (int i = 0; i < 8; ++i)
+		_mm256_storeu_si256((__m256i*)lanes[i], st[i]);
+	for (int l = 0; l < 8; ++l)
+		for (int i = 0; i < 8; ++i)
+			store_be(digests[l] + 4 * i, lanes[i][l]);
+	_mm256_zeroupper();
+}
+
+#undef ROR8
+
+#endif // HAVE_X86_INTRIN
+
+void sha256::hash_many(const std::string& salt, bool salt_first,
+		const uint8_t *const *msgs, size_t size, uint8_t *const *digests,
+		size_t count) {
+	const uint8_t *sp = reinterpret_cast<const uint8_t*>(salt.data());
+	size_t done = 0;
+	
+#ifdef HAVE_X86_INTRIN
+	// SHA-NI beats eight AVX2 lanes, so only go wide without it
+	if (cpu().avx2 && !cpu().sha) {
+		for (; done + 8 <= count; done += 8) {
+			sha_stream s[8];
+			for (int l = 0; l < 8; ++l) {
+				s[l].head = salt_first ? sp : NULL;
+				s[l].head_size = salt_first ? salt.size() : 0;
+				s[l].body = msgs[done + l];
+				s[l].body_size = size;
+				s[l].tail = salt_first ? NULL : sp;
+				s[l].tail_size = salt_first ? 0 : salt.size();
+			}
+			hash_x8(s, digests + done);
+		}
+	}
+#endif
+	
+	for (; done < count; ++done) {
+		sha256 h;
+		if (salt_first)
+			h.update(sp, salt.size());
+		h.update(msgs[done], size);
+		if (!salt_first)
+			h.update(sp, salt.size());
+		h.final(digests[done]);
+	}
+}
+
+} } // namespace devmapper::crypto
@@ -0,0 +1,126 @@
+#include "dm.hpp"
+#include "blockcache.hpp"
+
+#include <string.h>
+
+namespace devmapper {
+
+namespace targets {
+
+static const size_t PageBlocks = blockcache::PageBlocks;
+static const size_t PageBytes = blockcache::PageBytes;
+
+cached::cached(target::ptr src)
+	: source(src), cache(blockcache::shared()), owner(cache.owner()) { }
+
+cached::cached(target::ptr src, blockcache& c)
+	: source(src), cache(c), owner(c.owner()) { }
+
+cached::~cached() {
+	cache.forget(owner);
+}
+
+// Return bytes of the page available, as read_blocks()
+int cached::read_page(off_t page, uint8_t *buf) {
+	if (cache.get(owner, page, buf))
+		return PageBytes;
+	int err = source->read_blocks(page * PageBlocks, buf, PageBlocks);
+	if (err == int(PageBytes))
+		cache.put(owner, page, buf);
+	return err;
+}
+
+// Read whole pages that missed the cache, and remember them
+int cached::read_run(off_t block, uint8_t *buf, size_t count) {
+	int err = source->read_blocks(block, buf, count);
+	if (err < 0)
+		return err;
+	for (size_t i = 0; (i + 1) * PageBytes <= size_t(err); ++i)
+		cache.put(owner, block / PageBlocks + i, buf + i * PageBytes);
+	return err;
+}
+
+int cached::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	uint8_t page[PageBytes];
+	int err = read_page(block / PageBlocks, page);
+	if (err < 0)
+		return err;
+	size_t start = (block % PageBlocks) * BlockSize + offset;
+	if (size_t(err) <= start)
+		return 0;
+	if (size > err - start)
+		size = err - start;
+	memcpy(buf, page + start, size);
+	return size;
+}
+
+int cached::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	size_t done = 0, missed = 0; // in blocks; 'missed' pages precede 'done'
+	while (done < count) {
+		off_t b = block + done;
+		size_t skip = b % PageBlocks;
+		
+		if (!skip && count - done >= PageBlocks) {
+			// A whole page: collect misses, to read them together
+			uint8_t *dst = buf + done * BlockSize;
+			if (!cache.get(owner, b / PageBlocks, dst)) {
+				missed += PageBlocks;
+				done += PageBlocks;
+				continue;
+			}
+		}
+		
+		if (missed) {
+			size_t first = done - missed;
+			int err = read_run(block + first, buf + first * BlockSize, missed);
+			if (err < 0)
+				return err;
+			if (size_t(err) != missed * BlockSize)
+				return first * BlockSize + err;
+			missed = 0;
+		}
+		
+		if (!skip && count - done >= PageBlocks) { // the hit above
+			done += PageBlocks;
+			continue;
+		}
+		
+		// Part of a page
+		uint8_t page[PageBytes];
+		int err = read_page(b / PageBlocks, page);
+		if (err < 0)
+			return err;
+		size_t want = PageBlocks - skip;
+		if (want > count - done)
+			want = count - done;
+		size_t have = size_t(err) > skip * BlockSize
+			? size_t(err) / BlockSize - skip : 0;
+		if (have > want)
+			have = want;
+		memcpy(buf + done * BlockSize, page + skip * BlockSize,
+			have * BlockSize);
+		done += have;
+		if (have != want)
+			return done * BlockSize;
+	}
+	
+	if (missed) {
+		size_t first = done - missed;
+		int err = read_run(block + first, buf + first * BlockSize, missed);
+		if (err < 0)
+			return err;
+		return first * BlockSize + err;
+	}
+	return done * BlockSize;
+}
+
+bool cached::allocated(off_t block, off_t& count) {
+	return source->allocated(block, count);
+}
+
+// Copies that bypass us leave the cache alone, which suits bulk copies
+bool cached::direct(off_t block, off_t& count, int& fd, off_t& offset) {
+	return source->direct(block, count, fd, offset);
+}
+
+} } // namespace devmapper::targets
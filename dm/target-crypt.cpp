@@ -0,0 +1,84 @@
+#include "dm.hpp"
+#include "crypto.hpp"
+#include "workpool.hpp"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+
+namespace devmapper {
+
+namespace targets {
+
+// Below this many blocks, handing off to other threads costs more than it saves
+static const size_t ParallelBlocks = 16;
+
+struct crypt_job : public workpool::job {
+	const crypto::xts *cipher;
+	uint8_t *buf;
+	size_t count;
+	uint64_t sector;
+	
+	virtual void run() { cipher->decrypt(buf, count, sector); }
+};
+
+crypt::crypt(target::ptr src, const uint8_t *key, size_t keylen,
+		off_t iv_offset, workpool *pool)
+	: source(src), cipher(new crypto::xts(key, keylen)),
+	iv_offset(iv_offset), pool(pool ? *pool : workpool::shared()) { }
+
+crypt::~crypt() {
+	delete cipher;
+}
+
+void crypt::decrypt(off_t block, uint8_t *buf, size_t count) {
+	uint64_t sector = block + iv_offset;
+	size_t jobs = std::min(pool.size() + 1, count / ParallelBlocks);
+	if (jobs < 2) {
+		cipher->decrypt(buf, count, sector);
+		return;
+	}
+	
+	std::vector<crypt_job> work(jobs);
+	std::vector<workpool::job*> ptrs(jobs);
+	size_t per = count / jobs, extra = count % jobs;
+	for (size_t i = 0; i < jobs; ++i) {
+		size_t n = per + (i < extra ? 1 : 0);
+		work[i].cipher = cipher;
+		work[i].buf = buf;
+		work[i].count = n;
+		work[i].sector = sector;
+		ptrs[i] = &work[i];
+		buf += n * BlockSize;
+		sector += n;
+	}
+	pool.run(&ptrs[0], jobs);
+}
+
+int crypt::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	uint8_t sector[BlockSize];
+	int err = source->read(block, sector, 0, BlockSize);
+	if (err < 0)
+		return err;
+	if (err != BlockSize)
+		return -EIO;
+	
+	decrypt(block, sector, 1);
+	memcpy(buf, sector + offset, size);
+	memset(sector, 0, BlockSize);
+	return size;
+}
+
+int crypt::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	int err = source->read_blocks(block, buf, count);
+	if (err < 0)
+		return err;
+	
+	// Only whole sectors can be decrypted
+	size_t got = err / BlockSize;
+	decrypt(block, buf, got);
+	return got * BlockSize;
+}
+
+} } // namespace devmapper::targets
@@ -0,0 +1,17 @@
+#include "dm.hpp"
+
+#include <errno.h>
+
+namespace devmapper {
+
+namespace targets {
+
+int error::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	return -EIO;
+}
+
+int error::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	return -EIO;
+}
+
+} } // namespace devmapper::targets
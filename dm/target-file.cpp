@@ -1,7 +1,12 @@
 #include "dm.hpp"
+#include "iosched.hpp"
+
+#include <map>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace devmapper {
 
@@ -18,14 +23,95 @@ file::~file() {
 		close(fd);
 }
 
+int file::descriptor() const {
+	return fd;
+}
+
+SHARED_PTR<file> file::for_device(int fd) {
+	typedef std::pair<dev_t, ino_t> key;
+	typedef std::map<key, std::tr1::weak_ptr<file> > registry;
+	static registry files;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		return SHARED_PTR<file>(new file(dup(fd)));
+	key k = S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)
+		? key(st.st_rdev, 0) : key(st.st_dev, st.st_ino);
+	
+	pthread_mutex_lock(&lock);
+	// Forget devices no one has open any more
+	for (registry::iterator it = files.begin(); it != files.end(); )
+		if (it->second.expired())
+			files.erase(it++);
+		else
+			++it;
+	SHARED_PTR<file> f = files[k].lock();
+	if (!f) {
+		f.reset(new file(dup(fd)));
+		files[k] = f;
+	}
+	pthread_mutex_unlock(&lock);
+	return f;
+}
+
+void file::schedule(SHARED_PTR<iosched> s) {
+	sched = s;
+}
+
+// Return as iosched::pread
+ssize_t file::pread(uint8_t *buf, size_t size, off_t offset) {
+	if (sched)
+		return sched->pread(buf, size, offset);
+	ssize_t bytes = ::pread(fd, buf, size, offset);
+	return bytes == -1 ? -errno : bytes;
+}
+
 int file::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
-	ssize_t bytes = pread(fd, &buf[0], size, BlockSize * block + offset);
-	if (bytes == -1)
-		return -errno;
-	else if (bytes != size)
+	ssize_t bytes = pread(&buf[0], size, BlockSize * block + offset);
+	if (bytes < 0)
+		return bytes;
+	else if (bytes != ssize_t(size))
 		return -EIO;
 	else
 		return size;
 }
 
+int file::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	return pread(buf, count * BlockSize, BlockSize * block);
+}
+
+bool file::allocated(off_t block, off_t& count) {
+	return allocated(fd, block, count);
+}
+
+bool file::direct(off_t block, off_t& count, int& fd, off_t& offset) {
+	count = 0;
+	fd = this->fd;
+	offset = block * BlockSize;
+	return true;
+}
+
+// Sparse files, such as disk images, know where their holes are
+bool file::allocated(int fd, off_t block, off_t& count) {
+	count = 0;
+#ifdef SEEK_DATA
+	off_t pos = block * BlockSize;
+	off_t data = lseek(fd, pos, SEEK_DATA);
+	if (data == -1)
+		return errno != ENXIO; // ENXIO means only holes remain
+	if (data > pos) {
+		count = (data - pos) / BlockSize;
+		if (count)
+			return false;
+		pos = data; // partway into this block, which makes it data
+	}
+	
+	off_t hole = lseek(fd, pos, SEEK_HOLE);
+	if (hole > pos)
+		count = (hole - block * BlockSize + BlockSize - 1) / BlockSize;
+#endif
+	return true;
+}
+
 } } // namespace devmapper::targets
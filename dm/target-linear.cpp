@@ -11,4 +11,21 @@ int linear::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
 	return source->read(block + src_offset, buf, offset, size);
 }
 
+int linear::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	return source->read_blocks(block + src_offset, buf, count);
+}
+
+bool linear::allocated(off_t block, off_t& count) {
+	return source->allocated(block + src_offset, count);
+}
+
+bool linear::direct(off_t block, off_t& count, int& fd, off_t& offset) {
+	return source->direct(block + src_offset, count, fd, offset);
+}
+
+void linear::read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c) {
+	source->read_async(block + src_offset, buf, count, c);
+}
+
 } } // namespace devmapper::targets
@@ -0,0 +1,41 @@
+#include "dm.hpp"
+
+#include <errno.h>
+
+namespace devmapper {
+
+namespace targets {
+
+mirror::mirror(const std::vector<target::ptr>& legs)
+	: m_legs(legs), failed(legs.size()) {
+	for (size_t i = 0; i < legs.size(); ++i)
+		failed[i] = !legs[i];
+}
+
+int mirror::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	int err = -EIO;
+	for (size_t i = 0; i < m_legs.size(); ++i) {
+		if (failed[i])
+			continue;
+		err = m_legs[i]->read(block, buf, offset, size);
+		if (err >= 0)
+			return err;
+		__sync_bool_compare_and_swap(&failed[i], 0, 1);
+	}
+	return err;
+}
+
+int mirror::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	int err = -EIO;
+	for (size_t i = 0; i < m_legs.size(); ++i) {
+		if (failed[i])
+			continue;
+		err = m_legs[i]->read_blocks(block, buf, count);
+		if (err >= 0)
+			return err;
+		__sync_bool_compare_and_swap(&failed[i], 0, 1);
+	}
+	return err;
+}
+
+} } // namespace devmapper::targets
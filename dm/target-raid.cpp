@@ -0,0 +1,316 @@
+#include "dm.hpp"
+#include "parity.hpp"
+#include "workpool.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+namespace devmapper {
+
+namespace targets {
+
+// Reads part of one stripe, rebuilding it if need be
+struct raid::job : public workpool::job {
+	raid *r;
+	size_t leg;
+	off_t stripe, lblock;
+	uint8_t *buf;
+	size_t count;
+	int err;
+	
+	virtual void run() { err = r->read_chunk(leg, stripe, lblock, buf, count); }
+};
+
+// Reads the same range of one leg, for a rebuild
+struct leg_read : public workpool::job {
+	target *tgt;
+	off_t block;
+	uint8_t *buf;
+	size_t count;
+	bool ok;
+	
+	virtual void run() {
+		ok = tgt->read_blocks(block, buf, count) == int(count * BlockSize);
+	}
+};
+
+raid::raid(const std::vector<target::ptr>& legs, size_t parity, layout l,
+		off_t chunk)
+	: legs(legs), failed(legs.size()), parity(parity), m_layout(l),
+	chunk(chunk) {
+	for (size_t i = 0; i < legs.size(); ++i)
+		failed[i] = !legs[i];
+	pthread_mutex_init(&spare_lock, NULL);
+}
+
+raid::~raid() {
+	for (size_t i = 0; i < spare.size(); ++i)
+		delete spare[i];
+	pthread_mutex_destroy(&spare_lock);
+}
+
+raid::buffer *raid::take_buffer() {
+	buffer *b = NULL;
+	pthread_mutex_lock(&spare_lock);
+	if (!spare.empty()) {
+		b = spare.back();
+		spare.pop_back();
+	}
+	pthread_mutex_unlock(&spare_lock);
+	return b ? b : new buffer(legs.size() * chunk * BlockSize);
+}
+
+// Keep as many as are used at once, which the I/O pool bounds
+void raid::give_buffer(buffer *b) {
+	pthread_mutex_lock(&spare_lock);
+	spare.push_back(b);
+	pthread_mutex_unlock(&spare_lock);
+}
+
+// As md's raid5_compute_sector()
+size_t raid::place(off_t stripe, size_t dd, size_t& pd, size_t& qd,
+		bool& ddf) const {
+	size_t n = legs.size(), data = n - parity;
+	qd = n;
+	ddf = false;
+	
+	if (parity == 1) {
+		switch (m_layout) {
+		case left_asymmetric:
+			pd = data - stripe % n;
+			if (dd >= pd)
+				++dd;
+			break;
+		case right_asymmetric:
+			pd = stripe % n;
+			if (dd >= pd)
+				++dd;
+			break;
+		case left_symmetric:
+			pd = data - stripe % n;
+			dd = (pd + 1 + dd) % n;
+			break;
+		case right_symmetric:
+			pd = stripe % n;
+			dd = (pd + 1 + dd) % n;
+			break;
+		case parity_0:
+			pd = 0;
+			++dd;
+			break;
+		default: // parity_n
+			pd = data;
+			break;
+		}
+		return dd;
+	}
+	
+	switch (m_layout) {
+	case left_asymmetric:
+	case right_asymmetric:
+	case rotating_zero_restart:
+	case rotating_n_restart: {
+		// Q follows P, wrapping to the first leg
+		off_t s = m_layout == rotating_n_restart ? stripe + 1 : stripe;
+		bool left = m_layout == left_asymmetric
+			|| m_layout == rotating_n_restart;
+		pd = left ? n - 1 - s % n : s % n;
+		qd = pd + 1;
+		if (pd == n - 1) {
+			++dd;
+			qd = 0;
+		} else if (dd >= pd) {
+			dd += 2;
+		}
+		ddf = m_layout == rotating_zero_restart
+			|| m_layout == rotating_n_restart;
+		break;
+	}
+	case left_symmetric:
+	case right_symmetric:
+		pd = m_layout == left_symmetric ? n - 1 - stripe % n : stripe % n;
+		qd = (pd + 1) % n;
+		dd = (pd + 2 + dd) % n;
+		break;
+	case parity_0:
+		pd = 0;
+		qd = 1;
+		dd += 2;
+		break;
+	case parity_n:
+		pd = data;
+		qd = data + 1;
+		break;
+	case rotating_n_continue:
+		pd = n - 1 - stripe % n;
+		qd = (pd + n - 1) % n;
+		dd = (pd + 1 + dd) % n;
+		ddf = true;
+		break;
+	case left_asymmetric_6:
+	case right_asymmetric_6:
+		pd = m_layout == left_asymmetric_6
+			? data - stripe % (n - 1) : stripe % (n - 1);
+		if (dd >= pd)
+			++dd;
+		qd = n - 1;
+		break;
+	case left_symmetric_6:
+	case right_symmetric_6:
+		pd = m_layout == left_symmetric_6
+			? data - stripe % (n - 1) : stripe % (n - 1);
+		dd = (pd + 1 + dd) % (n - 1);
+		qd = n - 1;
+		break;
+	case parity_0_6:
+		pd = 0;
+		++dd;
+		qd = n - 1;
+		break;
+	}
+	return dd;
+}
+
+size_t raid::locate(off_t block, off_t& stripe, off_t& lblock,
+		off_t& left) const {
+	off_t n = block / chunk, within = block % chunk;
+	size_t data = legs.size() - parity;
+	stripe = n / data;
+	lblock = stripe * chunk + within;
+	left = chunk - within;
+	size_t pd, qd;
+	bool ddf;
+	return place(stripe, n % data, pd, qd, ddf);
+}
+
+int raid::read_chunk(size_t leg, off_t stripe, off_t lblock, uint8_t *buf,
+		size_t count) {
+	if (!failed[leg]) {
+		int err = legs[leg]->read_blocks(lblock, buf, count);
+		if (err == int(count * BlockSize))
+			return err;
+		// A short read means the leg is missing data, which it won't
+		// have next time either
+		__sync_bool_compare_and_swap(&failed[leg], 0, 1);
+	}
+	return rebuild(leg, stripe, lblock, buf, count);
+}
+
+// Rebuild data leg 'x' from the others: by P if it's the only data missing,
+// else by Q, else by P and Q together if two are missing.
+int raid::rebuild(size_t x, off_t stripe, off_t lblock, uint8_t *buf,
+		size_t count) {
+	size_t n = legs.size(), size = count * BlockSize;
+	buffer *scratch = take_buffer();
+	uint8_t *data = &(*scratch)[0];
+	std::vector<leg_read> reads(n);
+	std::vector<workpool::job*> jobs;
+	for (size_t i = 0; i < n; ++i) {
+		reads[i].ok = false;
+		if (i == x || failed[i])
+			continue;
+		reads[i].tgt = legs[i].get();
+		reads[i].block = lblock;
+		reads[i].buf = &data[i * size];
+		reads[i].count = count;
+		jobs.push_back(&reads[i]);
+	}
+	if (!jobs.empty())
+		workpool::io().run(&jobs[0], jobs.size());
+	
+	// Each data leg's Q coefficient is {02}^slot. md numbers slots from the
+	// leg after Q, counting only data; DDF layouts number every leg.
+	size_t pd, qd;
+	bool ddf;
+	place(stripe, 0, pd, qd, ddf);
+	std::vector<uint8_t> coeff(n);
+	std::vector<size_t> missing;
+	size_t start = ddf || qd >= n - 1 ? 0 : qd + 1;
+	for (size_t k = 0, slot = 0; k < n; ++k) {
+		size_t i = (start + k) % n;
+		if (i == pd || i == qd)
+			continue;
+		coeff[i] = parity::exp2(ddf ? i : slot++);
+		if (!reads[i].ok)
+			missing.push_back(i);
+	}
+	bool have_p = reads[pd].ok, have_q = qd < n && reads[qd].ok;
+	
+	// Syndromes of the data we have, into P and Q
+	for (size_t i = 0; i < n; ++i) {
+		if (i == pd || i == qd || !reads[i].ok)
+			continue;
+		if (have_p)
+			parity::xor_into(&data[pd * size], &data[i * size], size);
+		if (have_q)
+			parity::mul_xor_into(&data[qd * size], &data[i * size], coeff[i],
+				size);
+	}
+	
+	if (missing.size() == 1 && have_p) {
+		memcpy(buf, &data[pd * size], size);
+	} else if (missing.size() == 1 && have_q) {
+		memcpy(buf, &data[qd * size], size);
+		parity::scale(buf, parity::inverse(coeff[x]), size);
+	} else if (missing.size() == 2 && have_p && have_q) {
+		// Dx ^ Dy = P', a.Dx ^ b.Dy = Q', so Dx = (Q' ^ b.P') / (a ^ b)
+		size_t y = missing[0] == x ? missing[1] : missing[0];
+		uint8_t a = coeff[x], b = coeff[y];
+		uint8_t inv = parity::inverse(a ^ b);
+		memcpy(buf, &data[qd * size], size);
+		parity::scale(buf, inv, size);
+		parity::mul_xor_into(buf, &data[pd * size], parity::mul(b, inv), size);
+	} else {
+		give_buffer(scratch);
+		return -EIO;
+	}
+	give_buffer(scratch);
+	return size;
+}
+
+int raid::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	off_t stripe, lblock, left;
+	size_t leg = locate(block, stripe, lblock, left);
+	if (!failed[leg]) {
+		int err = legs[leg]->read(lblock, buf, offset, size);
+		if (err == int(size))
+			return err;
+	}
+	uint8_t whole[BlockSize];
+	int err = read_chunk(leg, stripe, lblock, whole, 1);
+	if (err < 0)
+		return err;
+	memcpy(buf, whole + offset, size);
+	return size;
+}
+
+// Chunks are read in parallel, each rebuilt on its own if need be
+int raid::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	std::vector<job> chunks;
+	for (size_t done = 0; done < count; ) {
+		job j;
+		j.r = this;
+		off_t left;
+		j.leg = locate(block + done, j.stripe, j.lblock, left);
+		j.buf = buf + done * BlockSize;
+		j.count = left < off_t(count - done) ? left : count - done;
+		j.err = 0;
+		chunks.push_back(j);
+		done += j.count;
+	}
+	
+	if (chunks.size() == 1) {
+		chunks[0].run();
+	} else {
+		std::vector<workpool::job*> jobs;
+		for (size_t i = 0; i < chunks.size(); ++i)
+			jobs.push_back(&chunks[i]);
+		workpool::io().run(&jobs[0], jobs.size());
+	}
+	for (size_t i = 0; i < chunks.size(); ++i)
+		if (chunks[i].err < 0)
+			return chunks[i].err;
+	return count * BlockSize;
+}
+
+} } // namespace devmapper::targets
@@ -0,0 +1,333 @@
+#include "dm.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace devmapper {
+
+namespace targets {
+
+static const size_t PageBlocks = 8;
+static const size_t PageBytes = PageBlocks * BlockSize;
+static const char Magic[8] = { 'L', 'V', 'M', 'F', 'S', 'S', 'D', 'C' };
+static const uint32_t Version = 1;
+static const size_t KeyBytes = 256;
+
+// At the start of the file. Fields are in host order: the cache is local.
+struct ssd_cache::header {
+	char magic[8];
+	uint32_t version, page_bytes;
+	uint64_t pages;
+	char key[KeyBytes];
+};
+
+// One way of one set. Slots follow the header page, and the pages of data
+// follow the slots, in the same order.
+struct ssd_cache::slot {
+	uint64_t page;		// source page + 1, or Empty or Filling
+	uint32_t crc;
+	uint16_t freq;
+	uint16_t unused;
+};
+
+static const uint64_t Empty = 0, Filling = ~0ULL;
+
+static uint64_t mix(uint64_t x) {
+	x *= 0x9e3779b97f4a7c15ULL;
+	return x ^ (x >> 29);
+}
+
+static uint32_t page_crc(const uint8_t *buf) {
+	return crc32(crc32(0, Z_NULL, 0), buf, PageBytes);
+}
+
+static size_t round_up(size_t n, size_t to) {
+	return (n + to - 1) / to * to;
+}
+
+ssd_cache::ssd_cache(target::ptr src, const std::string& path,
+		const std::string& key, size_t bytes)
+	: source(src), fd(-1), map(NULL), map_size(0),
+	pages(bytes / PageBytes / Ways * Ways), sets(pages / Ways), slots(NULL),
+	seen(pages * 4), m_sightings(0) {
+	if (!sets)
+		throw exception("SSD cache is smaller than one set");
+	if (key.size() >= KeyBytes)
+		throw exception("SSD cache key is too long");
+	for (size_t i = 0; i < Locks; ++i)
+		pthread_mutex_init(&locks[i], NULL);
+	memset(&m_stats, 0, sizeof(m_stats));
+	open(path, key);
+}
+
+ssd_cache::~ssd_cache() {
+	if (map) {
+		msync(map, map_size, MS_SYNC);
+		munmap(map, map_size);
+	}
+	if (fd != -1)
+		close(fd);
+	for (size_t i = 0; i < Locks; ++i)
+		pthread_mutex_destroy(&locks[i]);
+}
+
+// Reuse the file if it was made for the same source and size, else start
+// it afresh
+void ssd_cache::open(const std::string& path, const std::string& key) {
+	if ((fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600)) == -1)
+		throw exception("Can't open SSD cache " + path + ": "
+			+ strerror(errno));
+	// Another process using it would have its index changed underneath it
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		std::string why = errno == EWOULDBLOCK ? "it's in use elsewhere"
+			: strerror(errno);
+		close(fd);
+		fd = -1;
+		throw exception("Can't lock SSD cache " + path + ": " + why);
+	}
+	
+	map_size = PageBytes + round_up(pages * sizeof(slot), PageBytes);
+	data_start = map_size;
+	off_t size = data_start + off_t(pages) * PageBytes;
+	
+	struct stat st;
+	header hdr;
+	bool reuse = fstat(fd, &st) == 0 && st.st_size == size
+		&& pread(fd, &hdr, sizeof(hdr), 0) == ssize_t(sizeof(hdr))
+		&& !memcmp(hdr.magic, Magic, sizeof(Magic))
+		&& hdr.version == Version && hdr.page_bytes == PageBytes
+		&& hdr.pages == pages
+		&& !strncmp(hdr.key, key.c_str(), KeyBytes);
+	if (!reuse && (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1))
+		throw exception("Can't size SSD cache " + path + ": "
+			+ strerror(errno));
+	
+	void *m = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		throw exception("Can't map SSD cache " + path + ": " + strerror(errno));
+	map = static_cast<uint8_t*>(m);
+	slots = reinterpret_cast<slot*>(map + PageBytes);
+	
+	if (!reuse) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, Magic, sizeof(Magic));
+		hdr.version = Version;
+		hdr.page_bytes = PageBytes;
+		hdr.pages = pages;
+		memcpy(hdr.key, key.data(), key.size());
+		memcpy(map, &hdr, sizeof(hdr));
+	}
+	
+	// Pages being written when we last stopped can't be trusted
+	for (size_t i = 0; i < pages; ++i)
+		if (slots[i].page == Filling)
+			slots[i].page = Empty;
+}
+
+size_t ssd_cache::set_of(off_t page) const {
+	return mix(page) % sets;
+}
+
+// Copy out a page, if we have it intact
+bool ssd_cache::lookup(off_t page, uint8_t *buf) {
+	size_t set = set_of(page);
+	pthread_mutex_t *lock = &locks[set % Locks];
+	slot *ways = slots + set * Ways;
+	
+	pthread_mutex_lock(lock);
+	size_t way = 0;
+	while (way < Ways && ways[way].page != uint64_t(page) + 1)
+		++way;
+	uint32_t crc = 0;
+	if (way < Ways) {
+		crc = ways[way].crc;
+		if (ways[way].freq < 0xffff)
+			++ways[way].freq;
+	}
+	pthread_mutex_unlock(lock);
+	if (way == Ways)
+		return false;
+	
+	size_t index = set * Ways + way;
+	if (pread(fd, buf, PageBytes, data_start + off_t(index) * PageBytes)
+				== ssize_t(PageBytes)
+			&& page_crc(buf) == crc)
+		return true;
+	
+	// Corrupt, or replaced while we read it
+	pthread_mutex_lock(lock);
+	if (ways[way].page == uint64_t(page) + 1 && ways[way].crc == crc) {
+		ways[way].page = Empty;
+		__sync_fetch_and_add(&m_stats.corrupt, 1);
+	}
+	pthread_mutex_unlock(lock);
+	return false;
+}
+
+// Store a page that missed, if it's been missed before and is wanted more
+// than what it would replace
+void ssd_cache::admit(off_t page, const uint8_t *buf) {
+	// Approximate counts, halved now and then so old popularity fades.
+	// Races between threads only lose the odd count.
+	if (__sync_add_and_fetch(&m_sightings, 1) % (seen.size() * 8) == 0)
+		for (size_t i = 0; i < seen.size(); ++i)
+			seen[i] /= 2;
+	uint8_t& seen_count = seen[mix(page) % seen.size()];
+	uint16_t freq = seen_count < 0xff ? ++seen_count : seen_count;
+	if (freq < 2)
+		return;
+	
+	size_t set = set_of(page);
+	pthread_mutex_t *lock = &locks[set % Locks];
+	slot *ways = slots + set * Ways;
+	
+	pthread_mutex_lock(lock);
+	size_t victim = Ways;
+	for (size_t way = 0; way < Ways; ++way) {
+		if (ways[way].page == uint64_t(page) + 1) { // someone beat us
+			pthread_mutex_unlock(lock);
+			return;
+		}
+		if (ways[way].page == Filling)
+			continue;
+		if (victim == Ways || ways[way].page == Empty
+				|| (ways[victim].page != Empty
+					&& ways[way].freq < ways[victim].freq))
+			victim = way;
+	}
+	bool admit = victim < Ways && (ways[victim].page == Empty
+		|| ways[victim].freq < freq);
+	if (victim < Ways && !admit && ways[victim].freq)
+		--ways[victim].freq; // age it, so newly hot pages get in eventually
+	if (admit)
+		ways[victim].page = Filling;
+	pthread_mutex_unlock(lock);
+	if (!admit)
+		return;
+	
+	size_t index = set * Ways + victim;
+	bool ok = pwrite(fd, buf, PageBytes, data_start + off_t(index) * PageBytes)
+		== ssize_t(PageBytes);
+	
+	pthread_mutex_lock(lock);
+	if (ok) {
+		ways[victim].crc = page_crc(buf);
+		ways[victim].freq = freq;
+		ways[victim].page = page + 1;
+		__sync_fetch_and_add(&m_stats.admitted, 1);
+	} else {
+		ways[victim].page = Empty;
+	}
+	pthread_mutex_unlock(lock);
+}
+
+// Return bytes of the page available, as read_blocks()
+int ssd_cache::read_page(off_t page, uint8_t *buf) {
+	if (lookup(page, buf)) {
+		__sync_fetch_and_add(&m_stats.hits, 1);
+		return PageBytes;
+	}
+	__sync_fetch_and_add(&m_stats.misses, 1);
+	int err = source->read_blocks(page * PageBlocks, buf, PageBlocks);
+	if (err == int(PageBytes))
+		admit(page, buf);
+	return err;
+}
+
+int ssd_cache::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	uint8_t page[PageBytes];
+	int err = read_page(block / PageBlocks, page);
+	if (err < 0)
+		return err;
+	size_t start = (block % PageBlocks) * BlockSize + offset;
+	if (size_t(err) <= start)
+		return 0;
+	if (size > err - start)
+		size = err - start;
+	memcpy(buf, page + start, size);
+	return size;
+}
+
+// Read whole pages that missed, in one go, and offer them for admission
+int ssd_cache::read_run(off_t block, uint8_t *buf, size_t count) {
+	int err = source->read_blocks(block, buf, count);
+	if (err < 0)
+		return err;
+	for (size_t i = 0; (i + 1) * PageBytes <= size_t(err); ++i)
+		admit(block / PageBlocks + i, buf + i * PageBytes);
+	return err;
+}
+
+int ssd_cache::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	size_t done = 0, missed = 0; // in blocks; 'missed' pages precede 'done'
+	while (done < count) {
+		off_t b = block + done;
+		size_t skip = b % PageBlocks;
+		bool whole = !skip && count - done >= PageBlocks;
+		
+		if (whole) {
+			if (!lookup(b / PageBlocks, buf + done * BlockSize)) {
+				__sync_fetch_and_add(&m_stats.misses, 1);
+				missed += PageBlocks;
+				done += PageBlocks;
+				continue;
+			}
+			__sync_fetch_and_add(&m_stats.hits, 1);
+		}
+		
+		if (missed) {
+			size_t first = done - missed;
+			int err = read_run(block + first, buf + first * BlockSize, missed);
+			if (err < 0)
+				return err;
+			if (size_t(err) != missed * BlockSize)
+				return first * BlockSize + err;
+			missed = 0;
+		}
+		
+		if (whole) { // the hit above
+			done += PageBlocks;
+			continue;
+		}
+		
+		// Part of a page
+		uint8_t page[PageBytes];
+		int err = read_page(b / PageBlocks, page);
+		if (err < 0)
+			return err;
+		size_t want = PageBlocks - skip;
+		if (want > count - done)
+			want = count - done;
+		size_t have = size_t(err) > skip * BlockSize
+			? size_t(err) / BlockSize - skip : 0;
+		if (have > want)
+			have = want;
+		memcpy(buf + done * BlockSize, page + skip * BlockSize,
+			have * BlockSize);
+		done += have;
+		if (have != want)
+			return done * BlockSize;
+	}
+	
+	if (missed) {
+		size_t first = done - missed;
+		int err = read_run(block + first, buf + first * BlockSize, missed);
+		if (err < 0)
+			return err;
+		return first * BlockSize + err;
+	}
+	return done * BlockSize;
+}
+
+bool ssd_cache::allocated(off_t block, off_t& count) {
+	return source->allocated(block, count);
+}
+
+} } // namespace devmapper::targets
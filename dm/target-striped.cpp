@@ -0,0 +1,70 @@
+#include "dm.hpp"
+
+namespace devmapper {
+
+namespace targets {
+
+striped::striped(const std::vector<target::ptr>& stripes, off_t chunk)
+	: stripes(stripes), chunk(chunk) { }
+
+target& striped::locate(off_t block, off_t& sblock, off_t& left) const {
+	off_t n = block / chunk, within = block % chunk;
+	sblock = (n / stripes.size()) * chunk + within;
+	left = chunk - within;
+	return *stripes[n % stripes.size()];
+}
+
+int striped::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	off_t sblock, left;
+	target& tgt = locate(block, sblock, left);
+	return tgt.read(sblock, buf, offset, size);
+}
+
+int striped::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	off_t sblock, left;
+	target& tgt = locate(block, sblock, left);
+	if (left >= off_t(count))
+		return tgt.read_blocks(sblock, buf, count);
+	
+	// We may be on a pool thread already, so don't wait on read_async()
+	size_t parts = (block % chunk + count + chunk - 1) / chunk;
+	fanout f(parts);
+	for (size_t i = 0; i < parts; ++i) {
+		off_t sblock, left;
+		target& tgt = locate(block, sblock, left);
+		size_t n = left < off_t(count) ? left : count;
+		f.read(i, tgt, sblock, buf, n);
+		block += n;
+		buf += n * BlockSize;
+		count -= n;
+	}
+	return f.run();
+}
+
+bool striped::allocated(off_t block, off_t& count) {
+	off_t sblock, left;
+	target& tgt = locate(block, sblock, left);
+	bool data = tgt.allocated(sblock, count);
+	if (count <= 0 || count > left)
+		count = left;
+	return data;
+}
+
+// Every chunk goes to its stripe at once
+void striped::read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c) {
+	size_t parts = (block % chunk + count + chunk - 1) / chunk;
+	gather *g = new gather(c, parts);
+	for (size_t i = 0; i < parts; ++i) {
+		off_t sblock, left;
+		target& tgt = locate(block, sblock, left);
+		size_t n = left < off_t(count) ? left : count;
+		g->read(i, tgt, sblock, buf, n);
+		block += n;
+		buf += n * BlockSize;
+		count -= n;
+	}
+	g->issued();
+}
+
+} } // namespace devmapper::targets
@@ -0,0 +1,121 @@
+#include "dm.hpp"
+
+#include <errno.h>
+
+namespace devmapper {
+
+namespace targets {
+
+void table::add(off_t length, target::ptr tgt) {
+	segment seg = { size(), length, tgt };
+	segments.push_back(seg);
+}
+
+off_t table::size() const {
+	if (segments.empty())
+		return 0;
+	const segment& last = segments.back();
+	return last.start + last.length;
+}
+
+const table::segment *table::find(off_t block) const {
+	size_t lo = 0, hi = segments.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		const segment& seg = segments[mid];
+		if (block < seg.start)
+			hi = mid;
+		else if (block >= seg.start + seg.length)
+			lo = mid + 1;
+		else
+			return &seg;
+	}
+	return NULL;
+}
+
+int table::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	const segment *seg = find(block);
+	if (!seg)
+		return block < 0 ? -EINVAL : 0;
+	return seg->tgt->read(block - seg->start, buf, offset, size);
+}
+
+int table::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	const segment *seg = find(block);
+	if (seg && block + off_t(count) <= seg->start + seg->length)
+		return seg->tgt->read_blocks(block - seg->start, buf, count);
+	if (!seg)
+		return block < 0 ? -EINVAL : 0;
+	
+	// We may be on a pool thread already, so don't wait on read_async()
+	off_t end = block + count;
+	if (end > size())
+		end = size();
+	const segment *last = find(end - 1);
+	fanout f(last - seg + 1);
+	for (const segment *s = seg; s <= last; ++s) {
+		off_t from = s == seg ? block : s->start;
+		off_t to = s == last ? end : s->start + s->length;
+		f.read(s - seg, *s->tgt, from - s->start,
+			buf + (from - block) * BlockSize, to - from);
+	}
+	return f.run();
+}
+
+bool table::allocated(off_t block, off_t& count) {
+	const segment *seg = find(block);
+	if (!seg) {
+		count = 0;
+		return false;
+	}
+	
+	off_t left = seg->start + seg->length - block;
+	bool data = seg->tgt->allocated(block - seg->start, count);
+	if (count <= 0 || count > left)
+		count = left;
+	return data;
+}
+
+bool table::direct(off_t block, off_t& count, int& fd, off_t& offset) {
+	const segment *seg = find(block);
+	if (!seg) {
+		count = 0;
+		return false;
+	}
+	
+	off_t left = seg->start + seg->length - block;
+	bool found = seg->tgt->direct(block - seg->start, count, fd, offset);
+	if (count <= 0 || count > left)
+		count = left;
+	return found;
+}
+
+void table::read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c) {
+	const segment *first = find(block);
+	if (!first) {
+		c->done(block < 0 ? -EINVAL : 0);
+		return;
+	}
+	
+	// Trim to the end of the table, and see how many segments we touch
+	off_t end = block + count;
+	if (end > size())
+		end = size();
+	const segment *last = find(end - 1);
+	if (first == last) {
+		first->tgt->read_async(block - first->start, buf, end - block, c);
+		return;
+	}
+	
+	gather *g = new gather(c, last - first + 1);
+	for (const segment *seg = first; seg <= last; ++seg) {
+		off_t from = seg == first ? block : seg->start;
+		off_t to = seg == last ? end : seg->start + seg->length;
+		g->read(seg - first, *seg->tgt, from - seg->start,
+			buf + (from - block) * BlockSize, to - from);
+	}
+	g->issued();
+}
+
+} } // namespace devmapper::targets
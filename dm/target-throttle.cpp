@@ -0,0 +1,158 @@
+#include "dm.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <errno.h>
+
+namespace devmapper {
+
+namespace targets {
+
+// One reader's view. Its reads take turns with each other, so only one at a
+// time waits on the shared buckets, interleaved with other readers'.
+struct throttle::reader : public target {
+	reader(SHARED_PTR<throttle> t) : parent(t), next(0), serving(0) {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&turn, NULL);
+	}
+	
+	virtual ~reader() {
+		pthread_cond_destroy(&turn);
+		pthread_mutex_destroy(&lock);
+	}
+	
+	void wait(size_t size) {
+		pthread_mutex_lock(&lock);
+		uint64_t ticket = next++;
+		while (serving != ticket)
+			pthread_cond_wait(&turn, &lock);
+		pthread_mutex_unlock(&lock);
+		
+		parent->wait(size);
+		
+		pthread_mutex_lock(&lock);
+		++serving;
+		pthread_cond_broadcast(&turn);
+		pthread_mutex_unlock(&lock);
+	}
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		wait(size);
+		return parent->source->read(block, buf, offset, size);
+	}
+	
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count) {
+		wait(count * BlockSize);
+		return parent->source->read_blocks(block, buf, count);
+	}
+	
+	virtual bool allocated(off_t block, off_t& count) {
+		return parent->source->allocated(block, count);
+	}
+	
+private:
+	SHARED_PTR<throttle> parent;
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	uint64_t next, serving;
+};
+
+struct throttle::settings : public fuse_control {
+	settings(SHARED_PTR<throttle> t) : parent(t) { }
+	
+	virtual std::string get() {
+		limits l = parent->current();
+		std::ostringstream os;
+		os << "bytes_per_sec " << l.bytes_per_sec << "\n"
+			<< "ios_per_sec " << l.ios_per_sec << "\n"
+			<< "burst_bytes " << l.burst_bytes << "\n"
+			<< "burst_ios " << l.burst_ios << "\n";
+		return os.str();
+	}
+	
+	virtual int set(const std::string& text) {
+		limits l = parent->current();
+		std::istringstream is(text);
+		std::string key, word;
+		while (is >> key) {
+			// Streams would take "-1" as a huge limit
+			uint64_t val;
+			if (!(is >> word) || word[0] == '-' ||
+					!(std::istringstream(word) >> val))
+				return -EINVAL;
+			if (key == "bytes_per_sec")
+				l.bytes_per_sec = val;
+			else if (key == "ios_per_sec")
+				l.ios_per_sec = val;
+			else if (key == "burst_bytes")
+				l.burst_bytes = val;
+			else if (key == "burst_ios")
+				l.burst_ios = val;
+			else
+				return -EINVAL;
+		}
+		parent->configure(l);
+		return 0;
+	}
+	
+private:
+	SHARED_PTR<throttle> parent;
+};
+
+throttle::limits::limits()
+	: bytes_per_sec(0), ios_per_sec(0), burst_bytes(0), burst_ios(0) { }
+
+throttle::throttle(target::ptr src, const limits& l) : source(src) {
+	configure(l);
+}
+
+void throttle::configure(const limits& l) {
+	bytes.configure(l.bytes_per_sec, l.burst_bytes);
+	ios.configure(l.ios_per_sec, l.burst_ios);
+}
+
+throttle::limits throttle::current() const {
+	limits l;
+	l.bytes_per_sec = bytes.rate();
+	l.burst_bytes = bytes.burst();
+	l.ios_per_sec = ios.rate();
+	l.burst_ios = ios.burst();
+	return l;
+}
+
+// Nap a little at a time, so raising a limit frees waiters quickly
+void throttle::wait(size_t size) {
+	uint64_t brate = bytes.rate(), irate = ios.rate();
+	uint64_t b = bytes.reserve(size), i = ios.reserve(1);
+	while (b || i) {
+		uint64_t nap = std::min(std::max(b, i), token_bucket::LongestNap);
+		token_bucket::sleep(nap);
+		b = bytes.rewait(b > nap ? b - nap : 0, brate);
+		i = ios.rewait(i > nap ? i - nap : 0, irate);
+	}
+}
+
+int throttle::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	wait(size);
+	return source->read(block, buf, offset, size);
+}
+
+int throttle::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	wait(count * BlockSize);
+	return source->read_blocks(block, buf, count);
+}
+
+bool throttle::allocated(off_t block, off_t& count) {
+	return source->allocated(block, count);
+}
+
+target::ptr throttle::open_reader() {
+	return target::ptr(new reader(shared_from_this()));
+}
+
+fuse_control::ptr throttle::control() {
+	return fuse_control::ptr(new settings(shared_from_this()));
+}
+
+} } // namespace devmapper::targets
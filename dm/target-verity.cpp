@@ -0,0 +1,289 @@
+#include "dm.hpp"
+#include "crypto.hpp"
+#include "workpool.hpp"
+
+#include <algorithm>
+#include <list>
+#include <map>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+using devmapper::crypto::sha256;
+
+namespace devmapper {
+
+namespace targets {
+
+// Data blocks hashed per parallel job; also the multi-buffer batch size
+static const size_t JobBlocks = 8;
+
+static bool power_of_two(size_t n) {
+	return n && !(n & (n - 1));
+}
+
+// Verified hash tree blocks, by block number on the hash target, evicting
+// the least recently used
+struct verity::cache {
+	typedef std::list<off_t> lru_t;
+	struct entry {
+		std::vector<uint8_t> data;
+		lru_t::iterator pos;
+	};
+	typedef std::map<off_t, entry> map_t;
+	
+	cache(size_t max) : max(max) { pthread_mutex_init(&lock, NULL); }
+	~cache() { pthread_mutex_destroy(&lock); }
+	
+	// Copy out part of a cached block, if we have it
+	bool get(off_t block, size_t offset, uint8_t *buf, size_t size) {
+		pthread_mutex_lock(&lock);
+		map_t::iterator it = blocks.find(block);
+		bool found = it != blocks.end();
+		if (found) {
+			memcpy(buf, &it->second.data[offset], size);
+			lru.splice(lru.begin(), lru, it->second.pos);
+		}
+		pthread_mutex_unlock(&lock);
+		return found;
+	}
+	
+	void put(off_t block, const std::vector<uint8_t>& data) {
+		pthread_mutex_lock(&lock);
+		if (blocks.find(block) == blocks.end()) {
+			if (blocks.size() >= max && !lru.empty()) {
+				blocks.erase(lru.back());
+				lru.pop_back();
+			}
+			entry& e = blocks[block];
+			e.data = data;
+			lru.push_front(block);
+			e.pos = lru.begin();
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	
+private:
+	size_t max;
+	pthread_mutex_t lock;
+	map_t blocks;
+	lru_t lru;
+};
+
+struct verity::job : public workpool::job {
+	verity *v;
+	off_t index;
+	const uint8_t *buf;
+	size_t count;
+	int err;
+	
+	virtual void run() { err = v->check(index, buf, count); }
+};
+
+verity::params::params()
+	: version(1), data_block_size(4096), hash_block_size(4096),
+	data_blocks(0), hash_start(0), cache_blocks(1024) { }
+
+verity::verity(target::ptr data, target::ptr hash, const params& p,
+		workpool *pool)
+	: data(data), hash(hash), par(p), m_cache(NULL),
+	pool(pool ? *pool : workpool::shared()) {
+	if (par.version != 0 && par.version != 1)
+		throw exception("Unknown verity hash format");
+	if (!power_of_two(par.data_block_size) ||
+			par.data_block_size < BlockSize ||
+			!power_of_two(par.hash_block_size) ||
+			par.hash_block_size < BlockSize)
+		throw exception("Bad verity block size");
+	if (par.root_digest.size() != sha256::DigestBytes)
+		throw exception("Bad verity root digest");
+	
+	sectors_per_block = par.data_block_size / BlockSize;
+	bits = 0;
+	while ((size_t(2) << bits) <= par.hash_block_size / sha256::DigestBytes)
+		++bits;
+	entry_size = par.version ? par.hash_block_size >> bits
+		: sha256::DigestBytes;
+	
+	// Tree levels are stored top first, each packed after the last
+	levels = 0;
+	if (par.data_blocks)
+		while (bits * levels < 64 &&
+				uint64_t(par.data_blocks - 1) >> (bits * levels))
+			++levels;
+	level_start.resize(levels);
+	off_t pos = par.hash_start;
+	for (int i = levels - 1; i >= 0; --i) {
+		level_start[i] = pos;
+		int shift = (i + 1) * bits;
+		pos += (par.data_blocks + (off_t(1) << shift) - 1) >> shift;
+	}
+	
+	m_cache = new cache(par.cache_blocks);
+}
+
+verity::~verity() {
+	delete m_cache;
+}
+
+// Level zero is data blocks, level N is hash blocks pointing at level N - 1
+int verity::expected(int level, off_t index, uint8_t *digest) {
+	if (level == levels) {
+		memcpy(digest, par.root_digest.data(), sha256::DigestBytes);
+		return 0;
+	}
+	
+	off_t parent = index >> bits;
+	off_t block = level_start[level] + parent;
+	size_t offset = (index & ((off_t(1) << bits) - 1)) * entry_size;
+	if (m_cache->get(block, offset, digest, sha256::DigestBytes))
+		return 0;
+	
+	// Fetch the parent and check it against its own parent
+	uint8_t want[sha256::DigestBytes], have[sha256::DigestBytes];
+	int err = expected(level + 1, parent, want);
+	if (err)
+		return err;
+	
+	std::vector<uint8_t> buf(par.hash_block_size);
+	size_t sectors = par.hash_block_size / BlockSize;
+	err = hash->read_blocks(block * sectors, &buf[0], sectors);
+	if (err < 0)
+		return err;
+	if (err != int(buf.size()))
+		return -EIO;
+	
+	const uint8_t *msg = &buf[0];
+	uint8_t *out = have;
+	sha256::hash_many(par.salt, par.version == 1, &msg, buf.size(), &out, 1);
+	if (memcmp(want, have, sha256::DigestBytes) != 0)
+		return -EIO;
+	
+	m_cache->put(block, buf);
+	memcpy(digest, &buf[offset], sha256::DigestBytes);
+	return 0;
+}
+
+int verity::expected(off_t index, uint8_t *digest) {
+	return expected(0, index, digest);
+}
+
+int verity::check(off_t index, const uint8_t *buf, size_t count) {
+	for (size_t done = 0; done < count; done += JobBlocks) {
+		size_t n = std::min(JobBlocks, count - done);
+		const uint8_t *msgs[JobBlocks];
+		uint8_t have[JobBlocks][sha256::DigestBytes], *outs[JobBlocks];
+		for (size_t i = 0; i < n; ++i) {
+			msgs[i] = buf + (done + i) * par.data_block_size;
+			outs[i] = have[i];
+		}
+		sha256::hash_many(par.salt, par.version == 1, msgs,
+			par.data_block_size, outs, n);
+		
+		for (size_t i = 0; i < n; ++i) {
+			uint8_t want[sha256::DigestBytes];
+			int err = expected(0, index + done + i, want);
+			if (err)
+				return err;
+			if (memcmp(want, have[i], sha256::DigestBytes) != 0)
+				return -EIO;
+		}
+	}
+	return 0;
+}
+
+int verity::verify(off_t index, const uint8_t *buf, size_t count) {
+	size_t jobs = std::min(pool.size() + 1, count / JobBlocks);
+	if (jobs < 2)
+		return check(index, buf, count);
+	
+	std::vector<job> work(jobs);
+	std::vector<workpool::job*> ptrs(jobs);
+	size_t per = count / jobs, extra = count % jobs;
+	for (size_t i = 0; i < jobs; ++i) {
+		size_t n = per + (i < extra ? 1 : 0);
+		work[i].v = this;
+		work[i].index = index;
+		work[i].buf = buf;
+		work[i].count = n;
+		ptrs[i] = &work[i];
+		index += n;
+		buf += n * par.data_block_size;
+	}
+	pool.run(&ptrs[0], jobs);
+	
+	for (size_t i = 0; i < jobs; ++i)
+		if (work[i].err)
+			return work[i].err;
+	return 0;
+}
+
+// Read and check data blocks, returning how many good ones lead the range,
+// or a negative errno if the first isn't good
+int verity::read_data(off_t first, size_t count, uint8_t *buf) {
+	int err = data->read_blocks(first * sectors_per_block, buf,
+		count * sectors_per_block);
+	if (err < 0)
+		return err;
+	size_t have = std::min(count, err / par.data_block_size);
+	if (!have)
+		return -EIO;
+	err = verify(first, buf, have);
+	if (!err)
+		return have;
+	
+	// Something's bad, find out where it starts
+	size_t good = 0;
+	while (good < have && !check(first + good,
+			buf + good * par.data_block_size, 1))
+		++good;
+	return good ? int(good) : err;
+}
+
+int verity::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	off_t index = block / sectors_per_block;
+	if (index >= par.data_blocks)
+		return 0;
+	
+	std::vector<uint8_t> bounce(par.data_block_size);
+	int err = read_data(index, 1, &bounce[0]);
+	if (err < 0)
+		return err;
+	size_t skip = (block % sectors_per_block) * BlockSize;
+	memcpy(buf, &bounce[skip + offset], size);
+	return size;
+}
+
+// Like any target, a bad block or the end cuts the read short
+int verity::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	off_t first = block / sectors_per_block;
+	off_t end = (block + count + sectors_per_block - 1) / sectors_per_block;
+	if (end > par.data_blocks)
+		end = par.data_blocks;
+	if (first >= end)
+		return 0;
+	
+	size_t blocks = end - first;
+	size_t skip = block - first * sectors_per_block;
+	
+	// Aligned reads can be verified in place
+	uint8_t *dest = buf;
+	std::vector<uint8_t> bounce;
+	if (skip || count < blocks * sectors_per_block) {
+		bounce.resize(blocks * par.data_block_size);
+		dest = &bounce[0];
+	}
+	int good = read_data(first, blocks, dest);
+	if (good < 0)
+		return good;
+	
+	size_t avail = good * sectors_per_block - skip;
+	if (count > avail)
+		count = avail;
+	if (dest != buf)
+		memcpy(buf, &bounce[skip * BlockSize], count * BlockSize);
+	return count * BlockSize;
+}
+
+} } // namespace devmapper::targets
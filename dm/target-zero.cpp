@@ -0,0 +1,24 @@
+#include "dm.hpp"
+
+#include <string.h>
+
+namespace devmapper {
+
+namespace targets {
+
+int zero::read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+	memset(buf, 0, size);
+	return size;
+}
+
+int zero::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	memset(buf, 0, count * BlockSize);
+	return count * BlockSize;
+}
+
+bool zero::allocated(off_t block, off_t& count) {
+	count = 0;
+	return false;
+}
+
+} } // namespace devmapper::targets
@@ -0,0 +1,199 @@
+#include "dm.hpp"
+#include "workpool.hpp"
+
+#include <errno.h>
+
+namespace devmapper {
+
+// Runs a synchronous read for read_async(), then cleans itself up
+struct async_read : public workpool::job {
+	target *tgt;
+	off_t block;
+	uint8_t *buf;
+	size_t count;
+	target::completion *c;
+	
+	virtual void run() {
+		c->done(tgt->read_blocks(block, buf, count));
+		delete this;
+	}
+};
+
+int target::read_blocks(off_t block, uint8_t *buf, size_t count) {
+	for (size_t i = 0; i < count; ++i, buf += BlockSize) {
+		int err = read(block + i, buf, 0, BlockSize);
+		if (err < 0)
+			return err;
+		if (err != BlockSize)
+			return i * BlockSize + err;
+	}
+	return count * BlockSize;
+}
+
+bool target::allocated(off_t block, off_t& count) {
+	count = 0;
+	return true;
+}
+
+void target::read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c) {
+	async_read *job = new async_read();
+	job->tgt = this;
+	job->block = block;
+	job->buf = buf;
+	job->count = count;
+	job->c = c;
+	workpool::io().submit(job);
+}
+
+target::ptr target::open_reader() {
+	return ptr();
+}
+
+bool target::direct(off_t block, off_t& count, int& fd, off_t& offset) {
+	count = 0;
+	return false;
+}
+
+gather::gather(target::completion *c, size_t count)
+	: parent(c), remaining(count + 1), parts(count) {
+	for (size_t i = 0; i < count; ++i) {
+		parts[i].g = this;
+		parts[i].want = 0;
+		parts[i].result = 0;
+	}
+}
+
+void gather::read(size_t i, target& tgt, off_t block, uint8_t *buf,
+		size_t count) {
+	parts[i].want = count * BlockSize;
+	tgt.read_async(block, buf, count, &parts[i]);
+}
+
+void gather::issued() {
+	finish();
+}
+
+void gather::part::done(int res) {
+	result = res;
+	g->finish();
+}
+
+void gather::finish() {
+	if (__sync_sub_and_fetch(&remaining, 1))
+		return;
+	
+	// Stop at the first error or short read, as a single read would
+	int total = 0;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		int res = parts[i].result;
+		if (res < 0) {
+			total = res;
+			break;
+		}
+		total += res;
+		if (res != int(parts[i].want))
+			break;
+	}
+	target::completion *c = parent;
+	delete this;
+	c->done(total);
+}
+
+struct fanout::job : public workpool::job {
+	part *p;
+	virtual void run() {
+		p->result = p->tgt->read_blocks(p->block, p->buf, p->count);
+	}
+};
+
+fanout::fanout(size_t count) : parts(count) { }
+
+void fanout::read(size_t i, target& tgt, off_t block, uint8_t *buf,
+		size_t count) {
+	part p = { &tgt, block, buf, count, 0 };
+	parts[i] = p;
+}
+
+int fanout::run() {
+	if (parts.empty())
+		return 0;
+	std::vector<job> jobs(parts.size());
+	std::vector<workpool::job*> ptrs(parts.size());
+	for (size_t i = 0; i < parts.size(); ++i) {
+		jobs[i].p = &parts[i];
+		ptrs[i] = &jobs[i];
+	}
+	workpool::io().run(&ptrs[0], ptrs.size());
+	
+	// As gather
+	int total = 0;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		int res = parts[i].result;
+		if (res < 0)
+			return res;
+		total += res;
+		if (res != int(parts[i].count * BlockSize))
+			break;
+	}
+	return total;
+}
+
+int read_bytes(target& tgt, uint8_t *buf, size_t size, off_t offset) {
+	off_t block = offset / BlockSize;
+	size_t done = 0;
+	
+	// Leading partial block
+	size_t boffset = offset % BlockSize;
+	if (boffset && size) {
+		size_t want = BlockSize - boffset;
+		if (want > size)
+			want = size;
+		int err = tgt.read(block, buf, boffset, want);
+		if (err < 0 || err != int(want))
+			return err;
+		done += want;
+		++block;
+	}
+	
+	// Whole blocks, in one go
+	size_t whole = (size - done) / BlockSize;
+	if (whole) {
+		int err = tgt.read_blocks(block, buf + done, whole);
+		if (err < 0)
+			return err;
+		done += err;
+		if (err != int(whole * BlockSize))
+			return done;
+		block += whole;
+	}
+	
+	// Trailing partial block
+	if (done < size) {
+		int err = tgt.read(block, buf + done, 0, size - done);
+		if (err < 0)
+			return err;
+		done += err;
+	}
+	return done;
+}
+
+off_t seek_bytes(target& tgt, off_t offset, off_t size, bool hole) {
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+	
+	for (off_t block = offset / BlockSize; off_t(block * BlockSize) < size; ) {
+		off_t count;
+		bool data = tgt.allocated(block, count);
+		if (data != hole) {
+			off_t found = block * BlockSize;
+			return found < offset ? offset : found;
+		}
+		if (count <= 0)
+			break;
+		block += count;
+	}
+	return hole ? size : -ENXIO;
+}
+
+} // namespace devmapper
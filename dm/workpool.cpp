@@ -0,0 +1,133 @@
+#include "workpool.hpp"
+
+#include <unistd.h>
+
+namespace devmapper {
+
+// Enough threads to keep a few devices' queues busy
+static const size_t IOThreads = 16;
+
+struct workpool::batch {
+	size_t remaining;
+};
+
+workpool::workpool(size_t threads) : m_stopping(false) {
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_wake, NULL);
+	pthread_cond_init(&m_done, NULL);
+	
+	for (size_t i = 0; i < threads; ++i) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, worker, this) == 0)
+			m_threads.push_back(t);
+	}
+}
+
+workpool::~workpool() {
+	pthread_mutex_lock(&m_lock);
+	m_stopping = true;
+	pthread_cond_broadcast(&m_wake);
+	pthread_mutex_unlock(&m_lock);
+	
+	for (size_t i = 0; i < m_threads.size(); ++i)
+		pthread_join(m_threads[i], NULL);
+	pthread_cond_destroy(&m_done);
+	pthread_cond_destroy(&m_wake);
+	pthread_mutex_destroy(&m_lock);
+}
+
+workpool& workpool::shared() {
+	static workpool pool;
+	return pool;
+}
+
+workpool& workpool::io() {
+	static workpool pool(IOThreads);
+	return pool;
+}
+
+void workpool::execute(const entry& e) {
+	e.j->run();
+	if (!e.b)
+		return;
+	
+	pthread_mutex_lock(&m_lock);
+	if (--e.b->remaining == 0)
+		pthread_cond_broadcast(&m_done);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void *workpool::worker(void *arg) {
+	workpool *pool = static_cast<workpool*>(arg);
+	pthread_mutex_lock(&pool->m_lock);
+	while (true) {
+		while (pool->m_queue.empty() && !pool->m_stopping)
+			pthread_cond_wait(&pool->m_wake, &pool->m_lock);
+		if (pool->m_queue.empty())
+			break;
+		
+		entry e = pool->m_queue.front();
+		pool->m_queue.pop_front();
+		pthread_mutex_unlock(&pool->m_lock);
+		pool->execute(e);
+		pthread_mutex_lock(&pool->m_lock);
+	}
+	pthread_mutex_unlock(&pool->m_lock);
+	return NULL;
+}
+
+void workpool::submit(job *j) {
+	entry e = { j, NULL };
+	pthread_mutex_lock(&m_lock);
+	m_queue.push_back(e);
+	pthread_cond_signal(&m_wake);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void workpool::run(job **jobs, size_t count) {
+	if (count == 0)
+		return;
+	if (count == 1 || m_threads.empty()) {
+		for (size_t i = 0; i < count; ++i)
+			jobs[i]->run();
+		return;
+	}
+	
+	batch b = { count };
+	pthread_mutex_lock(&m_lock);
+	for (size_t i = 1; i < count; ++i) {
+		entry e = { jobs[i], &b };
+		m_queue.push_back(e);
+	}
+	pthread_cond_broadcast(&m_wake);
+	pthread_mutex_unlock(&m_lock);
+	
+	entry first = { jobs[0], &b };
+	execute(first);
+	
+	// Help out with our own jobs rather than just waiting, so nested calls
+	// can't starve when every worker is itself blocked in run().
+	pthread_mutex_lock(&m_lock);
+	while (b.remaining) {
+		std::deque<entry>::iterator it = m_queue.begin();
+		while (it != m_queue.end() && it->b != &b)
+			++it;
+		if (it == m_queue.end()) {
+			pthread_cond_wait(&m_done, &m_lock);
+			continue;
+		}
+		
+		entry e = *it;
+		m_queue.erase(it);
+		pthread_mutex_unlock(&m_lock);
+		execute(e);
+		pthread_mutex_lock(&m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+} // namespace devmapper
@@ -0,0 +1,78 @@
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include "common.hpp"
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+namespace devmapper {
+
+// Recently read pages of any number of targets, within one memory budget.
+// Split into shards with their own locks and LRU lists, so readers of
+// different pages rarely contend.
+struct blockcache {
+	static const size_t PageBlocks = 8;
+	static const size_t PageBytes = PageBlocks * BlockSize;
+	
+	struct stats {
+		uint64_t hits, misses, evictions;
+		size_t pages;
+	};
+	
+	// 'budget' in bytes
+	blockcache(size_t budget);
+	~blockcache();
+	
+	void set_budget(size_t budget);
+	size_t budget() const { return m_budget; }
+	stats statistics();
+	
+	// A fresh key space, for one cached target
+	uint64_t owner();
+	// Drop all of an owner's pages
+	void forget(uint64_t owner);
+	
+	// Copy out a whole page, if we have it
+	bool get(uint64_t owner, off_t page, uint8_t *buf);
+	void put(uint64_t owner, off_t page, const uint8_t *buf);
+	
+	// The process-wide cache, 64 MiB unless changed
+	static blockcache& shared();
+	
+private:
+	static const size_t Shards = 16;
+	
+	typedef std::pair<uint64_t, off_t> key;
+	typedef std::list<key> lru_t;
+	struct entry {
+		std::vector<uint8_t> data;
+		lru_t::iterator pos;
+	};
+	typedef std::map<key, entry> map_t;
+	
+	struct shard {
+		pthread_mutex_t lock;
+		map_t pages;
+		lru_t lru;
+		size_t max;
+		uint64_t hits, misses, evictions;
+	};
+	
+	blockcache(const blockcache&);
+	blockcache& operator=(const blockcache&);
+	
+	shard& find(uint64_t owner, off_t page);
+	void trim(shard& s);
+	
+	size_t m_budget;
+	uint64_t m_next_owner;
+	shard m_shards[Shards];
+};
+
+} // namespace devmapper
+
+#endif // BLOCKCACHE_HPP
@@ -41,6 +41,7 @@ struct filedesc {
 	void read(uint8_t *buf, size_t size);
 	void pread(uint8_t *buf, size_t size, off_t offset);
 	int dup();
+	int get() const { return m_fd; }
 	
 private:
 	int m_fd;
@@ -0,0 +1,17 @@
+#ifndef CPU_HPP
+#define CPU_HPP
+
+namespace devmapper {
+
+// Instruction set extensions we have accelerated paths for. Detected once,
+// at first use; everything is false on non-x86 hosts.
+struct cpu_features {
+	bool sse2, ssse3, sse41, avx2;
+	bool aesni, vaes, sha;
+};
+
+const cpu_features& cpu();
+
+} // namespace devmapper
+
+#endif // CPU_HPP
@@ -0,0 +1,72 @@
+#ifndef CRYPTO_HPP
+#define CRYPTO_HPP
+
+#include "common.hpp"
+
+namespace devmapper {
+namespace crypto {
+
+struct exception : public std::runtime_error {
+	exception(const std::string& msg) : std::runtime_error(msg) { }
+};
+
+// AES block cipher, with 128, 192 or 256 bit keys
+struct aes {
+	static const size_t BlockBytes = 16;
+	static const size_t MaxRounds = 14;
+	
+	aes(const uint8_t *key, size_t len);
+	~aes();
+	
+	void encrypt(const uint8_t *in, uint8_t *out) const;
+	void decrypt(const uint8_t *in, uint8_t *out) const;
+	
+	size_t rounds() const { return m_rounds; }
+	// Round keys in encryption order, and for the equivalent inverse cipher
+	const uint8_t *enc_keys() const { return m_enc[0]; }
+	const uint8_t *dec_keys() const { return m_dec[0]; }
+	
+private:
+	size_t m_rounds;
+	uint8_t m_enc[MaxRounds + 1][BlockBytes];
+	uint8_t m_dec[MaxRounds + 1][BlockBytes];
+};
+
+// XTS mode over AES, as in dm-crypt's aes-xts-plain64: each sector's tweak
+// is its 64-bit little-endian sector number.
+struct xts {
+	// 'key' is the data key followed by the tweak key, 32, 48 or 64 bytes
+	xts(const uint8_t *key, size_t len);
+	
+	// Decrypt whole sectors in place, the first having tweak 'sector'
+	void decrypt(uint8_t *buf, size_t sectors, uint64_t sector) const;
+	
+private:
+	aes m_data, m_tweak;
+};
+
+// SHA-256
+struct sha256 {
+	static const size_t DigestBytes = 32;
+	
+	sha256();
+	void update(const uint8_t *data, size_t size);
+	void final(uint8_t *digest);
+	
+	// Hash 'count' messages of 'size' bytes each, with 'salt' before or after
+	// each one. Batches are spread over several lanes of a vector unit when
+	// the CPU has no SHA instructions.
+	static void hash_many(const std::string& salt, bool salt_first,
+		const uint8_t *const *msgs, size_t size, uint8_t *const *digests,
+		size_t count);
+	
+private:
+	uint32_t m_state[8];
+	uint8_t m_buf[64];
+	size_t m_buffered;
+	uint64_t m_total;
+};
+
+} } // namespace devmapper::crypto
+
+#endif // CRYPTO_HPP
@@ -0,0 +1,199 @@
+#ifndef DM_STATIC_HPP
+#define DM_STATIC_HPP
+
+#include "dm.hpp"
+
+#include <errno.h>
+#include <unistd.h>
+
+namespace devmapper {
+
+// Targets composed at compile time. Each holds its source by value and calls
+// it directly, so a whole chain inlines into one function, with no virtual
+// calls or reference counting per block. Wrap the top of a chain in
+// erased<> to use it anywhere a target::ptr goes. Each piece has target's
+// read(), read_blocks(), allocated() and direct(), not virtual.
+namespace static_targets {
+
+// A file or device. Doesn't own 'fd'.
+struct file {
+	explicit file(int fd) : fd(fd) { }
+	
+	int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		ssize_t bytes = pread(fd, buf, size, BlockSize * block + offset);
+		if (bytes == -1)
+			return -errno;
+		return size_t(bytes) == size ? int(size) : -EIO;
+	}
+	
+	int read_blocks(off_t block, uint8_t *buf, size_t count) {
+		ssize_t bytes = pread(fd, buf, count * BlockSize, BlockSize * block);
+		return bytes == -1 ? -errno : int(bytes);
+	}
+	
+	bool allocated(off_t block, off_t& count) {
+		return targets::file::allocated(fd, block, count);
+	}
+	
+	bool direct(off_t block, off_t& count, int& fd, off_t& offset) {
+		count = 0;
+		fd = this->fd;
+		offset = block * BlockSize;
+		return true;
+	}
+	
+private:
+	int fd;
+};
+
+template <typename Source>
+struct linear {
+	linear(const Source& src, off_t off) : source(src), src_offset(off) { }
+	
+	int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		return source.read(block + src_offset, buf, offset, size);
+	}
+	
+	int read_blocks(off_t block, uint8_t *buf, size_t count) {
+		return source.read_blocks(block + src_offset, buf, count);
+	}
+	
+	bool allocated(off_t block, off_t& count) {
+		return source.allocated(block + src_offset, count);
+	}
+	
+	bool direct(off_t block, off_t& count, int& fd, off_t& offset) {
+		return source.direct(block + src_offset, count, fd, offset);
+	}
+	
+private:
+	Source source;
+	off_t src_offset;
+};
+
+// Up to Max linear segments over one source: the usual shape of an LV
+template <typename Source, size_t Max = 8>
+struct segments {
+	explicit segments(const Source& src) : source(src), count(0), end(0) { }
+	
+	// Append 'length' blocks from 'offset' on the source. False if full.
+	bool add(off_t length, off_t offset) {
+		if (count == Max)
+			return false;
+		starts[count] = end;
+		offsets[count] = offset;
+		end += length;
+		++count;
+		return true;
+	}
+	
+	off_t size() const { return end; }
+	
+	int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		size_t i = find(block);
+		if (i == count)
+			return 0;
+		return source.read(block - starts[i] + offsets[i], buf, offset, size);
+	}
+	
+	int read_blocks(off_t block, uint8_t *buf, size_t n) {
+		int done = 0;
+		for (size_t i = find(block); n && i < count; ++i) {
+			off_t left = limit(i) - block;
+			size_t want = off_t(n) < left ? n : left;
+			int err = source.read_blocks(block - starts[i] + offsets[i],
+				buf, want);
+			if (err < 0)
+				return err;
+			done += err;
+			if (size_t(err) != want * BlockSize)
+				break;
+			block += want;
+			buf += err;
+			n -= want;
+		}
+		return done;
+	}
+	
+	bool allocated(off_t block, off_t& n) {
+		size_t i = find(block);
+		if (i == count) {
+			n = 0;
+			return false;
+		}
+		off_t left = limit(i) - block;
+		bool data = source.allocated(block - starts[i] + offsets[i], n);
+		if (n <= 0 || n > left)
+			n = left;
+		return data;
+	}
+	
+	bool direct(off_t block, off_t& n, int& fd, off_t& offset) {
+		size_t i = find(block);
+		if (i == count) {
+			n = 0;
+			return false;
+		}
+		off_t left = limit(i) - block;
+		bool found = source.direct(block - starts[i] + offsets[i], n, fd,
+			offset);
+		if (n <= 0 || n > left)
+			n = left;
+		return found;
+	}
+	
+private:
+	size_t find(off_t block) const {
+		size_t i = 0;
+		while (i < count && block >= limit(i))
+			++i;
+		return block < 0 ? count : i;
+	}
+	
+	off_t limit(size_t i) const {
+		return i + 1 < count ? starts[i + 1] : end;
+	}
+	
+	Source source;
+	size_t count;
+	off_t end, starts[Max], offsets[Max];
+};
+
+// Adapts a static chain to the target interface. 'owner' is kept alive for
+// as long as the chain, for whatever holds its file descriptors. Chains read
+// synchronously and treat every reader alike, so read_async() and
+// open_reader() keep their defaults, which call through to these.
+template <typename Impl>
+struct erased : public target {
+	erased(const Impl& impl, target::ptr owner = target::ptr())
+		: impl(impl), owner(owner) { }
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		return impl.read(block, buf, offset, size);
+	}
+	
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count) {
+		return impl.read_blocks(block, buf, count);
+	}
+	
+	virtual bool allocated(off_t block, off_t& count) {
+		return impl.allocated(block, count);
+	}
+	
+	virtual bool direct(off_t block, off_t& count, int& fd, off_t& offset) {
+		return impl.direct(block, count, fd, offset);
+	}
+	
+private:
+	Impl impl;
+	target::ptr owner;
+};
+
+template <typename Impl>
+target::ptr erase(const Impl& impl, target::ptr owner = target::ptr()) {
+	return target::ptr(new erased<Impl>(impl, owner));
+}
+
+} } // namespace devmapper::static_targets
+
+#endif // DM_STATIC_HPP
@@ -2,22 +2,171 @@
 #define DM_HPP
 
 #include "common.hpp"
+#include "ratelimit.hpp"
 
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
 
+#include <pthread.h>
+
 namespace devmapper {
 
+namespace crypto { struct xts; }
+struct blockcache;
+struct iosched;
+struct workpool;
+
 struct target {
 	typedef SHARED_PTR<target> ptr;
 	
+	// Told when an asynchronous read finishes
+	struct completion {
+		virtual ~completion() { }
+		// 'result' as read_blocks()
+		virtual void done(int result) = 0;
+	};
+	
 	virtual ~target() { }
 	
 	// 'size' is limited to BlockSize
 	// Return as in FUSE: Negative errno on error, or non-negative bytes read
 	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size) = 0;
+	
+	// Read 'count' whole blocks. Return as read(), in bytes.
+	// By default, calls read() for each block.
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	
+	// Is 'block' backed by data, rather than an unallocated hole that reads
+	// as zeroes? Sets 'count' to how many blocks from 'block' on share the
+	// answer, or to zero if they all do. By default, everything is data.
+	virtual bool allocated(off_t block, off_t& count);
+	
+	// Start reading whole blocks, and call 'c' when done. That may happen on
+	// another thread, or before this returns. By default, runs read_blocks()
+	// on the shared I/O pool.
+	virtual void read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c);
+	
+	// A target for one reader, such as an open file, for targets that treat
+	// readers differently. By default, NULL: everyone shares this one.
+	virtual ptr open_reader();
+	
+	// Is 'block' stored unchanged in a file, so it can be copied from there
+	// without reading it through here? If so, sets 'fd' and the byte
+	// 'offset' of the block within it. Sets 'count' as allocated() does. By
+	// default, nothing is.
+	virtual bool direct(off_t block, off_t& count, int& fd, off_t& offset);
+};
+
+// Splits an asynchronous read into parts, issued all at once, and completes
+// it once the last is done. Parts are numbered in buffer order. Frees itself.
+struct gather {
+	gather(target::completion *c, size_t parts);
+	
+	// Start part 'i', reading whole blocks
+	void read(size_t i, target& tgt, off_t block, uint8_t *buf, size_t count);
+	// Call after the last read(). The gather may be gone once this returns.
+	void issued();
+	
+private:
+	struct part : public target::completion {
+		gather *g;
+		size_t want;
+		int result;
+		virtual void done(int result);
+	};
+	
+	gather(const gather&);
+	gather& operator=(const gather&);
+	
+	void finish();
+	
+	target::completion *parent;
+	size_t remaining;
+	std::vector<part> parts;
+};
+
+// Reads the parts of a range at once, as gather does, but returns once
+// they're done. They run on the I/O pool and the calling thread through
+// workpool::run(), so it's safe on a pool thread, where waiting on
+// read_async() could leave every thread waiting on reads still queued.
+struct fanout {
+	fanout(size_t parts);
+	
+	// Part 'i', reading whole blocks
+	void read(size_t i, target& tgt, off_t block, uint8_t *buf, size_t count);
+	// Return as read_blocks()
+	int run();
+	
+private:
+	struct part {
+		target *tgt;
+		off_t block;
+		uint8_t *buf;
+		size_t count;
+		int result;
+	};
+	struct job;
+	
+	std::vector<part> parts;
+};
+
+// Read an arbitrary byte range from a target. Return as target::read.
+int read_bytes(target& tgt, uint8_t *buf, size_t size, off_t offset);
+
+// Find the next data or hole at or after 'offset', as SEEK_DATA/SEEK_HOLE.
+// There's always a hole at 'size'. Return -ENXIO if there's nothing to find.
+off_t seek_bytes(target& tgt, off_t offset, off_t size, bool hole);
+
+// A small text file for settings in a FUSE mount. Reading it shows them,
+// writing it changes them.
+struct fuse_control {
+	typedef SHARED_PTR<fuse_control> ptr;
+	
+	virtual ~fuse_control() { }
+	virtual std::string get() = 0;
+	// Apply the whole file as written. Return 0, or negative errno.
+	virtual int set(const std::string& text) = 0;
+	// False to serve it read-only, never calling set()
+	virtual bool writable() const { return true; }
 };
 
+// Read-only files in a directory tree, to serve many targets from one mount
+struct fuse_tree {
+	struct file {
+		target::ptr tgt;
+		off_t size;	// in bytes
+	};
+	
+	// Add a file at a path such as "vg/lv", making directories as needed
+	void add(const std::string& path, target::ptr tgt, off_t size);
+	// Add a control file, writable unless it says otherwise
+	void add(const std::string& path, fuse_control::ptr ctl);
+	
+	// Paths as FUSE gives them, starting with '/'. NULL if there's none.
+	const file *find(const std::string& path) const;
+	fuse_control *control(const std::string& path) const;
+	bool directory(const std::string& path) const;
+	// Names of the files and directories within 'path'
+	std::vector<std::string> list(const std::string& path) const;
+	
+private:
+	void add_dirs(const std::string& path);
+	
+	std::map<std::string, file> m_files;
+	std::map<std::string, fuse_control::ptr> m_controls;
+	std::set<std::string> m_dirs;
+};
+
+// Serve a single target as the file "device"
 void fuse_serve(const char *path, target& tgt, size_t size);
+void fuse_serve(const char *path, const fuse_tree& tree);
+
+// Export read-only over NBD, on a Unix socket if 'address' is a path, or
+// else TCP at [host:]port (loopback by default). Never returns.
+void nbd_serve(const char *address, target& tgt, size_t size);
 
 
 namespace targets {
@@ -27,22 +176,367 @@ struct file : public target {
 	file(int fd, bool cleanup = true);
 	virtual ~file();
 	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	static bool allocated(int fd, off_t block, off_t& count);
+	virtual bool direct(off_t block, off_t& count, int& fd, off_t& offset);
+	
+	int descriptor() const;
+	
+	// The file behind 'fd', shared by everyone who asks for it rather than
+	// opened once per PV or LV. Reads through a duplicate of 'fd'.
+	static SHARED_PTR<file> for_device(int fd);
+	
+	// Send reads through a scheduler, such as iosched::for_device(fd)
+	void schedule(SHARED_PTR<iosched> sched);
 	
 private:
+	ssize_t pread(uint8_t *buf, size_t size, off_t offset);
+	
 	int fd;
 	bool cleanup;
+	SHARED_PTR<iosched> sched;
+};
+
+
+// Keeps recently read pages of 'src' in a blockcache
+struct cached : public target {
+	cached(target::ptr src);	// in blockcache::shared()
+	cached(target::ptr src, blockcache& cache);
+	virtual ~cached();
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	virtual bool direct(off_t block, off_t& count, int& fd, off_t& offset);
+	
+private:
+	cached(const cached&);
+	cached& operator=(const cached&);
+	
+	int read_page(off_t page, uint8_t *buf);
+	int read_run(off_t block, uint8_t *buf, size_t count);
+	
+	target::ptr source;
+	blockcache& cache;
+	uint64_t owner;
 };
 
 
 struct linear : public target {
 	linear(target::ptr src, off_t off);	
 	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	virtual bool direct(off_t block, off_t& count, int& fd, off_t& offset);
+	virtual void read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c);
 
 private:
 	target::ptr source;
 	off_t src_offset;
 };
 
+
+// A dm table: consecutive segments, each mapped onto its own target. Reads
+// that span segments are sent to all of them at once.
+struct table : public target {
+	// Append a segment of 'length' blocks
+	void add(off_t length, target::ptr tgt);
+	off_t size() const;
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	virtual bool direct(off_t block, off_t& count, int& fd, off_t& offset);
+	virtual void read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c);
+
+private:
+	struct segment {
+		off_t start, length;
+		target::ptr tgt;
+	};
+	
+	const segment *find(off_t block) const;
+	
+	std::vector<segment> segments;
+};
+
+
+// Striping: consecutive chunks of 'chunk' blocks rotate across the stripes
+struct striped : public target {
+	striped(const std::vector<target::ptr>& stripes, off_t chunk);
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	virtual void read_async(off_t block, uint8_t *buf, size_t count,
+		completion *c);
+
+private:
+	// Find the stripe holding 'block', and where it is on that stripe
+	target& locate(off_t block, off_t& sblock, off_t& left) const;
+	
+	std::vector<target::ptr> stripes;
+	off_t chunk;
+};
+
+
+// Keeps frequently read pages of 'src' in a cache file on fast local
+// storage, which survives restarts. Pages live in sets of a few ways; a page
+// is admitted once it's been missed more than once, and only in place of one
+// read less often. The index is memory-mapped, and each page's CRC is checked
+// on every hit. A file made with a different 'key', such as the PV's UUID and
+// metadata seqno, starts out empty.
+struct ssd_cache : public target {
+	struct exception : public std::runtime_error {
+		exception(const std::string& msg) : std::runtime_error(msg) { }
+	};
+	
+	struct stats {
+		uint64_t hits, misses, admitted, corrupt;
+	};
+	
+	// 'bytes' of cached data, plus a small index
+	ssd_cache(target::ptr src, const std::string& path, const std::string& key,
+		size_t bytes);
+	virtual ~ssd_cache();
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	
+	stats statistics() const { return m_stats; }
+	
+private:
+	struct header;
+	struct slot;
+	static const size_t Ways = 8, Locks = 64;
+	
+	ssd_cache(const ssd_cache&);
+	ssd_cache& operator=(const ssd_cache&);
+	
+	void open(const std::string& path, const std::string& key);
+	size_t set_of(off_t page) const;
+	bool lookup(off_t page, uint8_t *buf);
+	void admit(off_t page, const uint8_t *buf);
+	int read_page(off_t page, uint8_t *buf);
+	int read_run(off_t block, uint8_t *buf, size_t count);
+	
+	target::ptr source;
+	int fd;
+	uint8_t *map;
+	size_t map_size, pages, sets;
+	slot *slots;
+	off_t data_start;
+	std::vector<uint8_t> seen;	// how often pages were missed, by hash
+	uint64_t m_sightings;
+	pthread_mutex_t locks[Locks];
+	stats m_stats;
+};
+
+
+// Limits reads of 'src' in bytes and in reads per second, each with a burst
+// allowance. Readers that each open_reader() take turns, so one busy reader
+// can't starve the rest. Create with a SHARED_PTR, which readers share.
+struct throttle : public target,
+		public std::tr1::enable_shared_from_this<throttle> {
+	// Zero means unlimited
+	struct limits {
+		limits();
+		uint64_t bytes_per_sec, ios_per_sec;
+		uint64_t burst_bytes, burst_ios;
+	};
+	
+	throttle(target::ptr src, const limits& l = limits());
+	
+	void configure(const limits& l);
+	limits current() const;
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+	virtual target::ptr open_reader();
+	
+	// The limits as a control file: "key value" lines, written in any subset
+	fuse_control::ptr control();
+	
+private:
+	struct reader;
+	struct settings;
+	
+	void wait(size_t bytes);
+	
+	target::ptr source;
+	token_bucket bytes, ios;
+};
+
+
+// md RAID 4, 5 and 6: chunks of data rotate across the legs, alongside one
+// parity chunk per stripe (P, by XOR) or two (P and Q, by Reed-Solomon). Data
+// on legs that are missing (NULL) or fail is rebuilt from the others, and a
+// leg that fails once isn't read again.
+struct raid : public target {
+	// md's layouts, by the names dm-raid uses
+	enum layout {
+		left_asymmetric, right_asymmetric, left_symmetric, right_symmetric,
+		parity_0, parity_n,
+		// RAID 6 only
+		rotating_zero_restart, rotating_n_restart, rotating_n_continue,
+		// RAID 6, as the RAID 5 layout with Q on the last leg
+		left_asymmetric_6, right_asymmetric_6, left_symmetric_6,
+		right_symmetric_6, parity_0_6
+	};
+	
+	// 'parity' chunks per stripe, 1 or 2. 'chunk' in blocks.
+	raid(const std::vector<target::ptr>& legs, size_t parity, layout l,
+		off_t chunk);
+	virtual ~raid();
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	
+private:
+	struct job;
+	typedef std::vector<uint8_t> buffer;
+	
+	raid(const raid&);
+	raid& operator=(const raid&);
+	
+	// Find the leg holding 'block', and where it is on that leg
+	size_t locate(off_t block, off_t& stripe, off_t& lblock, off_t& left) const;
+	// The leg of data chunk 'dd' of 'stripe', and its parity legs. 'qd' is
+	// legs.size() without Q. 'ddf' if Q's coefficients follow leg order.
+	size_t place(off_t stripe, size_t dd, size_t& pd, size_t& qd,
+		bool& ddf) const;
+	
+	int read_chunk(size_t leg, off_t stripe, off_t lblock, uint8_t *buf,
+		size_t count);
+	int rebuild(size_t leg, off_t stripe, off_t lblock, uint8_t *buf,
+		size_t count);
+	// Room for every leg's copy of a chunk, kept for the next rebuild
+	buffer *take_buffer();
+	void give_buffer(buffer *b);
+	
+	std::vector<target::ptr> legs;
+	std::vector<int> failed;
+	size_t parity;
+	layout m_layout;
+	off_t chunk;
+	
+	std::vector<buffer*> spare;
+	pthread_mutex_t spare_lock;
+};
+
+
+// Legs that each hold the same data, as dm-mirror and md RAID 1. Reads go
+// to the first leg that hasn't failed, and a leg that fails once isn't read
+// again.
+struct mirror : public target {
+	mirror(const std::vector<target::ptr>& legs);
+	
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	
+	// Missing legs are NULL
+	const std::vector<target::ptr>& legs() const { return m_legs; }
+	
+private:
+	std::vector<target::ptr> m_legs;
+	std::vector<int> failed;
+};
+
+
+// Reads as zeroes, and is all hole
+struct zero : public target {
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	virtual bool allocated(off_t block, off_t& count);
+};
+
+
+// Fails every read with EIO
+struct error : public target {
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+};
+
+
+// dm-crypt with aes-xts-plain64. The key is both XTS keys concatenated, and
+// block N is decrypted with IV N + iv_offset. Large reads are decrypted in
+// parallel on 'pool', or the shared pool if none is given.
+struct crypt : public target {
+	crypt(target::ptr src, const uint8_t *key, size_t keylen,
+		off_t iv_offset = 0, workpool *pool = NULL);
+	virtual ~crypt();
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+
+private:
+	crypt(const crypt&);
+	crypt& operator=(const crypt&);
+	
+	void decrypt(off_t block, uint8_t *buf, size_t count);
+	
+	target::ptr source;
+	crypto::xts *cipher;
+	off_t iv_offset;
+	workpool& pool;
+};
+
+
+
+// dm-verity: every data block is checked against a Merkle tree of SHA-256
+// digests on 'hash'. Reads stop short at a block that doesn't match, or fail
+// with EIO if it's the first.
+// Verified tree blocks are cached, so hot parts of the tree aren't re-read.
+struct verity : public target {
+	struct params {
+		params();
+		
+		int version;					// hash format, as in the dm table
+		size_t data_block_size, hash_block_size;	// in bytes
+		off_t data_blocks;				// in data blocks
+		off_t hash_start;				// in hash blocks
+		std::string root_digest, salt;	// raw bytes, not hex
+		size_t cache_blocks;			// tree blocks to keep
+	};
+	
+	struct exception : public std::runtime_error {
+		exception(const std::string& msg) : std::runtime_error(msg) { }
+	};
+	
+	verity(target::ptr data, target::ptr hash, const params& p,
+		workpool *pool = NULL);
+	virtual ~verity();
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size);
+	virtual int read_blocks(off_t block, uint8_t *buf, size_t count);
+	
+	// Find the digest that data block 'index' should have
+	int expected(off_t index, uint8_t *digest);
+	// Check whole data blocks, returning zero or negative errno
+	int verify(off_t index, const uint8_t *buf, size_t count);
+
+private:
+	struct cache;
+	struct job;
+	
+	verity(const verity&);
+	verity& operator=(const verity&);
+	
+	int expected(int level, off_t index, uint8_t *digest);
+	int check(off_t index, const uint8_t *buf, size_t count);
+	int read_data(off_t first, size_t count, uint8_t *buf);
+	
+	target::ptr data, hash;
+	params par;
+	size_t sectors_per_block, entry_size;
+	int bits, levels;
+	std::vector<off_t> level_start;
+	cache *m_cache;
+	workpool& pool;
+};
+
 } } // namespace devmapper::targets
 
 #endif // DM_HPP
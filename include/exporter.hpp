@@ -0,0 +1,82 @@
+#ifndef EXPORTER_HPP
+#define EXPORTER_HPP
+
+#include "dm.hpp"
+
+#include <pthread.h>
+
+namespace devmapper {
+
+// Copies a target out to an image file or device, in large chunks that
+// several workers read at once. Zeroes aren't written: holes in the target
+// and all-zero pieces of data stay holes in a new file, and are punched out
+// of an old one or a device that can discard. Data stored as-is in a file,
+// per target::direct(), is copied by the kernel with copy_file_range() where
+// there is one, at the cost of not looking for zeroes in it.
+struct exporter {
+	struct options {
+		options();
+		size_t chunk_bytes;	// per read, a multiple of BlockSize
+		size_t workers;		// reads in flight
+		bool sparse;		// false to write out zeroes too
+		bool offload;		// false to never use copy_file_range()
+	};
+	
+	// In bytes. Of those done, each was written, copied by the kernel, or
+	// left as zero.
+	struct progress {
+		uint64_t total, done;
+		uint64_t written, copied, zero;
+		uint64_t elapsed_ns;
+	};
+	
+	// Told how far along a copy is, now and then and once more at the end.
+	// Called from one worker at a time.
+	struct reporter {
+		virtual ~reporter() { }
+		virtual void report(const progress& p) = 0;
+	};
+	
+	// The first 'bytes' of 'src', a whole number of blocks
+	exporter(target& src, off_t bytes, const options& opts = options());
+	~exporter();
+	
+	// Copy to the start of 'fd', and size it to fit if it's a file. Return
+	// zero, or the negative errno of the first failure.
+	int run(int fd, reporter *r = NULL);
+	
+private:
+	struct worker;
+	
+	exporter(const exporter&);
+	exporter& operator=(const exporter&);
+	
+	void work(std::vector<uint8_t>& buf);
+	int copy_chunk(off_t block, size_t count, uint8_t *buf);
+	int copy_direct(int sfd, off_t soff, off_t pos, size_t size,
+		size_t& copied);
+	int emit(off_t pos, const uint8_t *buf, size_t size);
+	int write_zero(off_t pos, size_t size);
+	int write_data(off_t pos, const uint8_t *buf, size_t size);
+	void report(bool last);
+	
+	target& src;
+	off_t blocks;
+	options opts;
+	
+	// For the copy underway
+	int fd;
+	size_t granule;		// bytes checked for zeroes at once
+	bool fresh;			// reads as zero, so zeroes can be skipped
+	volatile bool can_punch, can_copy;
+	volatile off_t next_chunk;
+	volatile int error;
+	progress m_progress;
+	uint64_t started, reported;
+	reporter *m_reporter;
+	pthread_mutex_t report_lock;
+};
+
+} // namespace devmapper
+
+#endif // EXPORTER_HPP
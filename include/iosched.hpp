@@ -0,0 +1,77 @@
+#ifndef IOSCHED_HPP
+#define IOSCHED_HPP
+
+#include "dm.hpp"
+
+#include <vector>
+
+#include <pthread.h>
+
+namespace devmapper {
+
+// Gathers concurrent reads of one device for a short window, merges those
+// that are adjacent or overlapping, and issues the merged reads at once. No
+// thread of its own: a reader arriving when nobody is gathering gathers the
+// next batch, so several batches can be in flight. Create with a
+// SHARED_PTR, for control().
+struct iosched : public std::tr1::enable_shared_from_this<iosched> {
+	typedef SHARED_PTR<iosched> ptr;
+	
+	struct config {
+		config();
+		
+		unsigned window_usec;	// how long to wait for company, at most a second
+		size_t max_batch;		// dispatch early once this many are queued
+		size_t max_merge;		// largest merged read, in bytes
+		size_t max_gap;			// unrequested bytes we'll read to join two
+	};
+	
+	struct stats {
+		uint64_t requests, batches, reads;
+		uint64_t bytes_requested, bytes_read;
+	};
+	
+	// Reads through a duplicate of 'fd'
+	iosched(int fd, const config& c = config());
+	~iosched();
+	
+	// The scheduler for the file or device behind 'fd', shared by all users
+	static ptr for_device(int fd, const config& c = config());
+	
+	// As ::pread, but returning -errno on failure
+	ssize_t pread(uint8_t *buf, size_t size, off_t offset);
+	
+	void configure(const config& c);
+	config current();
+	stats statistics();
+	
+	// The config as a control file of "key value" lines, written in any
+	// subset, followed by the statistics
+	fuse_control::ptr control();
+	
+private:
+	struct request;
+	struct settings;
+	struct merged_read;
+	
+	iosched(const iosched&);
+	iosched& operator=(const iosched&);
+	
+	void gather();
+	void issue(request **reqs, size_t count);
+	
+	int m_fd;
+	config m_config;
+	stats m_stats;
+	
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_arrived, m_done;
+	std::vector<request*> m_pending;
+	bool m_gathering;
+	size_t m_inflight;		// batches taken but not yet read
+	size_t m_last_batch;
+};
+
+} // namespace devmapper
+
+#endif // IOSCHED_HPP
@@ -3,33 +3,88 @@
 
 #include "lvm-text.hpp"
 
+#include <stdexcept>
 #include <vector>
 
 namespace lvm {
 
+// One stripe (or leg) of a segment: where it starts, on a PV or another LV
+struct area {
+	std::string name;
+	off_t extent;
+};
+
+struct segment {
+	segment(const text::section_t& txt);
+	
+	off_t start_extent, extent_count;
+	std::string type;
+	size_t stripe_size;		// in sectors, for striped and RAID segments
+	std::vector<area> areas;
+	std::vector<std::string> raid_metadata;	// per area, for RAID segments
+};
+
 struct lv {
+	lv(const std::string& name, const text::section_t& txt);
+	
+	const std::string& name() const { return m_name; }
+	const std::string& uuid() const { return m_uuid; }
+	bool visible() const { return m_visible; }
+	const std::vector<segment>& segments() const { return m_segments; }
+	off_t extents() const;
+	
+private:
+	std::string m_name, m_uuid;
+	bool m_visible;
+	std::vector<segment> m_segments;	// sorted by start extent
 };
 
 struct pv {
-	pv(const text::section_p& txt);
+	pv(const std::string& name, const text::section_t& txt);
+	
+	const std::string& name() const { return m_name; }
+	const std::string& uuid() const { return m_uuid; }
+	const std::string& device() const { return m_device; }
+	off_t pe_start() const { return m_pe_start; }	// in sectors
+	off_t pe_count() const { return m_pe_count; }
 	
 private:
-	std::string uuid;
+	std::string m_name, m_uuid, m_device;
+	off_t m_pe_start, m_pe_count;
 };
 
+// A VG's layout, from its text metadata
 struct config {
+	struct exception : public std::runtime_error {
+		exception(const std::string& msg) : std::runtime_error(msg) { }
+	};
+	
 	config(const text::section_p& txt);
 	
-	const std::vector<pv>& pvs() const;
-	const std::vector<lv>& lvs() const;
-	const std::string& uuid() const;
+	const std::vector<pv>& pvs() const { return m_pvs; }
+	const std::vector<lv>& lvs() const { return m_lvs; }
+	const std::string& name() const { return m_name; }
+	const std::string& uuid() const { return m_uuid; }
+	int seqno() const { return m_seqno; }
+	size_t extent_size() const { return m_extent_size; }	// in sectors
+	
+	// NULL if there's no such PV or LV
+	const pv *find_pv(const std::string& name) const;
+	const lv *find_lv(const std::string& name) const;
 	
 private:
-	std::string uuid;
-	std::vector<pv> m_pvs, m_lvs;
-	size_t extent_size;
+	std::string m_name, m_uuid;
+	int m_seqno;
+	std::vector<pv> m_pvs;
+	std::vector<lv> m_lvs;
+	size_t m_extent_size;
 };
 
+// Describe VGs in JSON shaped like `lvm fullreport --reportformat json`: a
+// report entry for each VG, holding its "vg", "pv" and "lv" rows. Sizes are
+// in bytes, as with --units b --nosuffix.
+std::string json_report(const std::vector<const config*>& vgs);
+
 } // namespace lvm
 
 #endif // LVM_CONFIG
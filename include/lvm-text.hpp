@@ -15,6 +15,9 @@ struct parser {
 	};
 	
 	parser(const std::string& s) : str(s), pos(s.c_str()) { }
+	// Start 'offset' bytes in
+	parser(const std::string& s, size_t offset)
+		: str(s), pos(s.c_str() + offset) { }
 	
 	enum advance { Advance, Remain };
 	
@@ -38,8 +41,80 @@ private:
 	const char *pos;
 };
 
+// Finds values in metadata text without parsing the rest. Indexes where
+// each section and array ends in one pass, so lookups skip over whatever
+// they don't need.
+struct query {
+	typedef parser::exception exception;
+	
+	// Keeps a reference to 's', as parser does
+	query(const std::string& s);
+	
+	// Find a value by its path of keys separated by '/', such as
+	// "vg0/logical_volumes/lv_data/segment3/stripes". A '*' key matches the
+	// first section, such as the VG in a whole config. Only the value found
+	// is parsed.
+	bool find(const std::string& path, value& v) const;
+	
+	// As find(), but false if the value has another type
+	bool integer(const std::string& path, int& i) const;
+	bool string(const std::string& path, std::string& s) const;
+	
+private:
+	const char *lookup(const std::string& path) const;
+	const char *skip_value(const char *p) const;
+	const char *close_of(const char *open) const;
+	
+	const std::string& str;
+	std::vector<size_t> m_opens, m_closes;	// bracket pairs, by opening
+};
+
+// Serializes metadata by appending to a buffer, which is kept between uses
+// so a writer called repeatedly stops allocating
+struct writer {
+	enum format { LVM, JSON };
+	
+	writer(format f = LVM) : m_format(f), m_depth(0) { }
+	
+	format fmt() const { return m_format; }
+	const std::string& str() const { return m_buf; }
+	// Empty the buffer, but keep its memory
+	void clear() { m_buf.clear(); }
+	
+	void raw(const char *s, size_t n) { m_buf.append(s, n); }
+	void raw(const std::string& s) { m_buf.append(s); }
+	void integer(long long i);
+	// A quoted string, escaped for the format
+	void quoted(const char *s, size_t n);
+	void quoted(const std::string& s) { quoted(s.data(), s.size()); }
+	// Indentation for the current LVM section depth
+	void indent();
+	
+	// In the writer's format. LVM sections are "key = value" lines, JSON
+	// sections are objects.
+	void write(const value& v);
+	void write(const array_t& a);
+	void write(const section_t& m);
+	
+	// Building JSON piece by piece
+	void open(char bracket);		// '{' or '['
+	void close(char bracket);
+	void key(const char *k);		// the next member of an object
+	void item();					// the next element of an array
+	// A member with a string value. Numbers are quoted, as lvs reports them.
+	void field(const char *k, const std::string& v);
+	void field(const char *k, long long v);
+	
+private:
+	format m_format;
+	int m_depth;
+	std::string m_buf;
+	std::vector<bool> m_first;	// for each open JSON bracket
+};
+
+// Writes LVM text to a stream
 struct dumper {
-	dumper(std::ostream& o) : os(o), indent(0) { }
+	dumper(std::ostream& o) : os(o) { }
 	
 	void tab();
 	void dump(const std::string& s);
@@ -48,8 +123,10 @@ struct dumper {
 	void dump(const value& v);
 	
 private:
+	void flush();
+	
 	std::ostream& os;
-	int indent;
+	writer w;
 };
 
 } } // namespace lvm::text
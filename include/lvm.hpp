@@ -2,8 +2,11 @@
 #define LVM_HPP
 
 #include "dm.hpp"
+#include "iosched.hpp"
+#include "lvm-config.hpp"
 
 #include <fstream>
+#include <map>
 #include <stdexcept>
 #include <string>
 
@@ -20,7 +23,7 @@ struct pvdevice {
 	
 	std::string uuid() { return m_uuid; }
 	std::string vg_config();
-	devmapper::target::ptr target();
+	SHARED_PTR<devmapper::targets::file> target();
 	
 private:
 	bool read_label(size_t sector, uint8_t *buf);
@@ -35,6 +38,108 @@ private:
 	uint32_t text_crc32;
 };
 
+// An LV mapped onto its PVs, to read in-process
+struct logical_volume {
+	// Where one stripe of one segment lives
+	struct extent {
+		off_t offset, length;	// in the LV, in bytes
+		size_t stripe, stripes;
+		std::string name;		// the PV or LV underneath
+		off_t start;			// bytes from the start of its device or LV
+	};
+	
+	logical_volume(const std::string& name, devmapper::target::ptr tgt,
+		off_t size, const std::vector<extent>& extents);
+	
+	const std::string& name() const { return m_name; }
+	off_t size() const { return m_size; }	// in bytes
+	devmapper::target::ptr target() const { return m_target; }
+	const std::vector<extent>& extents() const { return m_extents; }
+	
+	// As pread: bytes read, or negative errno
+	ssize_t read(uint8_t *buf, size_t size, off_t offset);
+	
+private:
+	std::string m_name;
+	devmapper::target::ptr m_target;
+	off_t m_size;
+	std::vector<extent> m_extents;
+};
+
+// A VG, assembled from whichever of its PVs are added
+struct volume_group {
+	typedef SHARED_PTR<volume_group> ptr;
+	
+	volume_group() : m_cache_bytes(0), m_schedule(false) { }
+	
+	struct exception : public std::runtime_error {
+		exception(const std::string& msg) : std::runtime_error(msg) { }
+	};
+	
+	// Open a PV. The newest metadata seen describes the VG.
+	void add(const char *path);
+	// Add a PV already opened, with the metadata it holds
+	void add(SHARED_PTR<pvdevice> dev, SHARED_PTR<config> cfg);
+	
+	const config& metadata() const;
+	// Are all the VG's PVs here?
+	bool complete() const;
+	
+	// Map an LV by name. Areas on missing PVs fail reads with EIO.
+	logical_volume open(const std::string& name);
+	
+	// An LV's mirror and RAID 1 segments, to scrub
+	struct mirror_segment {
+		off_t start, length;	// in blocks, within the LV
+		SHARED_PTR<devmapper::targets::mirror> tgt;
+	};
+	std::vector<mirror_segment> mirrors(const std::string& name);
+	
+	// Keep each PV's hot pages in a file named for its UUID in 'dir', of up
+	// to 'bytes', for LVs opened from now on. Emptied when the metadata
+	// changes.
+	void ssd_cache(const std::string& dir, size_t bytes);
+	
+	// Merge concurrent reads of each PV through its device's iosched, for
+	// LVs opened from now on
+	void schedule(const devmapper::iosched::config& c);
+	// The scheduler for a PV, by name, once an LV on it is open. NULL if
+	// there's none.
+	devmapper::iosched::ptr scheduler(const std::string& pv) const;
+	
+private:
+	typedef std::map<std::string, SHARED_PTR<pvdevice> > devices_t;
+	typedef std::map<std::string, devmapper::target::ptr> targets_t;
+	
+	devmapper::target::ptr pv_target(const pv& p);
+	devmapper::target::ptr lv_target(const lv& l);
+	devmapper::target::ptr area_target(const area& a);
+	devmapper::target::ptr segment_target(const segment& seg);
+	SHARED_PTR<devmapper::targets::mirror> mirror_target(const segment& seg);
+	
+	SHARED_PTR<config> m_config;
+	devices_t m_devices;	// by PV UUID
+	targets_t m_pv_targets, m_lv_targets;	// already mapped, by name
+	std::string m_cache_dir;
+	size_t m_cache_bytes;
+	bool m_schedule;
+	devmapper::iosched::config m_sched_config;
+	std::map<std::string, devmapper::iosched::ptr> m_scheds;	// by PV name
+};
+
+// All the VGs found on a set of PVs, for serving many from one process
+struct volume_groups {
+	// Open a PV, and add it to whichever VG it belongs to
+	void add(const char *path);
+	
+	// In order of their first PV's addition
+	const std::vector<volume_group::ptr>& groups() const { return m_groups; }
+	
+private:
+	std::vector<volume_group::ptr> m_groups;
+	std::map<std::string, volume_group::ptr> m_by_uuid;
+};
+
 } // namespace lvm
 
 #endif // LVM_HPP
@@ -0,0 +1,16 @@
+#ifndef MEMSCAN_HPP
+#define MEMSCAN_HPP
+
+#include "common.hpp"
+
+namespace devmapper {
+
+// Is every byte of 'buf' zero? Stops at the first that isn't.
+bool all_zero(const uint8_t *buf, size_t size);
+
+// Where 'a' and 'b' first differ, or 'size' if they don't
+size_t first_difference(const uint8_t *a, const uint8_t *b, size_t size);
+
+} // namespace devmapper
+
+#endif // MEMSCAN_HPP
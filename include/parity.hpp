@@ -0,0 +1,28 @@
+#ifndef PARITY_HPP
+#define PARITY_HPP
+
+#include "common.hpp"
+
+namespace devmapper {
+
+// Arithmetic for RAID parity: XOR for P, and GF(2^8) with the polynomial
+// x^8 + x^4 + x^3 + x^2 + 1 for the Reed-Solomon Q syndrome, as md uses.
+namespace parity {
+
+// 'dst' ^= 'src'
+void xor_into(uint8_t *dst, const uint8_t *src, size_t size);
+
+// 'dst' ^= 'c' * 'src'
+void mul_xor_into(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size);
+
+// 'buf' *= 'c', in place
+void scale(uint8_t *buf, uint8_t c, size_t size);
+
+uint8_t mul(uint8_t a, uint8_t b);
+uint8_t inverse(uint8_t a);
+// The generator {02} to the power 'n'
+uint8_t exp2(unsigned n);
+
+} } // namespace devmapper::parity
+
+#endif // PARITY_HPP
@@ -0,0 +1,47 @@
+#ifndef RATELIMIT_HPP
+#define RATELIMIT_HPP
+
+#include "common.hpp"
+
+namespace devmapper {
+
+// A token bucket that's safe to share between threads without locks. It
+// keeps only the time at which everything taken so far is paid for, moved
+// forward by compare-and-swap, so callers are served in the order they
+// took tokens.
+struct token_bucket {
+	// Unlimited until configured
+	token_bucket();
+	
+	// 'rate' tokens a second, and up to 'burst' at once after idling. A rate
+	// of zero means no limit. Tokens already taken but not yet paid for are
+	// paid for at the new rate.
+	void configure(uint64_t rate, uint64_t burst);
+	uint64_t rate() const { return m_rate; }
+	uint64_t burst() const { return m_burst; }
+	
+	// Take 'n' tokens, and return how many nanoseconds to wait before they
+	// may be used. Never blocks.
+	uint64_t reserve(uint64_t n);
+	// Take 'n' tokens, waiting until they may be used
+	void take(uint64_t n);
+	
+	// What's left of a wait from reserve() made at 'rate', now that the rate
+	// may have changed. Updates 'rate' to the current one. Sleep in naps no
+	// longer than LongestNap and ask again, to notice a changed rate soon.
+	uint64_t rewait(uint64_t wait, uint64_t& rate) const;
+	
+	static const uint64_t LongestNap = 100 * 1000000ULL; // ns
+	
+	// Monotonic nanoseconds
+	static uint64_t now();
+	static void sleep(uint64_t ns);
+	
+private:
+	volatile uint64_t m_rate, m_burst;
+	volatile uint64_t m_paid;	// when the tokens taken so far are paid for
+};
+
+} // namespace devmapper
+
+#endif // RATELIMIT_HPP
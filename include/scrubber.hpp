@@ -0,0 +1,99 @@
+#ifndef SCRUBBER_HPP
+#define SCRUBBER_HPP
+
+#include "dm.hpp"
+
+#include <pthread.h>
+
+namespace devmapper {
+
+// Checks that mirrors' legs still hold the same data, on a thread of its
+// own. Each chunk is read from every leg at once and compared, with reads
+// limited to a rate that leaves room for everyone else. Where the legs
+// differ, or a leg can't be read, is listed in the status.
+//
+// The status is "key value" lines, and writing it back restores it, so it
+// also serves as a checkpoint: it's saved to a file now and then, and a
+// scrub started with that file carries on from where it was.
+struct scrubber {
+	struct exception : public std::runtime_error {
+		exception(const std::string& msg) : std::runtime_error(msg) { }
+	};
+
+	// A byte range of a named mirror, such as "vg/lv"
+	struct range {
+		std::string name;
+		off_t offset, length;
+	};
+
+	// 'checkpoint' may be empty, for none. 'rate' is bytes a second read
+	// from all legs together, zero meaning no limit; a checkpoint's own
+	// settings win over it.
+	scrubber(const std::string& checkpoint, uint64_t rate,
+		size_t chunk_bytes = 1 << 20);
+	~scrubber();
+
+	// Scrub 'blocks' of 'm', called 'name', from 'start' blocks into it.
+	// Add everything before calling start().
+	void add(const std::string& name, off_t start, off_t blocks,
+		SHARED_PTR<targets::mirror> m);
+
+	// Load the checkpoint if there is one, and start the thread. The scrub
+	// carries on as the checkpoint says, or without one, runs unless
+	// 'paused'.
+	void start(bool paused = false);
+
+	std::string status();
+	// Apply status lines, as written to the control file. Writing "state
+	// running" to a finished scrub starts another pass.
+	int configure(const std::string& text);
+	// The status as a control file, valid while this is
+	fuse_control::ptr control();
+
+private:
+	struct region {
+		std::string name;
+		off_t start, blocks;
+		SHARED_PTR<targets::mirror> tgt;
+	};
+	enum state { Running, Paused, Done };
+	struct settings;
+
+	static const size_t MaxListed = 1000;
+
+	scrubber(const scrubber&);
+	scrubber& operator=(const scrubber&);
+
+	static void *thread(void *arg);
+	void loop();
+	void scrub(const region& r, off_t block, size_t count, uint8_t *buf);
+	void note(std::vector<range>& list, uint64_t& total,
+		const std::string& name, off_t offset, off_t length);
+	void save();
+	std::string describe() const;
+	int apply(const std::string& text);
+	off_t checked() const;
+
+	std::string m_checkpoint;
+	size_t chunk;
+	std::vector<region> regions;
+	token_bucket bucket;
+
+	// Guarded by 'lock'
+	state m_state;
+	size_t m_region;	// where we're up to
+	off_t m_block;
+	std::vector<range> m_mismatches, m_unreadable;
+	uint64_t m_mismatched, m_unreadable_bytes;
+	uint64_t saved;		// when the checkpoint was written
+	volatile bool stopping;
+	bool started;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t m_thread;
+};
+
+} // namespace devmapper
+
+#endif // SCRUBBER_HPP
@@ -0,0 +1,59 @@
+#ifndef WORKPOOL_HPP
+#define WORKPOOL_HPP
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+namespace devmapper {
+
+// A fixed set of worker threads, for spreading CPU-heavy work (decryption,
+// hashing, parity) across cores.
+struct workpool {
+	struct job {
+		virtual ~job() { }
+		virtual void run() = 0;
+	};
+	
+	// Zero threads means one per online CPU
+	workpool(size_t threads = 0);
+	~workpool();
+	
+	size_t size() const { return m_threads.size(); }
+	
+	// Run all the jobs, on the pool and the calling thread, and return once
+	// they're done. Safe to call from within a job.
+	void run(job **jobs, size_t count);
+	
+	// Queue a job to run in the background. The caller keeps ownership.
+	void submit(job *j);
+	
+	// The process-wide pool, one thread per CPU
+	static workpool& shared();
+	// The process-wide pool for jobs that block on I/O
+	static workpool& io();
+	
+private:
+	struct batch;
+	struct entry {
+		job *j;
+		batch *b;
+	};
+	
+	workpool(const workpool&);
+	workpool& operator=(const workpool&);
+	
+	static void *worker(void *arg);
+	void execute(const entry& e);
+	
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_wake, m_done;
+	std::deque<entry> m_queue;
+	std::vector<pthread_t> m_threads;
+	bool m_stopping;
+};
+
+} // namespace devmapper
+
+#endif // WORKPOOL_HPP
@@ -0,0 +1,246 @@
+#include "lvm-config.hpp"
+
+#include <algorithm>
+
+using std::string;
+
+namespace lvm {
+
+using namespace text;
+
+
+/***** Utility functions *****/
+
+static const value& get(const section_t& s, const string& key) {
+	section_t::const_iterator it = s.find(key);
+	if (it == s.end())
+		throw config::exception("LVM2 metadata is missing '" + key + "'");
+	return it->second;
+}
+
+static bool has(const section_t& s, const string& key) {
+	return s.find(key) != s.end();
+}
+
+static int get_int(const section_t& s, const string& key) {
+	const value& v = get(s, key);
+	if (v.type() != value::Integer)
+		throw config::exception("LVM2 metadata '" + key + "' isn't a number");
+	return v.integer();
+}
+
+static const string& get_string(const section_t& s, const string& key) {
+	const value& v = get(s, key);
+	if (v.type() != value::String)
+		throw config::exception("LVM2 metadata '" + key + "' isn't a string");
+	return v.string();
+}
+
+static const section_t& get_section(const section_t& s, const string& key) {
+	const value& v = get(s, key);
+	if (v.type() != value::Section)
+		throw config::exception("LVM2 metadata '" + key + "' isn't a section");
+	return v.section();
+}
+
+static bool has_flag(const section_t& s, const string& key,
+		const string& flag) {
+	if (!has(s, key))
+		return false;
+	const value& v = get(s, key);
+	if (v.type() != value::Array)
+		return false;
+	const array_t& a = v.array();
+	for (array_t::const_iterator it = a.begin(); it != a.end(); ++it)
+		if (it->type() == value::String && it->string() == flag)
+			return true;
+	return false;
+}
+
+static bool by_start(const segment& a, const segment& b) {
+	return a.start_extent < b.start_extent;
+}
+
+
+/***** Methods *****/
+
+segment::segment(const section_t& txt)
+	: start_extent(get_int(txt, "start_extent")),
+	extent_count(get_int(txt, "extent_count")),
+	type(get_string(txt, "type")), stripe_size(0) {
+	if (has(txt, "stripe_size"))
+		stripe_size = get_int(txt, "stripe_size");
+	
+	// Areas are name/extent pairs, under a key that depends on the type
+	const char *keys[] = { "stripes", "mirrors", NULL };
+	for (const char **key = keys; *key; ++key) {
+		if (!has(txt, *key))
+			continue;
+		const value& v = get(txt, *key);
+		if (v.type() != value::Array)
+			throw config::exception("LVM2 segment areas aren't an array");
+		const array_t& a = v.array();
+		for (size_t i = 0; i + 1 < a.size(); i += 2) {
+			if (a[i].type() != value::String || a[i + 1].type() != value::Integer)
+				throw config::exception("LVM2 segment area is malformed");
+			area ar = { a[i].string(), a[i + 1].integer() };
+			areas.push_back(ar);
+		}
+	}
+	
+	// RAID legs are metadata/image LV pairs, the data starting the image
+	if (has(txt, "raids")) {
+		const value& v = get(txt, "raids");
+		if (v.type() != value::Array)
+			throw config::exception("LVM2 RAID legs aren't an array");
+		const array_t& a = v.array();
+		for (size_t i = 0; i + 1 < a.size(); i += 2) {
+			if (a[i].type() != value::String || a[i + 1].type() != value::String)
+				throw config::exception("LVM2 RAID leg is malformed");
+			raid_metadata.push_back(a[i].string());
+			area ar = { a[i + 1].string(), 0 };
+			areas.push_back(ar);
+		}
+	}
+}
+
+lv::lv(const string& name, const section_t& txt)
+	: m_name(name), m_uuid(get_string(txt, "id")),
+	m_visible(has_flag(txt, "status", "VISIBLE")) {
+	for (section_t::const_iterator it = txt.begin(); it != txt.end(); ++it) {
+		if (it->first.compare(0, 7, "segment") == 0 &&
+				it->second.type() == value::Section)
+			m_segments.push_back(segment(it->second.section()));
+	}
+	std::sort(m_segments.begin(), m_segments.end(), by_start);
+}
+
+off_t lv::extents() const {
+	if (m_segments.empty())
+		return 0;
+	const segment& last = m_segments.back();
+	return last.start_extent + last.extent_count;
+}
+
+pv::pv(const string& name, const section_t& txt)
+	: m_name(name), m_uuid(get_string(txt, "id")),
+	m_pe_start(get_int(txt, "pe_start")), m_pe_count(get_int(txt, "pe_count")) {
+	if (has(txt, "device"))
+		m_device = get_string(txt, "device");
+}
+
+config::config(const section_p& txt) {
+	// The VG is the one top-level section, the rest is about the file
+	const section_t *vg = NULL;
+	for (section_t::const_iterator it = txt->begin(); it != txt->end(); ++it) {
+		if (it->second.type() != value::Section)
+			continue;
+		if (vg)
+			throw exception("LVM2 metadata has more than one VG");
+		m_name = it->first;
+		vg = &it->second.section();
+	}
+	if (!vg)
+		throw exception("LVM2 metadata has no VG");
+	
+	m_uuid = get_string(*vg, "id");
+	m_seqno = get_int(*vg, "seqno");
+	m_extent_size = get_int(*vg, "extent_size");
+	
+	const section_t& pvs = get_section(*vg, "physical_volumes");
+	for (section_t::const_iterator it = pvs.begin(); it != pvs.end(); ++it)
+		m_pvs.push_back(pv(it->first, get_section(pvs, it->first)));
+	
+	if (has(*vg, "logical_volumes")) {
+		const section_t& lvs = get_section(*vg, "logical_volumes");
+		for (section_t::const_iterator it = lvs.begin(); it != lvs.end(); ++it)
+			m_lvs.push_back(lv(it->first, get_section(lvs, it->first)));
+	}
+}
+
+const pv *config::find_pv(const string& name) const {
+	for (std::vector<pv>::const_iterator it = m_pvs.begin();
+			it != m_pvs.end(); ++it)
+		if (it->name() == name)
+			return &*it;
+	return NULL;
+}
+
+const lv *config::find_lv(const string& name) const {
+	for (std::vector<lv>::const_iterator it = m_lvs.begin();
+			it != m_lvs.end(); ++it)
+		if (it->name() == name)
+			return &*it;
+	return NULL;
+}
+
+string json_report(const std::vector<const config*>& vgs) {
+	text::writer w(text::writer::JSON);
+	w.open('{');
+	w.key("report");
+	w.open('[');
+	for (size_t i = 0; i < vgs.size(); ++i) {
+		const config& c = *vgs[i];
+		long long esize = c.extent_size() * 512LL;
+		
+		long long pes = 0;
+		for (size_t j = 0; j < c.pvs().size(); ++j)
+			pes += c.pvs()[j].pe_count();
+		
+		w.item();
+		w.open('{');
+		w.key("vg");
+		w.open('[');
+		w.item();
+		w.open('{');
+		w.field("vg_name", c.name());
+		w.field("vg_uuid", c.uuid());
+		w.field("vg_seqno", c.seqno());
+		w.field("vg_extent_size", esize);
+		w.field("vg_size", pes * esize);
+		w.field("pv_count", c.pvs().size());
+		w.field("lv_count", c.lvs().size());
+		w.close('}');
+		w.close(']');
+		
+		w.key("pv");
+		w.open('[');
+		for (size_t j = 0; j < c.pvs().size(); ++j) {
+			const pv& p = c.pvs()[j];
+			w.item();
+			w.open('{');
+			w.field("pv_name", p.device());
+			w.field("pv_uuid", p.uuid());
+			w.field("pe_start", p.pe_start() * 512LL);
+			w.field("pv_pe_count", p.pe_count());
+			w.field("pv_size", p.pe_count() * esize);
+			w.field("vg_name", c.name());
+			w.close('}');
+		}
+		w.close(']');
+		
+		w.key("lv");
+		w.open('[');
+		for (size_t j = 0; j < c.lvs().size(); ++j) {
+			const lv& l = c.lvs()[j];
+			w.item();
+			w.open('{');
+			w.field("lv_name", l.name());
+			w.field("vg_name", c.name());
+			w.field("lv_uuid", l.uuid());
+			w.field("lv_size", l.extents() * esize);
+			w.field("seg_count", l.segments().size());
+			w.field("segtype", l.segments().empty()
+				? string() : l.segments()[0].type);
+			w.field("lv_visible", l.visible() ? "visible" : "");
+			w.close('}');
+		}
+		w.close(']');
+		w.close('}');
+	}
+	w.close(']');
+	w.close('}');
+	return w.str();
+}
+
+} // namespace lvm
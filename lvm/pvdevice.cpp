@@ -220,9 +220,9 @@ std::string pvdevice::vg_config() {
 	return s;
 }
 
-devmapper::target::ptr pvdevice::target() {
+SHARED_PTR<devmapper::targets::file> pvdevice::target() {
 	using namespace devmapper;
-	return target::ptr(new targets::file(fd.dup()));
+	return targets::file::for_device(fd.get());
 }
 
 } // namespace lvm
@@ -0,0 +1,185 @@
+#include "lvm-text.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace lvm {
+namespace text {
+
+// Bytes the index pass stops at
+struct structural {
+	bool table[256];
+	
+	structural() {
+		memset(table, 0, sizeof(table));
+		const char *s = "{}[]\"#";
+		for (; *s; ++s)
+			table[static_cast<unsigned char>(*s)] = true;
+	}
+};
+
+static const char *skip_space(const char *p) {
+	while (*p) {
+		if (*p == '#') {
+			while (*p && *p != '\n')
+				++p;
+		} else if (isspace(*p)) {
+			++p;
+		} else {
+			break;
+		}
+	}
+	return p;
+}
+
+// Past the closing quote of the string starting at 'p'
+static const char *skip_string(const char *p) {
+	for (++p; *p && *p != '"'; ++p)
+		if (*p == '\\' && p[1])
+			++p;
+	if (!*p)
+		throw parser::exception("expected terminating quote");
+	return p + 1;
+}
+
+static bool ident_char(char c) {
+	return isalnum(c) || strchr("-_.+", c);
+}
+
+query::query(const std::string& s) : str(s) {
+	static structural st;
+	std::vector<size_t> open;
+	const char *base = str.c_str(), *p = base;
+	while (*p) {
+		if (!st.table[static_cast<unsigned char>(*p)]) {
+			++p;
+			continue;
+		}
+		switch (*p) {
+		case '#':
+			while (*p && *p != '\n')
+				++p;
+			break;
+		case '"':
+			p = skip_string(p);
+			break;
+		case '{':
+		case '[':
+			open.push_back(m_opens.size());
+			m_opens.push_back(p - base);
+			m_closes.push_back(0);
+			++p;
+			break;
+		default: { // a closing bracket
+			char want = *p == '}' ? '{' : '[';
+			if (open.empty() || base[m_opens[open.back()]] != want)
+				throw exception("unbalanced brackets");
+			m_closes[open.back()] = p - base;
+			open.pop_back();
+			++p;
+		}
+		}
+	}
+	if (!open.empty())
+		throw exception("unbalanced brackets");
+}
+
+const char *query::close_of(const char *open) const {
+	size_t off = open - str.c_str();
+	std::vector<size_t>::const_iterator it = std::lower_bound(m_opens.begin(),
+		m_opens.end(), off);
+	return str.c_str() + m_closes[it - m_opens.begin()];
+}
+
+const char *query::skip_value(const char *p) const {
+	if (*p == '{' || *p == '[')
+		return close_of(p) + 1;
+	if (*p == '"')
+		return skip_string(p);
+	if (!isdigit(*p))
+		throw exception("expected a value");
+	while (isdigit(*p))
+		++p;
+	return p;
+}
+
+// Where the value at 'path' starts, or NULL
+const char *query::lookup(const std::string& path) const {
+	const char *p = str.c_str(), *end = p + str.size();
+	size_t start = 0;
+	while (true) {
+		size_t slash = path.find('/', start);
+		std::string key(path, start, slash == std::string::npos
+			? std::string::npos : slash - start);
+		bool last = slash == std::string::npos;
+		
+		// Walk this section's entries up to 'end'
+		const char *found = NULL;
+		while (!found) {
+			p = skip_space(p);
+			if (p >= end || *p == '}')
+				return NULL;
+			const char *id = p;
+			while (ident_char(*p))
+				++p;
+			if (p == id)
+				throw exception("expected identifier");
+			size_t len = p - id;
+			
+			p = skip_space(p);
+			bool section = *p == '{';
+			if (!section && *p != '=')
+				throw exception("expected equals sign or opening brace");
+			const char *val = section ? p : skip_space(p + 1);
+			
+			if ((key == "*" && section) ||
+					(key.size() == len && !key.compare(0, len, id, len)))
+				found = val;
+			else
+				p = skip_value(val);
+		}
+		
+		if (last)
+			return found;
+		if (*found != '{')
+			return NULL;
+		end = close_of(found);
+		p = found + 1;
+		start = slash + 1;
+	}
+}
+
+bool query::find(const std::string& path, value& v) const {
+	const char *p = lookup(path);
+	if (!p)
+		return false;
+	parser par(str, p - str.c_str());
+	if (*p == '{') {
+		par.literal('{');
+		section_p m;
+		par.section(m);
+		v.set(value::Section, new section_core(m));
+	} else {
+		par.value(v);
+	}
+	return true;
+}
+
+bool query::integer(const std::string& path, int& i) const {
+	value v;
+	if (!find(path, v) || v.type() != value::Integer)
+		return false;
+	i = v.integer();
+	return true;
+}
+
+bool query::string(const std::string& path, std::string& s) const {
+	value v;
+	if (!find(path, v) || v.type() != value::String)
+		return false;
+	s = v.string();
+	return true;
+}
+
+} } // namespace lvm::text
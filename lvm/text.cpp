@@ -185,60 +185,34 @@ std::string parser::vg_name() {
 	return s;
 }
 
+void dumper::flush() {
+	os.write(w.str().data(), w.str().size());
+	w.clear();
+}
+
 void dumper::tab() {
-	for (int i = 0; i < indent; ++i)
-		os << "    ";
+	w.indent();
+	flush();
 }
 
 void dumper::dump(const std::string& s) {
-	os << "\"";
-	for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
-		if (*it == '"' || *it == '\\')
-			os << "\\";
-		os << *it;
-	}
-	os << "\"";
+	w.quoted(s);
+	flush();
 }
 
 void dumper::dump(const array_t& a) {
-	bool first = true;
-	os << "[";
-	for (array_t::const_iterator it = a.begin(); it != a.end(); ++it) {
-		if (first)
-			first = false;
-		else
-			os << ", ";
-		dump(*it);
-	}
-	os << "]";
+	w.write(a);
+	flush();
 }
 
 void dumper::dump(const value& v) {
-	switch (v.type()) {
-		case value::Integer: os << v.integer(); break;
-		case value::String: dump(v.string()); break;
-		case value::Array: dump(v.array()); break;
-		case value::Section: dump(v.section()); break;
-	}
+	w.write(v);
+	flush();
 }
 
 void dumper::dump(const section_t& m) {
-	for (section_t::const_iterator it = m.begin(); it != m.end(); ++it) {
-		tab();
-		os << it->first;
-		if (it->second.type() == value::Section) {
-			os << " {\n";
-			++indent;
-			dump(it->second);
-			--indent;
-			tab();
-			os << "}";
-		} else {
-			os << " = ";
-			dump(it->second);
-		}
-		os << "\n";
-	}
+	w.write(m);
+	flush();
 }
 
 } } // namespace lvm::text
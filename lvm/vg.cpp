@@ -0,0 +1,301 @@
+#include "lvm.hpp"
+#include "lvm-text.hpp"
+
+#include <sstream>
+
+using std::string;
+using std::vector;
+using devmapper::BlockSize;
+using devmapper::target;
+namespace targets = devmapper::targets;
+
+namespace lvm {
+
+// Largest piece to hand read_bytes() at once
+static const size_t ReadChunk = 16 << 20;
+
+logical_volume::logical_volume(const string& name, target::ptr tgt,
+		off_t size, const vector<extent>& extents)
+	: m_name(name), m_target(tgt), m_size(size), m_extents(extents) { }
+
+ssize_t logical_volume::read(uint8_t *buf, size_t size, off_t offset) {
+	if (offset >= m_size)
+		return 0;
+	if (off_t(size) > m_size - offset)
+		size = m_size - offset;
+	
+	size_t done = 0;
+	while (done < size) {
+		size_t want = size - done;
+		if (want > ReadChunk)
+			want = ReadChunk;
+		int err = devmapper::read_bytes(*m_target, buf + done, want,
+			offset + done);
+		if (err < 0)
+			return err;
+		done += err;
+		if (err != int(want))
+			break;
+	}
+	return done;
+}
+
+static SHARED_PTR<config> read_config(pvdevice& dev) {
+	string txt(dev.vg_config());
+	text::parser parser(txt);
+	return SHARED_PTR<config>(new config(parser.vg_config()));
+}
+
+void volume_group::add(const char *path) {
+	SHARED_PTR<pvdevice> dev(new pvdevice(path));
+	SHARED_PTR<config> cfg(read_config(*dev));
+	if (m_config && cfg->uuid() != m_config->uuid())
+		throw exception(string(path) + " belongs to another VG");
+	add(dev, cfg);
+}
+
+void volume_group::add(SHARED_PTR<pvdevice> dev, SHARED_PTR<config> cfg) {
+	if (m_config && cfg->uuid() != m_config->uuid())
+		throw exception("PV " + dev->uuid() + " belongs to another VG");
+	if (!m_config || cfg->seqno() > m_config->seqno()) {
+		m_config = cfg;
+		m_pv_targets.clear();
+		m_lv_targets.clear();
+	}
+	m_devices[dev->uuid()] = dev;
+}
+
+const config& volume_group::metadata() const {
+	if (!m_config)
+		throw exception("No PVs in VG");
+	return *m_config;
+}
+
+bool volume_group::complete() const {
+	const vector<pv>& pvs = metadata().pvs();
+	for (vector<pv>::const_iterator it = pvs.begin(); it != pvs.end(); ++it)
+		if (m_devices.find(it->uuid()) == m_devices.end())
+			return false;
+	return true;
+}
+
+void volume_group::ssd_cache(const string& dir, size_t bytes) {
+	m_cache_dir = dir;
+	m_cache_bytes = bytes;
+	m_pv_targets.clear();
+	m_lv_targets.clear();
+}
+
+void volume_group::schedule(const devmapper::iosched::config& c) {
+	m_schedule = true;
+	m_sched_config = c;
+	m_pv_targets.clear();
+	m_lv_targets.clear();
+}
+
+devmapper::iosched::ptr volume_group::scheduler(const string& pv) const {
+	std::map<string, devmapper::iosched::ptr>::const_iterator found
+		= m_scheds.find(pv);
+	return found == m_scheds.end() ? devmapper::iosched::ptr() : found->second;
+}
+
+target::ptr volume_group::pv_target(const pv& p) {
+	targets_t::iterator found = m_pv_targets.find(p.name());
+	if (found != m_pv_targets.end())
+		return found->second;
+	
+	target::ptr tgt;
+	devices_t::iterator dev = m_devices.find(p.uuid());
+	if (dev == m_devices.end()) {
+		tgt.reset(new targets::error());
+	} else {
+		SHARED_PTR<targets::file> file = dev->second->target();
+		if (m_schedule) {
+			devmapper::iosched::ptr sched = devmapper::iosched::for_device(
+				file->descriptor(), m_sched_config);
+			file->schedule(sched);
+			m_scheds[p.name()] = sched;
+		}
+		target::ptr whole = file;
+		if (m_cache_bytes) {
+			std::ostringstream key;
+			key << p.uuid() << " " << metadata().seqno();
+			whole.reset(new targets::ssd_cache(whole,
+				m_cache_dir + "/" + p.uuid(), key.str(), m_cache_bytes));
+		}
+		tgt = target::ptr(new targets::linear(whole, p.pe_start()));
+	}
+	m_pv_targets[p.name()] = tgt;
+	return tgt;
+}
+
+// Areas are on PVs, or on hidden LVs such as mirror legs
+target::ptr volume_group::area_target(const area& a) {
+	target::ptr under;
+	if (const pv *p = metadata().find_pv(a.name))
+		under = pv_target(*p);
+	else if (const lv *l = metadata().find_lv(a.name))
+		under = lv_target(*l);
+	else
+		throw exception("Unknown PV or LV " + a.name);
+	return target::ptr(new targets::linear(under,
+		a.extent * metadata().extent_size()));
+}
+
+// LVM's RAID segment types, as md levels and layouts
+struct raid_type {
+	const char *name;
+	size_t parity;
+	targets::raid::layout layout;
+};
+
+static const raid_type raid_types[] = {
+	{ "raid4", 1, targets::raid::parity_n },
+	{ "raid5", 1, targets::raid::left_symmetric },
+	{ "raid5_la", 1, targets::raid::left_asymmetric },
+	{ "raid5_ra", 1, targets::raid::right_asymmetric },
+	{ "raid5_ls", 1, targets::raid::left_symmetric },
+	{ "raid5_rs", 1, targets::raid::right_symmetric },
+	{ "raid5_n", 1, targets::raid::parity_n },
+	{ "raid6", 2, targets::raid::rotating_zero_restart },
+	{ "raid6_zr", 2, targets::raid::rotating_zero_restart },
+	{ "raid6_nr", 2, targets::raid::rotating_n_restart },
+	{ "raid6_nc", 2, targets::raid::rotating_n_continue },
+	{ "raid6_n_6", 2, targets::raid::parity_n },
+	{ "raid6_la_6", 2, targets::raid::left_asymmetric_6 },
+	{ "raid6_ra_6", 2, targets::raid::right_asymmetric_6 },
+	{ "raid6_ls_6", 2, targets::raid::left_symmetric_6 },
+	{ "raid6_rs_6", 2, targets::raid::right_symmetric_6 },
+	{ "raid6_0_6", 2, targets::raid::parity_0_6 },
+	{ NULL, 0, targets::raid::parity_n }
+};
+
+static bool mirrored(const segment& seg) {
+	return seg.type == "mirror" || seg.type == "raid1";
+}
+
+// Legs are hidden LVs, whose mirror logs and RAID metadata we needn't read
+SHARED_PTR<targets::mirror> volume_group::mirror_target(const segment& seg) {
+	if (seg.areas.empty())
+		throw exception("Mirror segment has no legs");
+	vector<target::ptr> legs;
+	for (size_t i = 0; i < seg.areas.size(); ++i)
+		legs.push_back(area_target(seg.areas[i]));
+	return SHARED_PTR<targets::mirror>(new targets::mirror(legs));
+}
+
+target::ptr volume_group::segment_target(const segment& seg) {
+	if (seg.type == "zero")
+		return target::ptr(new targets::zero());
+	if (seg.type == "error")
+		return target::ptr(new targets::error());
+	if (mirrored(seg))
+		return mirror_target(seg);
+	for (const raid_type *r = raid_types; r->name; ++r) {
+		if (seg.type != r->name)
+			continue;
+		if (seg.areas.size() <= r->parity)
+			throw exception("RAID segment has too few legs");
+		if (!seg.stripe_size)
+			throw exception("RAID segment has no stripe size");
+		vector<target::ptr> legs;
+		for (size_t i = 0; i < seg.areas.size(); ++i)
+			legs.push_back(area_target(seg.areas[i]));
+		return target::ptr(new targets::raid(legs, r->parity, r->layout,
+			seg.stripe_size));
+	}
+	if (seg.type != "striped")
+		throw exception("Unsupported segment type " + seg.type);
+	
+	if (seg.areas.empty())
+		throw exception("Striped segment has no stripes");
+	if (seg.areas.size() == 1)
+		return area_target(seg.areas[0]);
+	if (!seg.stripe_size)
+		throw exception("Striped segment has no stripe size");
+	vector<target::ptr> stripes;
+	for (size_t i = 0; i < seg.areas.size(); ++i)
+		stripes.push_back(area_target(seg.areas[i]));
+	return target::ptr(new targets::striped(stripes, seg.stripe_size));
+}
+
+target::ptr volume_group::lv_target(const lv& l) {
+	targets_t::iterator found = m_lv_targets.find(l.name());
+	if (found != m_lv_targets.end())
+		return found->second;
+	
+	off_t esize = metadata().extent_size();
+	targets::table *table = new targets::table();
+	target::ptr tgt(table);
+	const vector<segment>& segs = l.segments();
+	for (vector<segment>::const_iterator seg = segs.begin();
+			seg != segs.end(); ++seg) {
+		if (seg->start_extent * esize != table->size())
+			throw exception("LV " + l.name() + " has a gap between segments");
+		table->add(seg->extent_count * esize, segment_target(*seg));
+	}
+	m_lv_targets[l.name()] = tgt;
+	return tgt;
+}
+
+logical_volume volume_group::open(const string& name) {
+	const lv *l = metadata().find_lv(name);
+	if (!l)
+		throw exception("No LV named " + name);
+	
+	off_t esize = metadata().extent_size();
+	vector<logical_volume::extent> extents;
+	const vector<segment>& segs = l->segments();
+	for (vector<segment>::const_iterator seg = segs.begin();
+			seg != segs.end(); ++seg) {
+		for (size_t i = 0; i < seg->areas.size(); ++i) {
+			const area& a = seg->areas[i];
+			logical_volume::extent e;
+			e.offset = seg->start_extent * esize * BlockSize;
+			e.length = seg->extent_count * esize * BlockSize;
+			e.stripe = i;
+			e.stripes = seg->areas.size();
+			e.name = a.name;
+			e.start = a.extent * esize * BlockSize;
+			if (const pv *p = metadata().find_pv(a.name))
+				e.start += p->pe_start() * BlockSize;
+			extents.push_back(e);
+		}
+	}
+	
+	return logical_volume(name, lv_target(*l), l->extents() * esize * BlockSize,
+		extents);
+}
+
+vector<volume_group::mirror_segment> volume_group::mirrors(
+		const string& name) {
+	const lv *l = metadata().find_lv(name);
+	if (!l)
+		throw exception("No LV named " + name);
+	
+	off_t esize = metadata().extent_size();
+	vector<mirror_segment> found;
+	const vector<segment>& segs = l->segments();
+	for (vector<segment>::const_iterator seg = segs.begin();
+			seg != segs.end(); ++seg) {
+		if (!mirrored(*seg))
+			continue;
+		mirror_segment m = { seg->start_extent * esize,
+			seg->extent_count * esize, mirror_target(*seg) };
+		found.push_back(m);
+	}
+	return found;
+}
+
+void volume_groups::add(const char *path) {
+	SHARED_PTR<pvdevice> dev(new pvdevice(path));
+	SHARED_PTR<config> cfg(read_config(*dev));
+	volume_group::ptr& vg = m_by_uuid[cfg->uuid()];
+	if (!vg) {
+		vg.reset(new volume_group());
+		m_groups.push_back(vg);
+	}
+	vg->add(dev, cfg);
+}
+
+} // namespace lvm
@@ -0,0 +1,194 @@
+#include "lvm-text.hpp"
+#include "cpu.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_INTRIN 1
+#endif
+
+namespace lvm {
+namespace text {
+
+// Characters that need escaping, by format. LVM only escapes quotes and
+// backslashes; JSON also needs control characters.
+struct escapes {
+	bool lvm[256], json[256];
+	
+	escapes() {
+		for (int c = 0; c < 256; ++c) {
+			lvm[c] = c == '"' || c == '\\';
+			json[c] = lvm[c] || c < 0x20;
+		}
+	}
+};
+
+static const escapes& special() {
+	static escapes e;
+	return e;
+}
+
+#ifdef HAVE_X86_INTRIN
+// Length of the run of 's' with nothing to escape, sixteen bytes at a time
+__attribute__((target("sse2")))
+static size_t plain_sse2(const char *s, size_t n, bool json) {
+	const __m128i quote = _mm_set1_epi8('"'), slash = _mm_set1_epi8('\\');
+	const __m128i space = _mm_set1_epi8(0x1f);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+			_mm_cmpeq_epi8(v, slash));
+		if (json) // bytes that saturate to zero are below 0x20
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_subs_epu8(v, space),
+				_mm_setzero_si128()));
+		int mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i;
+}
+#endif
+
+static size_t plain(const char *s, size_t n, bool json) {
+	size_t i = 0;
+#ifdef HAVE_X86_INTRIN
+	if (devmapper::cpu().sse2) {
+		i = plain_sse2(s, n, json);
+		if (i + 16 <= n)
+			return i;
+	}
+#endif
+	const bool *table = json ? special().json : special().lvm;
+	while (i < n && !table[static_cast<unsigned char>(s[i])])
+		++i;
+	return i;
+}
+
+void writer::integer(long long i) {
+	char digits[24], *end = digits + sizeof(digits), *p = end;
+	unsigned long long u = i < 0 ? 0ULL - i : i;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (i < 0)
+		*--p = '-';
+	m_buf.append(p, end - p);
+}
+
+// Copy runs that need no escaping whole
+void writer::quoted(const char *s, size_t n) {
+	static const char hex[] = "0123456789abcdef";
+	bool json = m_format == JSON;
+	m_buf.reserve(m_buf.size() + n + 2);
+	m_buf += '"';
+	while (n) {
+		size_t run = plain(s, n, json);
+		m_buf.append(s, run);
+		if (run == n)
+			break;
+		
+		unsigned char c = s[run];
+		if (c == '"' || c == '\\') {
+			m_buf += '\\';
+			m_buf += c;
+		} else {
+			char u[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+			m_buf.append(u, sizeof(u));
+		}
+		s += run + 1;
+		n -= run + 1;
+	}
+	m_buf += '"';
+}
+
+void writer::indent() {
+	m_buf.append(4 * m_depth, ' ');
+}
+
+void writer::write(const value& v) {
+	switch (v.type()) {
+		case value::Integer: integer(v.integer()); break;
+		case value::String: quoted(v.string()); break;
+		case value::Array: write(v.array()); break;
+		case value::Section: write(v.section()); break;
+	}
+}
+
+void writer::write(const array_t& a) {
+	const char *sep = m_format == JSON ? "," : ", ";
+	m_buf += '[';
+	for (array_t::const_iterator it = a.begin(); it != a.end(); ++it) {
+		if (it != a.begin())
+			m_buf += sep;
+		write(*it);
+	}
+	m_buf += ']';
+}
+
+void writer::write(const section_t& m) {
+	if (m_format == JSON) {
+		open('{');
+		for (section_t::const_iterator it = m.begin(); it != m.end(); ++it) {
+			key(it->first.c_str());
+			write(it->second);
+		}
+		close('}');
+		return;
+	}
+	
+	for (section_t::const_iterator it = m.begin(); it != m.end(); ++it) {
+		indent();
+		m_buf += it->first;
+		if (it->second.type() == value::Section) {
+			m_buf += " {\n";
+			++m_depth;
+			write(it->second);
+			--m_depth;
+			indent();
+			m_buf += '}';
+		} else {
+			m_buf += " = ";
+			write(it->second);
+		}
+		m_buf += '\n';
+	}
+}
+
+void writer::open(char bracket) {
+	m_buf += bracket;
+	m_first.push_back(true);
+}
+
+void writer::close(char bracket) {
+	m_buf += bracket;
+	m_first.pop_back();
+}
+
+void writer::item() {
+	if (!m_first.back())
+		m_buf += ',';
+	m_first.back() = false;
+}
+
+void writer::key(const char *k) {
+	item();
+	quoted(k, strlen(k));
+	m_buf += ':';
+}
+
+void writer::field(const char *k, const std::string& v) {
+	key(k);
+	quoted(v);
+}
+
+void writer::field(const char *k, long long v) {
+	key(k);
+	m_buf += '"';
+	integer(v);
+	m_buf += '"';
+}
+
+} } // namespace lvm::text
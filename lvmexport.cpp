@@ -0,0 +1,125 @@
+#include "exporter.hpp"
+#include "lvm.hpp"
+
+#include <iostream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Copy an LV from the given PVs to an image file or device, with several
+// large reads in flight. Zeroes are left as holes unless -n is given. Shows
+// progress as it goes on a terminal, and a summary at the end.
+
+using namespace devmapper;
+using namespace lvm;
+using namespace std;
+
+static void usage(const char *prog) {
+	cerr << "Usage: " << prog << " [-j WORKERS] [-C CHUNK_MIB] [-n] [-q] "
+		"VG/LV IMAGE PV...\n";
+	exit(2);
+}
+
+namespace {
+
+struct meter : public exporter::reporter {
+	meter(bool live) : live(live) { }
+
+	virtual void report(const exporter::progress& p) {
+		double mib = 1 << 20;
+		double secs = p.elapsed_ns / 1e9;
+		double rate = secs > 0 ? p.done / mib / secs : 0;
+		bool last = p.done == p.total;
+		if (!live && !last)
+			return;
+		fprintf(stderr, "%s%5.1f%% %.0f of %.0f MiB, %.1f MiB/s "
+			"(%.0f MiB written, %.0f copied, %.0f zero)%s",
+			live ? "\r" : "", p.total ? 100.0 * p.done / p.total : 100.0,
+			p.done / mib, p.total / mib, rate, p.written / mib,
+			p.copied / mib, p.zero / mib, last ? "\n" : "");
+	}
+
+private:
+	bool live;
+};
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+	exporter::options opts;
+	bool quiet = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:C:nq")) != -1) {
+		if (opt == 'j')
+			opts.workers = strtoul(optarg, NULL, 0);
+		else if (opt == 'C')
+			opts.chunk_bytes = size_t(strtoul(optarg, NULL, 0)) << 20;
+		else if (opt == 'n')
+			opts.sparse = false;
+		else if (opt == 'q')
+			quiet = true;
+		else
+			usage(argv[0]);
+	}
+	if (argc - optind < 3)
+		usage(argv[0]);
+	string name = argv[optind];
+	const char *image = argv[optind + 1];
+	string::size_type slash = name.find('/');
+	if (slash == string::npos)
+		usage(argv[0]);
+
+	volume_groups vgs;
+	for (int i = optind + 2; i < argc; ++i) {
+		try {
+			vgs.add(argv[i]);
+		} catch (std::exception& e) {
+			cerr << argv[i] << ": " << e.what() << "\n";
+		}
+	}
+
+	volume_group::ptr vg;
+	const vector<volume_group::ptr>& groups = vgs.groups();
+	for (size_t i = 0; i < groups.size(); ++i)
+		if (groups[i]->metadata().name() == name.substr(0, slash))
+			vg = groups[i];
+	if (!vg) {
+		cerr << "No VG " << name.substr(0, slash) << "\n";
+		return 1;
+	}
+	if (!vg->complete())
+		cerr << "VG " << vg->metadata().name() << " is missing PVs\n";
+
+	try {
+		logical_volume vol(vg->open(name.substr(slash + 1)));
+
+		// Start files from empty, so zeroes needn't be punched out
+		int fd = open(image, O_WRONLY | O_CREAT, 0644);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1 ||
+				(S_ISREG(st.st_mode) && ftruncate(fd, 0) == -1)) {
+			cerr << image << ": " << strerror(errno) << "\n";
+			return 1;
+		}
+
+		meter m(isatty(STDERR_FILENO));
+		exporter ex(*vol.target(), vol.size(), opts);
+		int err = ex.run(fd, quiet ? NULL : &m);
+		if (err == 0 && fsync(fd) == -1 && errno != EINVAL)
+			err = -errno;
+		close(fd);
+		if (err < 0) {
+			cerr << image << ": " << strerror(-err) << "\n";
+			return 1;
+		}
+	} catch (std::exception& e) {
+		cerr << "LV " << name << ": " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,163 @@
+#include "blockcache.hpp"
+#include "lvm.hpp"
+#include "scrubber.hpp"
+
+#include <iostream>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Serve every LV on the given PVs from one mount, as MOUNTPOINT/vg/lv. All
+// VGs share one block cache, one pool of I/O threads, and one descriptor per
+// device. Each LV's read limits are in MOUNTPOINT/.limits/vg/lv.
+//
+// With -w, concurrent reads of each PV are merged, after waiting up to
+// WINDOW_USEC for company while the PV is busy. That helps disks that seek,
+// not SSDs. MOUNTPOINT/.iosched/vg/pv holds the settings, and counts how many
+// reads were merged.
+//
+// Mirrored LVs are scrubbed in the background, reading at most SCRUB_MIB a
+// second from their legs. It runs from the start with -m, or once "state
+// running" is written to MOUNTPOINT/.scrub, which shows its progress and what
+// didn't match. With -M, that's kept in CHECKPOINT too, and a scrub picks up
+// from there, with the state and rate it had.
+//
+// MOUNTPOINT/.report.json describes the VGs, PVs and LVs as
+// `lvm fullreport --reportformat json` would.
+
+using namespace devmapper;
+using namespace lvm;
+using namespace std;
+
+static void usage(const char *prog) {
+	cerr << "Usage: " << prog << " [-c CACHE_MIB] [-s SSD_DIR] [-S SSD_MIB] "
+		"[-m SCRUB_MIB] [-M CHECKPOINT] [-w WINDOW_USEC] MOUNTPOINT PV...\n";
+	exit(2);
+}
+
+namespace {
+
+// A read-only view of the VGs' metadata, which doesn't change once loaded
+struct report : public fuse_control {
+	report(const vector<volume_group::ptr>& groups) {
+		vector<const config*> configs;
+		for (size_t i = 0; i < groups.size(); ++i)
+			configs.push_back(&groups[i]->metadata());
+		text = json_report(configs) + "\n";
+	}
+	
+	virtual string get() { return text; }
+	virtual int set(const string& text) { return -EACCES; }
+	virtual bool writable() const { return false; }
+	
+private:
+	string text;
+};
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+	size_t cache_mib = 64, ssd_mib = 1024, scrub_mib = 16;
+	const char *ssd_dir = NULL, *checkpoint = "";
+	bool scrub_now = false, scheduled = false;
+	iosched::config sched;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:s:S:m:M:w:")) != -1) {
+		if (opt == 'c')
+			cache_mib = strtoul(optarg, NULL, 0);
+		else if (opt == 's')
+			ssd_dir = optarg;
+		else if (opt == 'S')
+			ssd_mib = strtoul(optarg, NULL, 0);
+		else if (opt == 'm') {
+			scrub_mib = strtoul(optarg, NULL, 0);
+			scrub_now = true;
+		} else if (opt == 'M')
+			checkpoint = optarg;
+		else if (opt == 'w') {
+			unsigned long usec = strtoul(optarg, NULL, 0);
+			if (optarg[0] == '-' || usec > 1000000)
+				usage(argv[0]);
+			sched.window_usec = usec;
+			scheduled = true;
+		}
+		else
+			usage(argv[0]);
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+	const char *mountpoint = argv[optind];
+	blockcache::shared().set_budget(cache_mib << 20);
+	
+	volume_groups vgs;
+	for (int i = optind + 1; i < argc; ++i) {
+		try {
+			vgs.add(argv[i]);
+		} catch (std::exception& e) {
+			cerr << argv[i] << ": " << e.what() << "\n";
+		}
+	}
+	
+	fuse_tree tree;
+	scrubber scrub(checkpoint, uint64_t(scrub_mib) << 20);
+	bool scrubbing = false;
+	const vector<volume_group::ptr>& groups = vgs.groups();
+	for (size_t i = 0; i < groups.size(); ++i) {
+		volume_group& vg = *groups[i];
+		const string& vgname = vg.metadata().name();
+		if (!vg.complete())
+			cerr << "VG " << vgname << " is missing PVs\n";
+		if (ssd_dir)
+			vg.ssd_cache(ssd_dir, size_t(ssd_mib) << 20);
+		if (scheduled)
+			vg.schedule(sched);
+		
+		const vector<lv>& lvs = vg.metadata().lvs();
+		for (vector<lv>::const_iterator l = lvs.begin(); l != lvs.end(); ++l) {
+			if (!l->visible())
+				continue;
+			try {
+				logical_volume vol(vg.open(l->name()));
+				target::ptr cached(new targets::cached(vol.target()));
+				SHARED_PTR<targets::throttle> tgt(
+					new targets::throttle(cached));
+				string path = vgname + "/" + l->name();
+				tree.add(path, tgt, vol.size());
+				tree.add(".limits/" + path, tgt->control());
+				
+				vector<volume_group::mirror_segment> mirrors(
+					vg.mirrors(l->name()));
+				for (size_t m = 0; m < mirrors.size(); ++m) {
+					scrub.add(path, mirrors[m].start, mirrors[m].length,
+						mirrors[m].tgt);
+					scrubbing = true;
+				}
+			} catch (std::exception& e) {
+				cerr << "LV " << vgname << "/" << l->name() << ": "
+					<< e.what() << "\n";
+			}
+		}
+		
+		const vector<pv>& pvs = vg.metadata().pvs();
+		for (vector<pv>::const_iterator p = pvs.begin(); p != pvs.end(); ++p)
+			if (iosched::ptr s = vg.scheduler(p->name()))
+				tree.add(".iosched/" + vgname + "/" + p->name(), s->control());
+	}
+	
+	if (groups.empty()) {
+		cerr << "No VGs found\n";
+		return 1;
+	}
+	tree.add(".report.json", fuse_control::ptr(new report(groups)));
+	if (scrubbing) {
+		try {
+			scrub.start(!scrub_now);
+			tree.add(".scrub", scrub.control());
+		} catch (std::exception& e) {
+			cerr << "Scrub: " << e.what() << "\n";
+		}
+	}
+	fuse_serve(mountpoint, tree);
+	return 0;
+}
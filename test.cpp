@@ -1,26 +1,1284 @@
+#include "cpu.hpp"
+#include "crypto.hpp"
+#include "exporter.hpp"
 #include "lvm.hpp"
 #include "lvm-text.hpp"
+#include "memscan.hpp"
+#include "parity.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 using namespace devmapper;
 using namespace lvm;
 using namespace lvm::text;
 using namespace std;
 
+namespace {
+
+/***** XTS known answers, from IEEE 1619-2007 Annex B *****/
+
+struct xts_vector {
+	const char *key, *ciphertext;
+	uint64_t sector;
+};
+
+// Vectors 4 and 10: both 512-byte sectors of 00 01 02 ... ff 00 01 ... ff
+const xts_vector XtsVectors[] = {
+	{ "27182818284590452353602874713526"
+		"31415926535897932384626433832795",
+		"27a7479befa1d476489f308cd4cfa6e2a96e4bbe3208ff25287dd3819616e89c"
+		"c78cf7f5e543445f8333d8fa7f56000005279fa5d8b5e4ad40e736ddb4d35412"
+		"328063fd2aab53e5ea1e0a9f332500a5df9487d07a5c92cc512c8866c7e860ce"
+		"93fdf166a24912b422976146ae20ce846bb7dc9ba94a767aaef20c0d61ad0265"
+		"5ea92dc4c4e41a8952c651d33174be51a10c421110e6d81588ede82103a252d8"
+		"a750e8768defffed9122810aaeb99f9172af82b604dc4b8e51bcb08235a6f434"
+		"1332e4ca60482a4ba1a03b3e65008fc5da76b70bf1690db4eae29c5f1badd03c"
+		"5ccf2a55d705ddcd86d449511ceb7ec30bf12b1fa35b913f9f747a8afd1b130e"
+		"94bff94effd01a91735ca1726acd0b197c4e5b03393697e126826fb6bbde8ecc"
+		"1e08298516e2c9ed03ff3c1b7860f6de76d4cecd94c8119855ef5297ca67e9f3"
+		"e7ff72b1e99785ca0a7e7720c5b36dc6d72cac9574c8cbbc2f801e23e56fd344"
+		"b07f22154beba0f08ce8891e643ed995c94d9a69c9f1b5f499027a78572aeebd"
+		"74d20cc39881c213ee770b1010e4bea718846977ae119f7a023ab58cca0ad752"
+		"afe656bb3c17256a9f6e9bf19fdd5a38fc82bbe872c5539edb609ef4f79c203e"
+		"bb140f2e583cb2ad15b4aa5b655016a8449277dbd477ef2c8d6c017db738b18d"
+		"eb4a427d1923ce3ff262735779a418f20a282df920147beabe421ee5319d0568",
+		0 },
+	{ "2718281828459045235360287471352662497757247093699959574966967627"
+		"3141592653589793238462643383279502884197169399375105820974944592",
+		"1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b"
+		"5d31e276f8fe4a8d66b317f9ac683f44680a86ac35adfc3345befecb4bb188fd"
+		"5776926c49a3095eb108fd1098baec70aaa66999a72a82f27d848b21d4a741b0"
+		"c5cd4d5fff9dac89aeba122961d03a757123e9870f8acf1000020887891429ca"
+		"2a3e7a7d7df7b10355165c8b9a6d0a7de8b062c4500dc4cd120c0f7418dae3d0"
+		"b5781c34803fa75421c790dfe1de1834f280d7667b327f6c8cd7557e12ac3a0f"
+		"93ec05c52e0493ef31a12d3d9260f79a289d6a379bc70c50841473d1a8cc81ec"
+		"583e9645e07b8d9670655ba5bbcfecc6dc3966380ad8fecb17b6ba02469a020a"
+		"84e18e8f84252070c13e9f1f289be54fbc481457778f616015e1327a02b140f1"
+		"505eb309326d68378f8374595c849d84f4c333ec4423885143cb47bd71c5edae"
+		"9be69a2ffeceb1bec9de244fbe15992b11b77c040f12bd8f6a975a44a0f90c29"
+		"a9abc3d4d893927284c58754cce294529f8614dcd2aba991925fedc4ae74ffac"
+		"6e333b93eb4aff0479da9a410e4450e0dd7ae4c6e2910900575da401fc07059f"
+		"645e8b7e9bfdef33943054ff84011493c27b3429eaedb4ed5376441a77ed4385"
+		"1ad77f16f541dfd269d50d6a5f14fb0aab1cbb4c1550be97f7ab4066193c4caa"
+		"773dad38014bd2092fa755c824bb5e54c4f36ffda9fcea70b9c6e693e148c151",
+		0xff },
+};
+
+vector<uint8_t> unhex(const char *s) {
+	vector<uint8_t> bytes;
+	for (; s[0] && s[1]; s += 2) {
+		unsigned b;
+		sscanf(s, "%2x", &b);
+		bytes.push_back(b);
+	}
+	return bytes;
+}
+
+int test_xts() {
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(XtsVectors) / sizeof(XtsVectors[0]); ++i) {
+		const xts_vector& v = XtsVectors[i];
+		vector<uint8_t> key(unhex(v.key)), buf(unhex(v.ciphertext));
+		crypto::xts(&key[0], key.size()).decrypt(&buf[0], 1, v.sector);
+
+		bool ok = buf.size() == BlockSize;
+		for (size_t j = 0; ok && j < buf.size(); ++j)
+			ok = buf[j] == uint8_t(j);
+		cout << "xts " << key.size() * 4 << "-bit key: "
+			<< (ok ? "ok" : "FAILED") << "\n";
+		failed += !ok;
+	}
+	return failed ? 1 : 0;
+}
+
+
+/***** NBD round trip, over a Unix socket *****/
+
+// Each byte is a function of its position
+struct pattern : public target {
+	static uint8_t at(off_t pos) { return pos * 2654435761u >> 24; }
+
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		for (size_t i = 0; i < size; ++i)
+			buf[i] = at(block * BlockSize + offset + i);
+		return size;
+	}
+};
+
+const size_t NbdSize = 1 << 20;
+
+struct nbd_server {
+	const char *path;
+	target *tgt;
+};
+
+void *serve(void *arg) {
+	nbd_server *s = reinterpret_cast<nbd_server*>(arg);
+	nbd_serve(s->path, *s->tgt, NbdSize);
+	return NULL;
+}
+
+bool send_all(int fd, const void *buf, size_t size) {
+	const char *p = reinterpret_cast<const char*>(buf);
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n <= 0 && errno != EINTR)
+			return false;
+		if (n > 0) {
+			p += n;
+			size -= n;
+		}
+	}
+	return true;
+}
+
+bool recv_all(int fd, void *buf, size_t size) {
+	char *p = reinterpret_cast<char*>(buf);
+	while (size) {
+		ssize_t n = read(fd, p, size);
+		if (n <= 0 && (n == 0 || errno != EINTR))
+			return false;
+		if (n > 0) {
+			p += n;
+			size -= n;
+		}
+	}
+	return true;
+}
+
+// Big-endian, as on the wire
+uint64_t get(const uint8_t *p, size_t bytes) {
+	uint64_t v = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		v = v << 8 | p[i];
+	return v;
+}
+
+void put(uint8_t *p, size_t bytes, uint64_t v) {
+	for (size_t i = bytes; i--; v >>= 8)
+		p[i] = v;
+}
+
+// Send an option, and collect its replies up to the last. Return that
+// one's type, and the export size if it was given.
+uint32_t nbd_option(int fd, uint32_t opt, const uint8_t *data, size_t len,
+		uint64_t& size) {
+	uint8_t hdr[16];
+	put(hdr, 8, 0x49484156454f5054ULL); // "IHAVEOPT"
+	put(hdr + 8, 4, opt);
+	put(hdr + 12, 4, len);
+	if (!send_all(fd, hdr, 16) || !send_all(fd, data, len))
+		return 0;
+
+	while (true) {
+		uint8_t rep[20];
+		if (!recv_all(fd, rep, 20) || get(rep, 8) != 0x3e889045565a9ULL ||
+				get(rep + 8, 4) != opt)
+			return 0;
+		uint32_t type = get(rep + 12, 4);
+		vector<uint8_t> body(get(rep + 16, 4) + 1);
+		if (!recv_all(fd, &body[0], body.size() - 1))
+			return 0;
+		if (type == 3 && body.size() > 10 && get(&body[0], 2) == 0) // export
+			size = get(&body[2], 8);
+		if (type != 3) // anything but more info ends it
+			return type;
+	}
+}
+
+// Read 'length' bytes at 'offset' with a simple reply. False unless it
+// worked.
+bool nbd_read(int fd, uint64_t handle, uint64_t offset, uint32_t length,
+		vector<uint8_t>& buf) {
+	uint8_t req[28];
+	put(req, 4, 0x25609513);
+	put(req + 4, 2, 0);		// flags
+	put(req + 6, 2, 0);		// read
+	put(req + 8, 8, handle);
+	put(req + 16, 8, offset);
+	put(req + 24, 4, length);
+	if (!send_all(fd, req, 28))
+		return false;
+
+	uint8_t rep[16];
+	if (!recv_all(fd, rep, 16) || get(rep, 4) != 0x67446698 ||
+			get(rep + 4, 4) != 0 || get(rep + 8, 8) != handle)
+		return false;
+	buf.resize(length);
+	return !length || recv_all(fd, &buf[0], length);
+}
+
+// Read past the end. That must fail with EINVAL, in a structured error
+// chunk ending the reply if those were agreed on.
+bool nbd_bad_read(int fd, bool structured) {
+	uint8_t req[28];
+	put(req, 4, 0x25609513);
+	put(req + 4, 4, 0);		// flags, read
+	put(req + 8, 8, 99);
+	put(req + 16, 8, NbdSize);
+	put(req + 24, 4, BlockSize);
+	if (!send_all(fd, req, 28))
+		return false;
+
+	if (!structured) {
+		uint8_t rep[16];
+		return recv_all(fd, rep, 16) && get(rep, 4) == 0x67446698 &&
+			get(rep + 4, 4) == 22 && get(rep + 8, 8) == 99;
+	}
+	uint8_t chunk[26];
+	return recv_all(fd, chunk, 26) && get(chunk, 4) == 0x668e33ef &&
+		get(chunk + 4, 2) == 1 && get(chunk + 6, 2) == 32769 &&
+		get(chunk + 8, 8) == 99 && get(chunk + 16, 4) == 6 &&
+		get(chunk + 20, 4) == 22;
+}
+
+bool nbd_check(int fd, bool structured) {
+	uint8_t hello[18];
+	if (!recv_all(fd, hello, 18) || get(hello, 8) != 0x4e42444d41474943ULL)
+		return false;
+	uint8_t flags[4];
+	put(flags, 4, 3);	// fixed newstyle, no zeroes
+	if (!send_all(fd, flags, 4))
+		return false;
+
+	// A name length past the end of the option is refused, but the
+	// connection goes on
+	uint64_t size = 0;
+	uint8_t bad[6];
+	put(bad, 4, 0xffffffff);
+	put(bad + 4, 2, 0);
+	if (nbd_option(fd, 7, bad, 6, size) != 0x80000003) {
+		cout << "nbd: malformed GO wasn't refused\n";
+		return false;
+	}
+	if (structured && nbd_option(fd, 8, NULL, 0, size) != 1) {
+		cout << "nbd: structured replies refused\n";
+		return false;
+	}
+
+	uint8_t go[6];
+	put(go, 4, 0);	// default export
+	put(go + 4, 2, 0);
+	if (nbd_option(fd, 7, go, 6, size) != 1 || size != NbdSize) {
+		cout << "nbd: GO failed, size " << size << "\n";
+		return false;
+	}
+
+	if (!nbd_bad_read(fd, structured)) {
+		cout << "nbd: bad read wasn't refused properly\n";
+		return false;
+	}
+
+	// Whole blocks, then a piece straddling two
+	const uint64_t offsets[] = { 8 * BlockSize, 3 * BlockSize + 100 };
+	const uint32_t lengths[] = { 64 * 1024, 1000 };
+	for (size_t i = 0; !structured && i < 2; ++i) {
+		vector<uint8_t> buf;
+		if (!nbd_read(fd, i, offsets[i], lengths[i], buf)) {
+			cout << "nbd: read " << i << " failed\n";
+			return false;
+		}
+		for (size_t j = 0; j < buf.size(); ++j) {
+			if (buf[j] != pattern::at(offsets[i] + j)) {
+				cout << "nbd: read " << i << " differs at " << j << "\n";
+				return false;
+			}
+		}
+	}
+
+	uint8_t disc[28];
+	memset(disc, 0, sizeof(disc));
+	put(disc, 4, 0x25609513);
+	put(disc + 6, 2, 2);
+	return send_all(fd, disc, 28);
+}
+
+int test_nbd() {
+	char path[] = "/tmp/lvmfuse-test-XXXXXX";
+	if (!mkdtemp(path)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string sock = string(path) + "/nbd";
+
+	pattern tgt;
+	nbd_server server = { sock.c_str(), &tgt };
+	pthread_t thread;
+	pthread_create(&thread, NULL, serve, &server);
+
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, sock.c_str());
+
+	// Once with simple replies, once with structured
+	bool ok = true;
+	for (int structured = 0; structured < 2; ++structured) {
+		int fd = -1;
+		for (int tries = 0; fd == -1 && tries < 100; ++tries) {
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (connect(fd, reinterpret_cast<struct sockaddr*>(&sun),
+					sizeof(sun)) == -1) {
+				close(fd);
+				fd = -1;
+				usleep(10000);
+			}
+		}
+		// A reply that's the wrong shape shouldn't hang us
+		struct timeval timeout = { 5, 0 };
+		if (fd != -1)
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		bool good = fd != -1 && nbd_check(fd, structured);
+		cout << "nbd round trip, " << (structured ? "structured" : "simple")
+			<< " replies: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+		if (fd != -1)
+			close(fd);
+	}
+	unlink(sock.c_str());
+	rmdir(path);
+	return ok ? 0 : 1;
+}
+
+/***** RAID 5 and 6 against md's own layouts, and the parity kernels *****/
+
+// An in-memory leg, which reads short past its end
+struct memory : public target {
+	vector<uint8_t> data;
+	int reads;
+
+	memory() : reads(0) { }
+
+	virtual int read(off_t block, uint8_t *buf, size_t offset, size_t size) {
+		__sync_fetch_and_add(&reads, 1);
+		size_t pos = block * BlockSize + offset;
+		if (pos >= data.size())
+			return 0;
+		size_t n = min(size, data.size() - pos);
+		memcpy(buf, &data[pos], n);
+		return n;
+	}
+};
+
+struct raid_case {
+	const char *name;
+	targets::raid::layout layout;
+	size_t legs, parity;
+};
+
+const raid_case RaidCases[] = {
+	{ "raid5 left_symmetric", targets::raid::left_symmetric, 4, 1 },
+	{ "raid6 left_symmetric", targets::raid::left_symmetric, 5, 2 },
+	{ "raid6 rotating_zero_restart", targets::raid::rotating_zero_restart,
+		5, 2 },
+};
+
+const off_t RaidChunk = 2;
+
+// Where md's raid5_compute_sector() puts data chunk 'dd' of 'stripe'
+size_t md_place(const raid_case& c, off_t stripe, size_t dd, size_t& pd,
+		size_t& qd, bool& ddf) {
+	size_t n = c.legs;
+	ddf = false;
+	if (c.parity == 1) {	// ALGORITHM_LEFT_SYMMETRIC
+		pd = n - 1 - stripe % n;
+		qd = n;
+		return (pd + 1 + dd) % n;
+	}
+	if (c.layout == targets::raid::left_symmetric) {
+		pd = n - 1 - stripe % n;
+		qd = (pd + 1) % n;
+		return (pd + 2 + dd) % n;
+	}
+	// ALGORITHM_ROTATING_ZERO_RESTART
+	pd = stripe % n;
+	qd = pd + 1;
+	if (pd == n - 1) {
+		++dd;
+		qd = 0;
+	} else if (dd >= pd) {
+		dd += 2;
+	}
+	ddf = true;
+	return dd;
+}
+
+// Lay out 'stripes' stripes of pattern data as md would, with P and Q
+vector<memory*> raid_legs(const raid_case& c, off_t stripes) {
+	size_t size = RaidChunk * BlockSize, data = c.legs - c.parity;
+	vector<memory*> legs;
+	for (size_t i = 0; i < c.legs; ++i) {
+		legs.push_back(new memory());
+		legs[i]->data.resize(stripes * size);
+	}
+	for (off_t s = 0; s < stripes; ++s) {
+		size_t pd = 0, qd = 0;
+		bool ddf = false;
+		vector<size_t> where(data);
+		for (size_t dd = 0; dd < data; ++dd) {
+			where[dd] = md_place(c, s, dd, pd, qd, ddf);
+			uint8_t *chunk = &legs[where[dd]]->data[s * size];
+			off_t pos = (s * data + dd) * size;
+			for (size_t j = 0; j < size; ++j)
+				chunk[j] = pattern::at(pos + j);
+		}
+		// As md's raid6_idx_to_slot(), from the leg after Q
+		size_t start = ddf || qd == c.legs - 1 ? 0 : qd + 1;
+		for (size_t k = 0, slot = 0; k < c.legs; ++k) {
+			size_t i = (start + k) % c.legs;
+			if (i == pd || i == qd)
+				continue;
+			uint8_t g = parity::exp2(ddf ? i : slot++);
+			for (size_t j = 0; j < size; ++j) {
+				uint8_t d = legs[i]->data[s * size + j];
+				legs[pd]->data[s * size + j] ^= d;
+				if (qd < c.legs)
+					legs[qd]->data[s * size + j] ^= parity::mul(g, d);
+			}
+		}
+	}
+	return legs;
+}
+
+// Read everything back, whole and in pieces, without the legs in 'gone'
+bool raid_check(const raid_case& c, const vector<memory*>& mem,
+		const vector<size_t>& gone, off_t stripes) {
+	vector<target::ptr> legs;
+	for (size_t i = 0; i < mem.size(); ++i) {
+		memory *copy = new memory(*mem[i]);
+		legs.push_back(target::ptr(copy));
+	}
+	for (size_t i = 0; i < gone.size(); ++i)
+		legs[gone[i]].reset();
+	targets::raid raid(legs, c.parity, c.layout, RaidChunk);
+
+	size_t blocks = stripes * RaidChunk * (c.legs - c.parity);
+	vector<uint8_t> buf(blocks * BlockSize);
+	int err = raid.read_blocks(0, &buf[0], blocks);
+	if (gone.size() > c.parity)
+		return err == -EIO;
+	if (err != int(buf.size()))
+		return false;
+	for (size_t j = 0; j < buf.size(); ++j)
+		if (buf[j] != pattern::at(j))
+			return false;
+
+	// Single blocks, and partial ones, chunk by chunk
+	for (size_t b = 0; b < blocks; ++b) {
+		uint8_t part[BlockSize];
+		if (raid.read(b, part, 100, 300) != 300)
+			return false;
+		for (size_t j = 0; j < 300; ++j)
+			if (part[j] != pattern::at(b * BlockSize + 100 + j))
+				return false;
+	}
+	return true;
+}
+
+// A leg that's cut short is rebuilt past where it ends, and not read again
+bool raid_short(const raid_case& c, const vector<memory*>& mem,
+		off_t stripes) {
+	vector<target::ptr> legs;
+	memory *cut = NULL;
+	for (size_t i = 0; i < mem.size(); ++i) {
+		memory *copy = new memory(*mem[i]);
+		if (i == 1) {
+			cut = copy;
+			cut->data.resize(cut->data.size() / 2 + 1000);
+		}
+		legs.push_back(target::ptr(copy));
+	}
+	targets::raid raid(legs, c.parity, c.layout, RaidChunk);
+
+	size_t blocks = stripes * RaidChunk * (c.legs - c.parity);
+	vector<uint8_t> buf(blocks * BlockSize);
+	for (int pass = 0; pass < 2; ++pass) {
+		int before = cut->reads;
+		if (raid.read_blocks(0, &buf[0], blocks) != int(buf.size()))
+			return false;
+		for (size_t j = 0; j < buf.size(); ++j)
+			if (buf[j] != pattern::at(j))
+				return false;
+		if (pass == 1 && cut->reads != before)
+			return false;
+	}
+	return true;
+}
+
+bool parity_check() {
+	const size_t sizes[] = { 1, 15, 16, 31, 33, 64, 100, BlockSize + 7 };
+	const size_t offsets[] = { 0, 1, 3 };
+	const uint8_t consts[] = { 0, 1, 2, 0x1d, 0x8e, 0xff };
+	vector<uint8_t> src(BlockSize + 16), dst(BlockSize + 16), ref;
+	for (size_t i = 0; i < src.size(); ++i) {
+		src[i] = pattern::at(i);
+		dst[i] = pattern::at(i + 12345);
+	}
+
+	for (size_t si = 0; si < sizeof(sizes) / sizeof(*sizes); ++si) {
+		for (size_t oi = 0; oi < sizeof(offsets) / sizeof(*offsets); ++oi) {
+			size_t size = sizes[si], off = offsets[oi];
+			vector<uint8_t> out = dst;
+			ref = dst;
+			parity::xor_into(&out[off], &src[off + 1], size);
+			for (size_t j = 0; j < size; ++j)
+				ref[off + j] ^= src[off + 1 + j];
+			if (out != ref) {
+				cout << "parity: xor_into differs, size " << size << "\n";
+				return false;
+			}
+
+			for (size_t ci = 0; ci < sizeof(consts); ++ci) {
+				uint8_t c = consts[ci];
+				out = ref = dst;
+				parity::mul_xor_into(&out[off], &src[off + 1], c, size);
+				for (size_t j = 0; j < size; ++j)
+					ref[off + j] ^= parity::mul(c, src[off + 1 + j]);
+				if (out != ref) {
+					cout << "parity: mul_xor_into differs, size " << size
+						<< ", by " << int(c) << "\n";
+					return false;
+				}
+
+				out = ref = dst;
+				parity::scale(&out[off], c, size);
+				for (size_t j = 0; j < size; ++j)
+					ref[off + j] = parity::mul(c, ref[off + j]);
+				if (out != ref) {
+					cout << "parity: scale differs, size " << size
+						<< ", by " << int(c) << "\n";
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+int test_raid() {
+	const cpu_features& f = cpu();
+	bool ok = parity_check();
+	cout << "parity kernels (" << (f.avx2 ? "avx2" : f.ssse3 ? "ssse3"
+		: f.sse2 ? "sse2" : "scalar") << ") against the tables: "
+		<< (ok ? "ok" : "FAILED") << "\n";
+
+	for (size_t ci = 0; ci < sizeof(RaidCases) / sizeof(*RaidCases); ++ci) {
+		const raid_case& c = RaidCases[ci];
+		off_t stripes = 2 * c.legs;	// Every rotation, twice
+		vector<memory*> mem = raid_legs(c, stripes);
+
+		// Nothing missing, every single leg, and every pair
+		vector<vector<size_t> > sets(1);
+		for (size_t i = 0; i < c.legs; ++i) {
+			sets.push_back(vector<size_t>(1, i));
+			for (size_t j = i + 1; j < c.legs; ++j) {
+				sets.push_back(vector<size_t>(1, i));
+				sets.back().push_back(j);
+			}
+		}
+		for (size_t si = 0; si < sets.size(); ++si) {
+			if (raid_check(c, mem, sets[si], stripes))
+				continue;
+			cout << c.name << ": FAILED without legs";
+			for (size_t i = 0; i < sets[si].size(); ++i)
+				cout << " " << sets[si][i];
+			cout << "\n";
+			ok = false;
+		}
+
+		bool good = raid_short(c, mem, stripes);
+		cout << c.name << ": " << sets.size() << " sets of legs, and a short "
+			"leg: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+
+		for (size_t i = 0; i < mem.size(); ++i)
+			delete mem[i];
+	}
+	return ok ? 0 : 1;
+}
+
+/***** dm-verity over a small hash tree *****/
+
+const off_t VerityBlocks = 300;	// Three bottom hash blocks, and a top one
+const size_t VerityBlockSize = 4096;
+const char VeritySalt[] = "pepper";
+
+vector<uint8_t> verity_digest(const uint8_t *data) {
+	vector<uint8_t> digest(crypto::sha256::DigestBytes);
+	crypto::sha256 h;
+	h.update(reinterpret_cast<const uint8_t*>(VeritySalt),
+		strlen(VeritySalt));
+	h.update(data, VerityBlockSize);
+	h.final(&digest[0]);
+	return digest;
+}
+
+// Digests of 'blocks', packed into hash blocks
+vector<uint8_t> verity_level(const vector<uint8_t>& blocks) {
+	size_t count = blocks.size() / VerityBlockSize;
+	size_t per = VerityBlockSize / crypto::sha256::DigestBytes;
+	vector<uint8_t> level((count + per - 1) / per * VerityBlockSize);
+	for (size_t i = 0; i < count; ++i) {
+		vector<uint8_t> d = verity_digest(&blocks[i * VerityBlockSize]);
+		copy(d.begin(), d.end(),
+			level.begin() + i * crypto::sha256::DigestBytes);
+	}
+	return level;
+}
+
+struct verity_tree {
+	memory *data, *hash;
+	target::ptr data_ptr, hash_ptr;
+	targets::verity::params par;
+
+	verity_tree() : data(new memory()), hash(new memory()),
+			data_ptr(data), hash_ptr(hash) {
+		data->data.resize(VerityBlocks * VerityBlockSize);
+		for (size_t i = 0; i < data->data.size(); ++i)
+			data->data[i] = pattern::at(i);
+		vector<uint8_t> bottom = verity_level(data->data);
+		vector<uint8_t> top = verity_level(bottom);
+		hash->data = top;	// Top level first
+		hash->data.insert(hash->data.end(), bottom.begin(), bottom.end());
+
+		vector<uint8_t> root = verity_digest(&top[0]);
+		par.root_digest.assign(root.begin(), root.end());
+		par.salt = VeritySalt;
+		par.data_blocks = VerityBlocks;
+	}
+};
+
+// Read 'count' sectors from 'block', expecting 'want' bytes of pattern back
+bool verity_read(targets::verity& v, off_t block, size_t count, int want) {
+	vector<uint8_t> buf(count * BlockSize);
+	int got = v.read_blocks(block, &buf[0], count);
+	if (got != want) {
+		cout << "verity: read at sector " << block << " gave " << got
+			<< ", not " << want << "\n";
+		return false;
+	}
+	for (int i = 0; i < got; ++i) {
+		if (buf[i] != pattern::at(block * BlockSize + i)) {
+			cout << "verity: read at sector " << block << " differs at "
+				<< i << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+int test_verity() {
+	const size_t per = VerityBlockSize / BlockSize;	// Sectors per block
+	const int all = VerityBlocks * VerityBlockSize;
+	bool ok = true;
+
+	{
+		verity_tree t;
+		targets::verity v(t.data_ptr, t.hash_ptr, t.par);
+		// Everything; across the first and second hash block's data; and
+		// unaligned, into the third
+		bool good = verity_read(v, 0, VerityBlocks * per, all)
+			&& verity_read(v, 126 * per, 5 * per, 5 * VerityBlockSize)
+			&& verity_read(v, 255 * per + 3, 2 * per, 2 * VerityBlockSize);
+		uint8_t part[100];
+		good = good && v.read(299 * per + 5, part, 17, sizeof(part))
+			== int(sizeof(part))
+			&& part[0] == pattern::at((299 * per + 5) * BlockSize + 17);
+		// Past the end, short and then nothing
+		good = good && verity_read(v, 298 * per, 5 * per,
+			2 * VerityBlockSize) && verity_read(v, VerityBlocks * per, per, 0);
+		cout << "verity clean reads: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+	}
+
+	{
+		// A bad data block cuts reads short, or fails them
+		verity_tree t;
+		t.data->data[200 * VerityBlockSize + 1234] ^= 1;
+		targets::verity v(t.data_ptr, t.hash_ptr, t.par);
+		uint8_t sector[BlockSize];
+		bool good = verity_read(v, 0, VerityBlocks * per,
+				200 * VerityBlockSize)
+			&& verity_read(v, 199 * per + 1, 2 * per,
+				per * BlockSize - BlockSize)
+			&& verity_read(v, 200 * per, per, -EIO)
+			&& v.read(200 * per + 2, sector, 0, BlockSize) == -EIO
+			&& verity_read(v, 201 * per, per, VerityBlockSize);
+		cout << "verity tampered data: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+	}
+
+	{
+		// A bad hash block fails everything under it, and only that
+		verity_tree t;
+		t.hash->data[3 * VerityBlockSize + 99] ^= 1;
+		targets::verity v(t.data_ptr, t.hash_ptr, t.par);
+		bool good = verity_read(v, 0, VerityBlocks * per, 256 * VerityBlockSize)
+			&& verity_read(v, 256 * per, per, -EIO)
+			&& verity_read(v, 128 * per, 2 * per, 2 * VerityBlockSize);
+		cout << "verity tampered hash: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+	}
+
+	{
+		// Data that ends early is as good as it goes
+		verity_tree t;
+		t.data->data.resize(150 * VerityBlockSize + 1000);
+		targets::verity v(t.data_ptr, t.hash_ptr, t.par);
+		bool good = verity_read(v, 0, VerityBlocks * per,
+				150 * VerityBlockSize)
+			&& verity_read(v, 150 * per, per, -EIO);
+		cout << "verity short data: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+	}
+	return ok ? 0 : 1;
+}
+
+/***** The SSD cache, across reopening *****/
+
+const size_t CachePage = 8 * BlockSize, CachePages = 64, CacheUsed = 16;
+
+// Read the pages in use, checking what comes back
+bool cache_read(targets::ssd_cache& cache) {
+	vector<uint8_t> buf(CacheUsed * CachePage);
+	if (cache.read_blocks(0, &buf[0], buf.size() / BlockSize)
+			!= int(buf.size()))
+		return false;
+	for (size_t i = 0; i < buf.size(); ++i)
+		if (buf[i] != pattern::at(i))
+			return false;
+	return true;
+}
+
+int test_ssd_cache() {
+	char dir[] = "/tmp/lvmfuse-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string path = string(dir) + "/cache";
+	target::ptr source(new pattern());
+	const size_t bytes = CachePages * CachePage;
+	bool ok = true;
+
+	// Pages get in once they've been missed twice
+	uint64_t admitted;
+	{
+		targets::ssd_cache cache(source, path, "pv0 seqno 1", bytes);
+		bool good = cache_read(cache) && cache_read(cache)
+			&& cache_read(cache);
+		targets::ssd_cache::stats st = cache.statistics();
+		admitted = st.admitted;
+		good = good && admitted > CacheUsed / 2 && st.hits >= admitted;
+
+		// Only one user at a time
+		try {
+			targets::ssd_cache again(source, path, "pv0 seqno 1", bytes);
+			good = false;
+		} catch (targets::ssd_cache::exception& e) { }
+		cout << "ssd cache fill: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+	}
+
+	{
+		targets::ssd_cache cache(source, path, "pv0 seqno 1", bytes);
+		bool good = cache_read(cache)
+			&& cache.statistics().hits == admitted;
+		cout << "ssd cache reopened: " << (good ? "ok" : "FAILED") << "\n";
+		ok = ok && good;
+	}
+
+	{
+		targets::ssd_cache cache(source, path, "pv0 seqno 2", bytes);
+		bool good = cache_read(cache) && cache.statistics().hits == 0;
+		good = good && cache_read(cache) && cache_read(cache);
+		admitted = cache.statistics().admitted;
+		cout << "ssd cache with a new key: " << (good ? "ok" : "FAILED")
+			<< "\n";
+		ok = ok && good;
+	}
+
+	// Spoil the first cached page. Slots of 16 bytes follow the header
+	// page, each starting with its page number, and data follows them.
+	int fd = open(path.c_str(), O_RDWR);
+	size_t slot_bytes = (CachePages * 16 + CachePage - 1) / CachePage
+		* CachePage;
+	size_t used = 0;
+	for (uint64_t page = 0; used < CachePages; ++used) {
+		pread(fd, &page, sizeof(page), CachePage + used * 16);
+		if (page)
+			break;
+	}
+	uint8_t byte = 0;
+	off_t where = CachePage + slot_bytes + used * CachePage + 1000;
+	pread(fd, &byte, 1, where);
+	byte ^= 0x40;
+	pwrite(fd, &byte, 1, where);
+	close(fd);
+
+	{
+		targets::ssd_cache cache(source, path, "pv0 seqno 2", bytes);
+		bool good = cache_read(cache);
+		targets::ssd_cache::stats st = cache.statistics();
+		good = good && st.corrupt == 1 && st.hits == admitted - 1;
+		cout << "ssd cache with a bad page: " << (good ? "ok" : "FAILED")
+			<< "\n";
+		ok = ok && good;
+	}
+
+	unlink(path.c_str());
+	rmdir(dir);
+	return ok ? 0 : 1;
+}
+
+/***** Exporting, and the zero and difference scans it uses *****/
+
+bool memscan_check() {
+	vector<uint8_t> a(BlockSize * 8 + 64), b(a.size());
+	const size_t sizes[] = { 0, 1, 7, 8, 15, 16, 31, 32, 33, 63, 64, 65, 100,
+		BlockSize, BlockSize * 8 + 33 };
+	for (size_t si = 0; si < sizeof(sizes) / sizeof(*sizes); ++si) {
+		for (size_t off = 0; off < 8; ++off) {
+			size_t size = sizes[si];
+			if (!all_zero(&a[off], size)
+					|| first_difference(&a[off], &b[off], size) != size)
+				return false;
+			for (size_t k = 0; k < size; ++k) {
+				a[off + k] = 0x80 >> (k % 8);
+				bool good = !all_zero(&a[off], size)
+					&& first_difference(&a[off], &b[off], size) == k;
+				a[off + k] = 0;
+				if (!good)
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+const size_t ExportRun = 64 * 1024, ExportRuns = 128;
+
+// Runs of data, holes and written zeroes
+int export_source(const string& path, uint64_t& zero) {
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	vector<uint8_t> run(ExportRun);
+	zero = 0;
+	for (size_t r = 0; r < ExportRuns; ++r) {
+		off_t pos = off_t(r) * ExportRun;
+		int kind = r % 5;
+		if (kind == 1 || kind == 4) {
+			zero += ExportRun;
+			continue;
+		}
+		for (size_t i = 0; i < run.size(); ++i)
+			run[i] = kind == 3 ? 0 : pattern::at(pos + i);
+		if (kind == 3)
+			zero += ExportRun;
+		if (pwrite(fd, &run[0], run.size(), pos) != ssize_t(run.size()))
+			return -1;
+	}
+	if (ftruncate(fd, off_t(ExportRuns) * ExportRun) == -1)
+		return -1;
+	return fd;
+}
+
+// Bytes the filesystem keeps as holes
+uint64_t hole_bytes(int fd, off_t size) {
+	uint64_t holes = 0;
+	for (off_t pos = 0; pos < size; ) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data == -1)
+			data = size;
+		holes += data - pos;
+		if (data >= size)
+			break;
+		pos = lseek(fd, data, SEEK_HOLE);
+	}
+	return holes;
+}
+
+struct last_progress : public exporter::reporter {
+	exporter::progress p;
+	virtual void report(const exporter::progress& now) { p = now; }
+};
+
+int test_export() {
+	bool ok = memscan_check();
+	cout << "all_zero and first_difference: " << (ok ? "ok" : "FAILED")
+		<< "\n";
+
+	char dir[] = "/tmp/lvmfuse-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string src_path = string(dir) + "/source", dst_path = string(dir) + "/out";
+	uint64_t zero;
+	int sfd = export_source(src_path, zero);
+	if (sfd == -1) {
+		perror("export source");
+		return 1;
+	}
+	const off_t size = off_t(ExportRuns) * ExportRun;
+	uint64_t holes = hole_bytes(sfd, size);
+	vector<uint8_t> want(size), got(size);
+	pread(sfd, &want[0], size, 0);
+	targets::file source(sfd);
+
+	// Into a new file, and over one full of something else
+	for (int offload = 0; offload < 2; ++offload) {
+		for (int fresh = 1; fresh >= 0; --fresh) {
+			int dfd = open(dst_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+			if (!fresh) {
+				vector<uint8_t> junk(size, 0xa5);
+				pwrite(dfd, &junk[0], size, 0);
+			}
+			exporter::options opts;
+			opts.chunk_bytes = 1 << 20;
+			opts.workers = 4;
+			opts.offload = offload;
+			exporter ex(source, size, opts);
+			last_progress r;
+			bool good = ex.run(dfd, &r) == 0
+				&& pread(dfd, &got[0], size, 0) == ssize_t(size)
+				&& got == want
+				&& r.p.done == uint64_t(size)
+				&& r.p.written + r.p.copied + r.p.zero == uint64_t(size);
+			// Data the kernel copies isn't looked at for zeroes
+			if (fresh)
+				good = good && r.p.zero == (r.p.copied ? holes : zero);
+			cout << "export " << (offload ? "with" : "without")
+				<< " offload, into a " << (fresh ? "new file" : "used one")
+				<< ": " << (good ? "ok" : "FAILED") << "\n";
+			ok = ok && good;
+			close(dfd);
+		}
+	}
+
+	unlink(src_path.c_str());
+	unlink(dst_path.c_str());
+	rmdir(dir);
+	return ok ? 0 : 1;
+}
+
+/***** Writing metadata as LVM text and as JSON *****/
+
+// Quotes, a backslash and a tab, in strings long enough to be scanned a
+// vector at a time. A comment and a string mention 'seqno' too.
+const char SampleConfig[] =
+	"# Generated by LVM2\n"
+	"contents = \"Text Format Volume Group\"\n"
+	"version = 1\n"
+	"description = \"Created \\\"after\\\" running 'lvcreate', seqno = 9\"\n"
+	"\n"
+	"vg0 {\n"
+	"\tid = \"Q2yGhz-dv3T-1tFQ-9mMa-yQbs-hVmy-bOALTo\"\n"
+	"\t# seqno = 7, before the real one\n"
+	"\tseqno = 42\n"
+	"\tformat = \"lvm2\"\n"
+	"\tstatus = [\"RESIZEABLE\", \"READ\", \"WRITE\"]\n"
+	"\textent_size = 8192\n"
+	"\tphysical_volumes {\n"
+	"\t\tpv0 {\n"
+	"\t\t\tid = \"a \\\\ path\twith a tab in it, sixteen bytes on\"\n"
+	"\t\t\tdevice = \"/dev/sda1\"\n"
+	"\t\t\tpe_start = 2048\n"
+	"\t\t\tpe_count = 100\n"
+	"\t\t}\n"
+	"\t}\n"
+	"\tlogical_volumes {\n"
+	"\t\tdata {\n"
+	"\t\t\tid = \"lv-uuid\"\n"
+	"\t\t\tstatus = [\"READ\", \"WRITE\", \"VISIBLE\"]\n"
+	"\t\t\tsegment_count = 1\n"
+	"\t\t\tsegment1 {\n"
+	"\t\t\t\tstart_extent = 0\n"
+	"\t\t\t\textent_count = 50\n"
+	"\t\t\t\ttype = \"striped\"\n"
+	"\t\t\t\tstripe_count = 1\n"
+	"\t\t\t\tstripes = [\"pv0\", 0]\n"
+	"\t\t\t}\n"
+	"\t\t}\n"
+	"\t}\n"
+	"}\n";
+
+// How the dumper wrote LVM text before it used a writer
+struct reference_dumper {
+	ostream& os;
+	int indent;
+
+	reference_dumper(ostream& os) : os(os), indent(0) { }
+
+	void tab() {
+		for (int i = 0; i < indent; ++i)
+			os << "    ";
+	}
+
+	void dump(const string& s) {
+		os << "\"";
+		for (string::const_iterator it = s.begin(); it != s.end(); ++it) {
+			if (*it == '"' || *it == '\\')
+				os << "\\";
+			os << *it;
+		}
+		os << "\"";
+	}
+
+	void dump(const array_t& a) {
+		os << "[";
+		for (array_t::const_iterator it = a.begin(); it != a.end(); ++it) {
+			if (it != a.begin())
+				os << ", ";
+			dump(*it);
+		}
+		os << "]";
+	}
+
+	void dump(const value& v) {
+		switch (v.type()) {
+			case value::Integer: os << v.integer(); break;
+			case value::String: dump(v.string()); break;
+			case value::Array: dump(v.array()); break;
+			case value::Section: dump(v.section()); break;
+		}
+	}
+
+	void dump(const section_t& m) {
+		for (section_t::const_iterator it = m.begin(); it != m.end(); ++it) {
+			tab();
+			os << it->first;
+			if (it->second.type() == value::Section) {
+				os << " {\n";
+				++indent;
+				dump(it->second);
+				--indent;
+				tab();
+				os << "}";
+			} else {
+				os << " = ";
+				dump(it->second);
+			}
+			os << "\n";
+		}
+	}
+};
+
+// A strict JSON reader, that only says whether it's well formed
+struct json_checker {
+	const char *p;
+
+	json_checker(const string& s) : p(s.c_str()) { }
+
+	void space() {
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			++p;
+	}
+
+	bool string() {
+		if (*p++ != '"')
+			return false;
+		for (; *p != '"'; ++p) {
+			if (static_cast<unsigned char>(*p) < 0x20)
+				return false;	// including the end
+			if (*p != '\\')
+				continue;
+			++p;
+			if (*p == 'u') {
+				for (int i = 0; i < 4; ++i)
+					if (!isxdigit(*++p))
+						return false;
+			} else if (!strchr("\"\\/bfnrt", *p) || !*p) {
+				return false;
+			}
+		}
+		++p;
+		return true;
+	}
+
+	bool number() {
+		if (*p == '-')
+			++p;
+		if (!isdigit(*p))
+			return false;
+		if (*p == '0')
+			++p;
+		while (isdigit(*p))
+			++p;
+		return true;
+	}
+
+	bool value() {
+		space();
+		if (*p == '{' || *p == '[') {
+			char close = *p++ == '{' ? '}' : ']';
+			space();
+			if (*p == close) {
+				++p;
+				return true;
+			}
+			while (true) {
+				if (close == '}') {
+					space();
+					if (!string())
+						return false;
+					space();
+					if (*p++ != ':')
+						return false;
+				}
+				if (!value())
+					return false;
+				space();
+				if (*p == close) {
+					++p;
+					return true;
+				}
+				if (*p++ != ',')
+					return false;
+			}
+		}
+		if (*p == '"')
+			return string();
+		if (!strncmp(p, "true", 4) || !strncmp(p, "null", 4)) {
+			p += 4;
+			return true;
+		}
+		if (!strncmp(p, "false", 5)) {
+			p += 5;
+			return true;
+		}
+		return number();
+	}
+
+	bool document() {
+		if (!value())
+			return false;
+		space();
+		return !*p;
+	}
+};
+
+int test_writer() {
+	string text(SampleConfig);
+	parser parser(text);
+	section_p config(parser.vg_config());
+	bool ok = true;
+
+	ostringstream now, before;
+	dumper(now).dump(*config);
+	reference_dumper(before).dump(*config);
+	bool good = now.str() == before.str();
+	cout << "dumper output: " << (good ? "ok" : "FAILED") << "\n";
+	ok = ok && good;
+
+	// Twice over, as writers are reused
+	writer w(writer::JSON);
+	good = true;
+	for (int i = 0; i < 2; ++i) {
+		w.clear();
+		w.write(*config);
+		good = good && json_checker(w.str()).document()
+			&& w.str().find("\\u0009") != string::npos;
+	}
+	lvm::config vg(config);
+	vector<const lvm::config*> vgs(1, &vg);
+	string report = json_report(vgs);
+	good = good && json_checker(report).document()
+		&& report.find("\"vg_seqno\"") != string::npos;
+	cout << "JSON metadata and report: " << (good ? "ok" : "FAILED") << "\n";
+	ok = ok && good;
+	return ok ? 0 : 1;
+}
+
+/***** Finding values in metadata without parsing it all *****/
+
+int test_query() {
+	string conf(SampleConfig);
+	query q(conf);
+	int i = 0;
+	string str;
+	value v;
+	bool ok = true;
+
+	// Down through sections, to each kind of value
+	bool good = q.integer("vg0/physical_volumes/pv0/pe_count", i) && i == 100
+		&& q.string("vg0/physical_volumes/pv0/device", str)
+		&& str == "/dev/sda1"
+		&& q.find("vg0/logical_volumes/data/segment1/stripes", v)
+		&& v.type() == value::Array && v.array().size() == 2
+		&& v.array()[0].string() == "pv0" && v.array()[1].integer() == 0
+		&& q.find("vg0/logical_volumes/data/segment1", v)
+		&& v.type() == value::Section
+		&& v.section().find("extent_count")->second.integer() == 50;
+	cout << "query nested paths: " << (good ? "ok" : "FAILED") << "\n";
+	ok = ok && good;
+
+	// Not the seqno in the comment, nor the one in the description
+	good = q.integer("*/seqno", i) && i == 42 && !q.find("seqno", v)
+		&& q.string("*/id", str)
+		&& str == "Q2yGhz-dv3T-1tFQ-9mMa-yQbs-hVmy-bOALTo";
+	cout << "query */seqno: " << (good ? "ok" : "FAILED") << "\n";
+	ok = ok && good;
+
+	// Absent, below something that isn't a section, or of another type
+	good = !q.find("vg0/nothing", v)
+		&& !q.find("vg0/physical_volumes/pv1/pe_count", v)
+		&& !q.find("vg0/seqno/more", v)
+		&& !q.integer("vg0/format", i) && !q.string("vg0/seqno", str);
+	cout << "query missing keys: " << (good ? "ok" : "FAILED") << "\n";
+	ok = ok && good;
+	return ok ? 0 : 1;
+}
+
+} // anonymous namespace
+
+// "test xts", "test nbd", "test raid", "test verity", "test ssd-cache",
+// "test export", "test writer" and "test query" check those against known
+// answers
 int main(int argc, char *argv[]) {
+	if (argc > 1 && string(argv[1]) == "xts")
+		return test_xts();
+	if (argc > 1 && string(argv[1]) == "nbd")
+		return test_nbd();
+	if (argc > 1 && string(argv[1]) == "raid")
+		return test_raid();
+	if (argc > 1 && string(argv[1]) == "verity")
+		return test_verity();
+	if (argc > 1 && string(argv[1]) == "ssd-cache")
+		return test_ssd_cache();
+	if (argc > 1 && string(argv[1]) == "export")
+		return test_export();
+	if (argc > 1 && string(argv[1]) == "writer")
+		return test_writer();
+	if (argc > 1 && string(argv[1]) == "query")
+		return test_query();
+
 	target::ptr file(new targets::file("/dev/disk0s8"));
 	target::ptr linear(new targets::linear(file, 187 * 65536 + 2048));
 	fuse_serve("mnt", *linear, 1242 * 65536);
 	return 0;
-	
+
 	try {
 		pvdevice pv(argv[1]);
 		std::string conftext(pv.vg_config());
-		
+
 		parser parser(conftext);
 		section_p config(parser.vg_config());
-		
+
 		dumper dumper(cout);
 		dumper.dump(*config);
 	} catch (std::exception& e) {